@@ -0,0 +1,122 @@
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "civetta.h"
+
+// Compares blocking handlers on a thread pool with coroutine handlers on a
+// few worker threads. Every handler waits for a while, as if calling a slow
+// upstream service, and all connections are opened at once.
+// Build with "make coroutine_bench", which compiles with -std=c++20.
+
+static const int delay_ms = 100;
+
+// Opens the connections, sends one request on each and waits for every
+// response. Returns the number of complete responses.
+static int load(int port, int connections) {
+  static const char request[] = "GET /slow HTTP/1.0\r\n\r\n";
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  int epfd = epoll_create1(0);
+  std::vector<bool> sent(connections, false);
+  for (int i = 0; i < connections; i++) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    fcntl(fd, F_SETFL, O_NONBLOCK);
+    connect(fd, (struct sockaddr *)&sin, sizeof(sin));
+    struct epoll_event event;
+    event.events = EPOLLOUT | EPOLLIN;
+    event.data.u64 = ((uint64_t)i << 32) | (uint32_t)fd;
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &event);
+  }
+
+  int pending = connections, done = 0, n;
+  struct epoll_event events[256];
+  char buf[4096];
+  while (pending > 0 && (n = epoll_wait(epfd, events, 256, 10000)) > 0) {
+    for (int e = 0; e < n; e++) {
+      int i = (int)(events[e].data.u64 >> 32), fd = (int)(uint32_t)events[e].data.u64;
+      if (!sent[i]) {
+        if (!(events[e].events & EPOLLOUT))
+          continue;
+        sent[i] = true;
+        send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+        struct epoll_event event = events[e];
+        event.events = EPOLLIN;
+        epoll_ctl(epfd, EPOLL_CTL_MOD, fd, &event);
+        continue;
+      }
+      ssize_t len = recv(fd, buf, sizeof(buf), 0);
+      if (len > 0) {
+        if (memcmp(buf, "HTTP/1.0 200", 12) == 0)
+          done++;
+        continue;
+      }
+      if (len < 0 && errno == EAGAIN)
+        continue;
+      close(fd);
+      pending--;
+    }
+  }
+  close(epfd);
+  return done;
+}
+
+static void report(const char *name, int port, int connections) {
+  auto start = std::chrono::steady_clock::now();
+  int done = load(port, connections);
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  std::cout << name << ": " << done << "/" << connections << " responses in " << elapsed.count() << " s, "
+            << (long)(done / elapsed.count()) << " requests/sec" << std::endl;
+}
+
+static Civetta::Task slow(Civetta::Request &, Civetta::Response &res) {
+  co_await Civetta::Sleep(std::chrono::milliseconds(delay_ms));
+  res << "ok";
+}
+
+int main(int argc, char *argv[]) {
+  int connections = argc > 1 ? atoi(argv[1]) : 10000;
+  const char *pool_threads = argc > 2 ? argv[2] : "500";
+
+  // Each connection needs a descriptor on both ends
+  struct rlimit limit;
+  getrlimit(RLIMIT_NOFILE, &limit);
+  limit.rlim_cur = limit.rlim_max;
+  setrlimit(RLIMIT_NOFILE, &limit);
+
+  {
+    const char *options[] = {"listening_ports", "18095", "num_threads", pool_threads, 0};
+    Civetta::Server server(options);
+    server.route("GET", "/slow", [](Civetta::Request &, Civetta::Response &res) {
+      std::this_thread::sleep_for(std::chrono::milliseconds(delay_ms));
+      res << "ok";
+    });
+    std::ostringstream name;
+    name << "blocking handlers, " << pool_threads << " threads";
+    report(name.str().c_str(), 18095, connections);
+  }
+  {
+    const char *options[] = {"listening_ports", "18096", "num_threads", "4", 0};
+    Civetta::Server server(options);
+    Civetta::routeTask(server, "GET", "/slow", slow);
+    report("coroutine handlers, 4 threads", 18096, connections);
+  }
+  return 0;
+}
@@ -0,0 +1,75 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <thread>
+#include <vector>
+
+#include "civetta.h"
+
+// Measures the latency from connect() to the response of a handler doing no
+// work, which is dominated by handing accepted sockets to worker threads.
+// Every client thread opens a new connection per request, so the socket
+// queue is hit once per request by an acceptor and once by a worker.
+
+static void client(int port, int requests, Civetta::Histogram *histogram) {
+  static const char request[] = "GET /ping HTTP/1.0\r\n\r\n";
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+  char buf[512];
+  for (int i = 0; i < requests; i++) {
+    auto start = std::chrono::steady_clock::now();
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0 &&
+        send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL) > 0) {
+      while (recv(fd, buf, sizeof(buf), 0) > 0) {
+      }
+    }
+    close(fd);
+    histogram->record(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+  }
+}
+
+// Usage: dispatch_bench [clients] [requests per client] [option value]...
+// where the options are civetweb ones, e.g. num_threads 32 num_acceptors 4.
+int main(int argc, char *argv[]) {
+  int clients = argc > 1 ? atoi(argv[1]) : 64;
+  int requests = argc > 2 ? atoi(argv[2]) : 500;
+
+  std::vector<const char *> options;
+  options.push_back("listening_ports");
+  options.push_back("18097");
+  for (int i = 3; i + 1 < argc; i += 2) {
+    options.push_back(argv[i]);
+    options.push_back(argv[i + 1]);
+  }
+  options.push_back(0);
+  Civetta::Server server(&options[0]);
+  server.route("GET", "/ping", [](Civetta::Request &, Civetta::Response &res) { res << "pong"; });
+
+  Civetta::Histogram histogram;
+  auto start = std::chrono::steady_clock::now();
+  std::vector<std::thread> pool;
+  for (int i = 0; i < clients; i++)
+    pool.push_back(std::thread(client, 18097, requests, &histogram));
+  for (size_t i = 0; i < pool.size(); i++)
+    pool[i].join();
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+
+  std::cout << clients << " clients";
+  for (size_t i = 2; i + 1 < options.size(); i += 2)
+    std::cout << ", " << options[i] << " " << options[i + 1];
+  std::cout << ": " << (long)(histogram.total() / elapsed.count()) << " connections/sec, p50 "
+            << histogram.percentile(50) << " us, p99 " << histogram.percentile(99) << " us, p99.9 "
+            << histogram.percentile(99.9) << " us" << std::endl;
+  return 0;
+}
@@ -0,0 +1,104 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "civetta.h"
+
+// Measures requests/sec for small static files over keep-alive, read from
+// disk on every request and served from the file cache. The files are in
+// the page cache either way: the difference is the stat, open, read and
+// close calls, and the headers formatted for every response.
+
+static const int kNumFiles = 100;
+
+static std::string fileName(const std::string &root, int i) { return root + "/" + std::to_string(i) + ".css"; }
+
+// Returns the body length of one response read from fd
+static long download(int fd, const std::string &request) {
+  char buf[16384];
+  send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+  std::string response;
+  ssize_t len;
+  size_t end;
+  while ((end = response.find("\r\n\r\n")) == std::string::npos && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    response.append(buf, len);
+  if (end == std::string::npos)
+    return -1;
+  size_t cl = response.find("Content-Length: ");
+  long body = cl == std::string::npos ? 0 : atol(response.c_str() + cl + 16);
+  long left = body - (long)(response.size() - end - 4);
+  while (left > 0 && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    left -= len;
+  return left == 0 ? body : -1;
+}
+
+static void bench(const char *cache_size, int port, const std::string &root, int size, int requests) {
+  std::string ports = std::to_string(port);
+  const char *options[] = {"listening_ports", ports.c_str(), "document_root", root.c_str(), "enable_keep_alive",
+                           "yes", "tcp_nodelay", "yes", "file_cache_size", cache_size, 0};
+  Civetta::Server server(options);
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    std::cerr << "cannot connect to port " << port << std::endl;
+    return;
+  }
+
+  std::string paths[kNumFiles];
+  for (int i = 0; i < kNumFiles; i++)
+    paths[i] = "GET /" + std::to_string(i) + ".css HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; i++) {
+    if (download(fd, paths[i % kNumFiles]) != size) {
+      std::cerr << "short download" << std::endl;
+      break;
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  close(fd);
+
+  std::cout << "file_cache_size " << cache_size << ", " << size << " bytes: " << requests / seconds << " requests/s";
+  struct mg_file_cache_stats stats;
+  if (mg_get_file_cache_stats(server.getContext(), &stats))
+    std::cout << ", " << stats.hits << " hits, " << stats.misses << " misses";
+  std::cout << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  int requests = argc > 1 ? atoi(argv[1]) : 50000;
+  char root[] = "/tmp/file_cache_benchXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    std::cerr << "cannot create a temporary directory" << std::endl;
+    return 1;
+  }
+
+  for (int size : {1024, 16384}) {
+    std::string data(size, 'x');
+    for (int i = 0; i < kNumFiles; i++) {
+      int fd = open(fileName(root, i).c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+      if (write(fd, data.data(), data.size()) < 0)
+        std::cerr << "cannot write " << fileName(root, i) << std::endl;
+      close(fd);
+    }
+    bench("0", 18102, root, size, requests);
+    bench("67108864", 18103, root, size, requests);
+  }
+
+  for (int i = 0; i < kNumFiles; i++)
+    unlink(fileName(root, i).c_str());
+  rmdir(root);
+  return 0;
+}
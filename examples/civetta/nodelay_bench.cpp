@@ -0,0 +1,64 @@
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "civetta.h"
+
+// Measures the latency of keep-alive requests to a handler streaming its
+// response in two small writes. Without tcp_nodelay, the second write waits
+// for the client to acknowledge the first one, which delayed ACKs hold back
+// for tens of milliseconds.
+
+static void bench(const char *nodelay, int port, int requests) {
+  std::string ports = std::to_string(port);
+  const char *options[] = {"listening_ports", ports.c_str(), "enable_keep_alive", "yes", "tcp_nodelay", nodelay, 0};
+  Civetta::Server server(options);
+  server.route("GET", "/stream", [](Civetta::Request &, Civetta::Response &res) {
+    res << "head";
+    res.flush();
+    res << "tail";
+  });
+
+  static const char request[] = "GET /stream HTTP/1.1\r\nHost: localhost\r\n\r\n";
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    std::cerr << "cannot connect to port " << port << std::endl;
+    return;
+  }
+
+  Civetta::Histogram histogram;
+  char buf[4096];
+  for (int i = 0; i < requests; i++) {
+    auto start = std::chrono::steady_clock::now();
+    send(fd, request, sizeof(request) - 1, MSG_NOSIGNAL);
+    // The response ends with the last, empty, chunk
+    std::string response;
+    ssize_t len;
+    while (response.find("\r\n0\r\n\r\n") == std::string::npos && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+      response.append(buf, len);
+    histogram.record(
+        std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start).count());
+  }
+  close(fd);
+
+  std::cout << "tcp_nodelay " << nodelay << ": p50 " << histogram.percentile(50) << " us, p99 "
+            << histogram.percentile(99) << " us" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  int requests = argc > 1 ? atoi(argv[1]) : 200;
+  bench("no", 18098, requests);
+  bench("yes", 18099, requests);
+  return 0;
+}
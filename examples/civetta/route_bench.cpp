@@ -0,0 +1,53 @@
+#include <chrono>
+#include <iostream>
+#include <sstream>
+
+#include "civetta.h"
+
+// Measures requests/sec against servers with a growing number of routes.
+// Half of the routes are plain paths, the other half carry a capture group,
+// and every request hits the last registered route.
+
+static double bench(int port, int num_routes, int num_requests) {
+  std::ostringstream port_str;
+  port_str << port;
+  std::string ports = port_str.str();
+  const char *options[] = {"listening_ports", ports.c_str(), "num_threads", "4", 0};
+
+  Civetta::Server server(options);
+  for (int i = 0; i < num_routes; i++) {
+    std::ostringstream url;
+    url << "/api/v1/resource" << i;
+    if (i % 2)
+      url << "/(\\d+)";
+    server.route("GET", url.str(), [](Civetta::Request &, Civetta::Response &res) { res << "ok"; });
+  }
+
+  std::ostringstream request;
+  request << "GET /api/v1/resource" << num_routes - 1 << ((num_routes - 1) % 2 ? "/42" : "") << " HTTP/1.0\r\n\r\n";
+
+  char ebuf[100];
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < num_requests; i++) {
+    struct mg_connection *conn =
+        mg_download("127.0.0.1", port, 0, ebuf, sizeof(ebuf), "%s", request.str().c_str());
+    if (conn == NULL) {
+      std::cerr << "request failed: " << ebuf << std::endl;
+      return 0;
+    }
+    mg_close_connection(conn);
+  }
+  std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+  return num_requests / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  int num_requests = argc > 1 ? atoi(argv[1]) : 2000;
+  int sizes[] = {10, 100, 1000};
+
+  for (int i = 0; i < 3; i++) {
+    double rps = bench(18090 + i, sizes[i], num_requests);
+    std::cout << sizes[i] << " routes: " << (long)rps << " requests/sec" << std::endl;
+  }
+  return 0;
+}
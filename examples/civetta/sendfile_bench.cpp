@@ -0,0 +1,111 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "civetta.h"
+
+// Measures the throughput of static file downloads over keep-alive, copying
+// through a user space buffer and with sendfile(). The files are 1 KB, 1 MB
+// and 1 GB; pass a smaller maximum size in bytes to skip the largest.
+// tcp_nodelay keeps small files from waiting on delayed ACKs.
+
+static const long long sizes[] = {1LL << 10, 1LL << 20, 1LL << 30};
+
+static void make_file(const std::string &path, long long size) {
+  int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  char buf[65536];
+  for (size_t i = 0; i < sizeof(buf); i++)
+    buf[i] = 'a' + i % 26;
+  for (long long left = size; left > 0; left -= sizeof(buf))
+    if (write(fd, buf, left < (long long)sizeof(buf) ? left : sizeof(buf)) < 0)
+      break;
+  close(fd);
+}
+
+// Returns the body length of one response read from fd
+static long long download(int fd, const std::string &request) {
+  static char buf[1 << 16];
+  send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+  std::string headers;
+  ssize_t len = 0;
+  size_t end;
+  while ((end = headers.find("\r\n\r\n")) == std::string::npos && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    headers.append(buf, len);
+  if (end == std::string::npos)
+    return -1;
+  size_t cl = headers.find("Content-Length: ");
+  long long body = cl == std::string::npos ? 0 : atoll(headers.c_str() + cl + 16);
+  long long left = body - (long long)(headers.size() - end - 4);
+  while (left > 0 && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    left -= len;
+  return left == 0 ? body : -1;
+}
+
+static void bench(const char *sendfile, int port, const std::string &root, long long max_size) {
+  std::string ports = std::to_string(port);
+  const char *options[] = {"listening_ports", ports.c_str(), "document_root", root.c_str(), "enable_keep_alive",
+                           "yes", "tcp_nodelay", "yes", "enable_sendfile", sendfile, 0};
+  Civetta::Server server(options);
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    std::cerr << "cannot connect to port " << port << std::endl;
+    return;
+  }
+
+  for (long long size : sizes) {
+    if (size > max_size)
+      break;
+    std::string request = "GET /" + std::to_string(size) + ".bin HTTP/1.1\r\nHost: localhost\r\n\r\n";
+    // About 2 GB per size, at least 3 requests
+    long long requests = (2LL << 30) / size < 3 ? 3 : (2LL << 30) / size;
+    if (requests > 100000)
+      requests = 100000;
+    download(fd, request);
+    auto start = std::chrono::steady_clock::now();
+    for (long long i = 0; i < requests; i++) {
+      if (download(fd, request) != size) {
+        std::cerr << "short download of " << size << " bytes" << std::endl;
+        close(fd);
+        return;
+      }
+    }
+    double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "enable_sendfile " << sendfile << ", " << size << " bytes: " << requests / seconds
+              << " requests/s, " << requests * size / seconds / (1 << 20) << " MB/s" << std::endl;
+  }
+  close(fd);
+}
+
+int main(int argc, char *argv[]) {
+  long long max_size = argc > 1 ? atoll(argv[1]) : sizes[2];
+  char root[] = "/tmp/sendfile_benchXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    std::cerr << "cannot create a temporary directory" << std::endl;
+    return 1;
+  }
+  for (long long size : sizes)
+    if (size <= max_size)
+      make_file(std::string(root) + "/" + std::to_string(size) + ".bin", size);
+
+  bench("no", 18100, root, max_size);
+  bench("yes", 18101, root, max_size);
+
+  for (long long size : sizes)
+    unlink((std::string(root) + "/" + std::to_string(size) + ".bin").c_str());
+  rmdir(root);
+  return 0;
+}
@@ -0,0 +1,103 @@
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <iostream>
+#include <string>
+
+#include "civetta.h"
+
+// Measures requests/sec for directory URIs over keep-alive, with and without
+// the stat cache. Each directory holds an index.htm, so every request probes
+// the directory, index.html and index.htm, and the .gz variants the client
+// accepts, before the file is read.
+
+static const int kNumFiles = 100;
+
+static std::string dirName(const std::string &root, int i) { return root + "/" + std::to_string(i); }
+
+// Returns the body length of one response read from fd
+static long download(int fd, const std::string &request) {
+  char buf[16384];
+  send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+  std::string response;
+  ssize_t len;
+  size_t end;
+  while ((end = response.find("\r\n\r\n")) == std::string::npos && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    response.append(buf, len);
+  if (end == std::string::npos)
+    return -1;
+  size_t cl = response.find("Content-Length: ");
+  long body = cl == std::string::npos ? 0 : atol(response.c_str() + cl + 16);
+  long left = body - (long)(response.size() - end - 4);
+  while (left > 0 && (len = recv(fd, buf, sizeof(buf), 0)) > 0)
+    left -= len;
+  return left == 0 ? body : -1;
+}
+
+static void bench(const char *stat_cache, int port, const std::string &root, int size, int requests) {
+  std::string ports = std::to_string(port);
+  const char *options[] = {"listening_ports", ports.c_str(), "document_root", root.c_str(), "enable_keep_alive",
+                           "yes", "tcp_nodelay", "yes", "enable_stat_cache", stat_cache, 0};
+  Civetta::Server server(options);
+
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(port);
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) != 0) {
+    std::cerr << "cannot connect to port " << port << std::endl;
+    return;
+  }
+
+  std::string paths[kNumFiles];
+  for (int i = 0; i < kNumFiles; i++)
+    paths[i] = "GET /" + std::to_string(i) + "/ HTTP/1.1\r\nHost: localhost\r\nAccept-Encoding: gzip\r\n\r\n";
+  auto start = std::chrono::steady_clock::now();
+  for (int i = 0; i < requests; i++) {
+    if (download(fd, paths[i % kNumFiles]) != size) {
+      std::cerr << "short download" << std::endl;
+      break;
+    }
+  }
+  double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+  close(fd);
+
+  std::cout << "enable_stat_cache " << stat_cache << ": " << requests / seconds << " requests/s" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  int requests = argc > 1 ? atoi(argv[1]) : 50000;
+  char root[] = "/tmp/stat_cache_benchXXXXXX";
+  if (mkdtemp(root) == NULL) {
+    std::cerr << "cannot create a temporary directory" << std::endl;
+    return 1;
+  }
+
+  const int size = 1024;
+  std::string data(size, 'x');
+  for (int i = 0; i < kNumFiles; i++) {
+    mkdir(dirName(root, i).c_str(), 0755);
+    int fd = open((dirName(root, i) + "/index.htm").c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (write(fd, data.data(), data.size()) < 0)
+      std::cerr << "cannot write " << dirName(root, i) << "/index.htm" << std::endl;
+    close(fd);
+  }
+  bench("no", 18104, root, size, requests);
+  bench("yes", 18105, root, size, requests);
+
+  for (int i = 0; i < kNumFiles; i++) {
+    unlink((dirName(root, i) + "/index.htm").c_str());
+    rmdir(dirName(root, i).c_str());
+  }
+  rmdir(root);
+  return 0;
+}
@@ -1,345 +1,1311 @@
-/* Copyright (c) 2013-2014 the Civetta developers
- * Copyright (c) 2004-2013 Sergey Lyubka
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy
- * of this software and associated documentation files (the "Software"), to deal
- * in the Software without restriction, including without limitation the rights
- * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
- * copies of the Software, and to permit persons to whom the Software is
- * furnished to do so, subject to the following conditions:
- *
- * The above copyright notice and this permission notice shall be included in
- * all copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
- * THE SOFTWARE.
- */
-
-#ifndef _CIVETTA_H
-#define _CIVETTA_H
-
-#ifdef _MSC_VER
-#pragma once
-#pragma warning(disable : 4251)  // Disable VC warning about dll linkage required
-                                 // (for private members?)
-#pragma warning(disable : 4275)  // Disable non dll-interface base class warning
-#endif
-
-#if defined(_MSC_VER) && defined(CIVETTA_USE_DLL)
-#ifdef CIVETTA_BUILD_DLL
-#define CIVETTA_EXPORT __declspec(dllexport)
-#else
-#define CIVETTA_EXPORT __declspec(dllimport)
-#endif
-#else
-#define CIVETTA_EXPORT
-#endif
-
-#include <map>
-#include <string>
-#include <functional>
-#include <iostream>
-#include <sstream>
-#include <vector>
-#include <regex>
-
-#include "civetweb.h"
-
-namespace Civetta {
-
-class Server;
-
-/**
-  Request is a wrapper for the clients requests
-*/
-class CIVETTA_EXPORT Request {
- public:
-  /**
-    Request constructor.
-    @param connection the request connection
-  */
-  Request(struct mg_connection *connection);
-  virtual ~Request();
-
-  /**
-    Information about the request.
-  */
-  const struct mg_request_info *request_info;
-
-  /**
-    Accessor for the request uri matches.
-    @return the uri route pattern matches
-  */
-  std::smatch getMatches();
-
-  /**
-     Gets a cookie.
-     @param cookieName - cookie name to get the value from
-     @param cookieValue - cookie value is returned using this reference
-     @puts the cookie value string that matches the cookie name in the _cookieValue string.
-     @returns the size of the cookie value string read.
-  */
-  int getCookie(const std::string &cookieName, std::string &cookieValue);
-
-  /**
-     Gets a header.
-     @param headerName - header name to get the value from
-     @returns a char array whcih contains the header value as
-     string
-  */
-  const char *getHeader(const std::string &headerName);
-  
-  /**
-     Gets a param.
-     Returns a query paramter contained in the supplied buffer.
-     The occurence value is a zero-based index of a particular key name.
-     This should not be confused with the index over all of the keys.
-     @param name the key to search for
-     @param the destination string
-     @param occurrence the occurrence of the selected name in the query (0 based).
-     @return true of key was found
-  */
-  bool getParam(const char *name, std::string &dst, size_t occurrence = 0);
-
-  /**
-     Gets a param as Array.
-     Returns array of strings containing the values passed in the varios occurrences of the param.
-     @param name the key to search for
-     @param the destination string
-     @param occurrence the occurrence of the selected name in the query (0 based).
-     @return true of key was found
-  */
-  std::vector<std::string> getParamArray(const char *name);
-  
-  /**
-     Gets a query string param.
-     Returns a query paramter contained in the supplied buffer.
-     The occurence value is a zero-based index of a particular key name.
-     This should not be confused with the index over all of the keys.
-     @param name the key to search for
-     @param the destination string
-     @param occurrence the occurrence of the selected name in the query (0 based).
-     @return true of key was found
-  */
-  bool getQueryParam(const char *name, std::string &dst, size_t occurrence = 0);
-
-  /**
-     Gets a query string param as Array.
-     Returns array of strings containing the values passed in the varios occurrences of the param.
-     @param name the key to search for
-     @param the destination string
-     @param occurrence the occurrence of the selected name in the query (0 based).
-     @return true of key was found
-  */
-  std::vector<std::string> getQueryParamArray(const char *name);
-
-  const char* getPostData();
-
-  std::vector<std::string> getUploads(std::string destination_path);
-
- protected:
-  char *postData;
-  std::map<std::string, std::vector<std::string> > values;
-  std::map<std::string, std::vector<std::string> > query;
-  struct mg_connection *connection;
-  std::smatch matches;
-  std::vector<std::string> upload_filepaths;
-
-  friend class Server;
-};
-
-class CIVETTA_EXPORT Response : public std::ostringstream {
- public:
-  /**
-    Some of the HTTP response codes
-  */
-  enum codes { OK = 200, NOT_FOUND = 404, FORBIDDEN = 403, SERVER_ERROR = 500, BAD_REQUEST = 400 };
-  Response();
-
-  /**
-    Test if the given header is present
-    @param string the header key
-    @return bool true if the header is set
-  */
-  bool hasHeader(std::string key);
-
-  /**
-     Sets the header
-     @param key the header key
-     @param value the header value
-   */
-  void setHeader(std::string key, std::string value);
-
-  /**
-     Get the data of the response, this will contain headers and body.
-     @return string the response data
-   */
-  std::string getData();
-
-  /**
-     Gets the response body.
-     @return string the response body
-   */
-  std::string getBody();
-
-  /**
-     Sets the cookie, note that you can only define one cookie by request for now.
-     @param string the key of the cookie
-     @param string value the cookie value
-   */
-  void setCookie(std::string key, std::string value);
-
-  /**
-     Sets the response code
-   */
-  void setCode(int code);
-
- protected:
-  int code;
-  std::map<std::string, std::string> headers;
-};
-
-typedef std::function<void(Request &request, Response &response)> Callback;
-
-/**
-  Basic class for embedded web server.  This has a URL mapping built-in.
- */
-class CIVETTA_EXPORT Server {
- public:
-  /**
-     Constructor.
-
-     This automatically starts the sever.
-     It is good practice to call getContext() after this in case there
-     were errors starting the server.
-
-     @param options - the web server options.
-     @param callbacks - optional web server callback methods.
-   */
-  Server(const char **options, const struct mg_callbacks *callbacks = 0);
-
-  /**
-     Destructor
-   */
-  virtual ~Server();
-
-  /**
-    Stops server and frees resources.
-  */
-  void close();
-
-  /**
-     Accessor for the server context.
-     @return the context or 0 if not running.
-  */
-  const struct mg_context *getContext() const { return context; }
-
-  /**
-     Registers a route to the server
-     @param string the method
-     @param string the url path
-     @param Callback the request handler for this route
-   */
-  Callback route(std::string httpMethod, std::string url, Callback callback);
-  
-  /**
-     Sets the routes prefix.
-   */
-  void setPrefix(std::string prefix);
-  void setUploadDestination(std::string upload_destination);
-  std::string getUploadDestination() const;
-
- protected:
-  struct mg_context *context;
-  std::map<std::string, Callback> routes;
-  std::string prefix;
-  std::string upload_destination;
-
- private:
-  /**
-     Handles the incomming request.
-     @param conn - the connection information
-     @param cbdata - pointer to the CivetHandler instance.
-     @returns 0 if implemented, false otherwise
-   */
-  int requestHandler(struct mg_connection *conn, void *cbdata);
-  static int globalHandler(struct mg_connection *conn, void *cbdata);
-
-  /**
-     Handles closing a request (internal handler)
-     @param conn - the connection information
-   */
-  static void closeHandler(struct mg_connection *conn);
-
-  static void uploadHandler(struct mg_connection *conn, const char *file_name);
-
-  /**
-     Stores the user provided close handler
-   */
-  void (*userCloseHandler)(struct mg_connection *conn);
-  void (*userUploadHandler)(struct mg_connection *conn, const char *filename);
-};
-
-class CIVETTA_EXPORT Util {
- public:
-  /**
-     Url decoder.
-     @param src buffer to be decoded
-     @param src_len length of buffer to be decoded
-     @param dst destination string
-     @param is_form_url_encoded true if form url encoded form-url-encoded data differs from URI encoding in a way that
-     it uses '+' as character for space, see RFC 1866 section 8.2.1 http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
-   */
-  static void urlDecode(const char *src, size_t src_len, std::string &dst, bool is_form_url_encoded = true);
-
-  /**
-     Url decoder.
-     @param src string to be decoded
-     @param dst destination string
-     @param is_form_url_encoded true if form url encoded form-url-encoded data differs from URI encoding in a way that
-     it uses '+' as character for space, see RFC 1866 section 8.2.1 http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
-   */
-  static void urlDecode(const std::string &src, std::string &dst, bool is_form_url_encoded = true);
-
-  /**
-     Url decoder.
-     @param src buffer to be decoded (0 terminated)
-     @param dst destination string
-     @param is_form_url_encoded true if form url encoded form-url-encoded data differs from URI encoding in a way that
-     it uses '+' as character for space, see RFC 1866 section 8.2.1 http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
-   */
-  static void urlDecode(const char *src, std::string &dst, bool is_form_url_encoded = true);
-
-  /**
-     Url encoder.
-     @param src buffer to be encoded
-     @param src_len length of buffer to be decoded
-     @param dst destination string
-     @param append true if string should not be cleared before encoding.
-   */
-  static void urlEncode(const char *src, size_t src_len, std::string &dst, bool append = false);
-
-  /**
-     Url encoder.
-     @param src buffer to be encoded (0 terminated)
-     @param dst destination string
-     @param append true if string should not be cleared before encoding.
-   */
-  static void urlEncode(const char *src, std::string &dst, bool append = false);
-
-  /**
-     Url encoder.
-     @param src buffer to be encoded
-     @param dst destination string
-     @param append true if string should not be cleared before
-     encoding.
-   */
-  static void urlEncode(const std::string &src, std::string &dst, bool append = false);
-};
-}  // namespace Civetta
-#endif  // _CIVETTA_H
+/* Copyright (c) 2013-2014 the Civetta developers
+ * Copyright (c) 2004-2013 Sergey Lyubka
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#ifndef _CIVETTA_H
+#define _CIVETTA_H
+
+#ifdef _MSC_VER
+#pragma once
+#pragma warning(disable : 4251)  // Disable VC warning about dll linkage required
+                                 // (for private members?)
+#pragma warning(disable : 4275)  // Disable non dll-interface base class warning
+#endif
+
+#if defined(_MSC_VER) && defined(CIVETTA_USE_DLL)
+#ifdef CIVETTA_BUILD_DLL
+#define CIVETTA_EXPORT __declspec(dllexport)
+#else
+#define CIVETTA_EXPORT __declspec(dllimport)
+#endif
+#else
+#define CIVETTA_EXPORT
+#endif
+
+#include <atomic>
+#include <chrono>
+#include <map>
+#include <string>
+#include <functional>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <regex>
+
+#if defined(__cpp_impl_coroutine)
+#include <condition_variable>
+#include <coroutine>
+#include <cstddef>
+#include <mutex>
+#include <queue>
+#include <thread>
+#endif
+
+#include "civetweb.h"
+
+namespace Civetta {
+
+class Server;
+class Deferred;
+
+/**
+  A view into a string owned by someone else, usually the connection buffer.
+  It is only valid while the request it came from is being handled.
+*/
+struct CIVETTA_EXPORT Slice {
+  const char *data;
+  size_t size;
+
+  Slice() : data(NULL), size(0) {}
+  Slice(const char *data_, size_t size_) : data(data_), size(size_) {}
+
+  bool empty() const { return size == 0; }
+  std::string str() const { return std::string(data, size); }
+  bool operator==(const char *other) const;
+};
+
+std::ostream &operator<<(std::ostream &os, const Slice &slice);
+
+/**
+  Bump allocator for per-request data. Each civetweb worker thread owns one,
+  which Server resets after every request, so anything allocated from it is
+  only valid while a request is handled. Blocks are kept across resets, so a
+  warmed up worker handles typical requests without calling malloc.
+*/
+class CIVETTA_EXPORT Arena {
+ public:
+  explicit Arena(size_t block_size = 16384);
+  ~Arena();
+
+  /**
+     Allocates memory suitably aligned for any type.
+     @throws std::bad_alloc when out of memory
+   */
+  void *allocate(size_t size);
+
+  /**
+     Same as allocate(), returning NULL when out of memory or when the size
+     is too large to allocate at all, e.g. one sent by a client.
+   */
+  void *tryAllocate(size_t size);
+
+  /**
+     Copies a string into the arena and adds a terminating zero.
+   */
+  Slice copy(const char *data, size_t size);
+
+  /**
+     Releases everything allocated since the last reset.
+   */
+  void reset();
+
+  /**
+     The arena of the calling thread.
+   */
+  static Arena &current();
+
+  /**
+     Hands the arena of the calling thread over to the caller, who deletes it
+     when done. The thread gets a new arena on its next call to current().
+   */
+  static Arena *detach();
+
+  /**
+     Number of blocks all arenas have requested from the heap so far. It does
+     not change while warmed up workers handle typical requests.
+   */
+  static unsigned long allocations();
+
+ private:
+  struct Block {
+    Block *next;
+    size_t size;
+  };
+
+  Block *newBlock(size_t size);
+
+  size_t block_size;
+  Block *first;  // standard sized blocks, kept across resets
+  Block *block;  // the standard block in use
+  Block *large;  // oversized allocations, freed on reset
+  char *ptr;
+  char *end;
+
+  Arena(const Arena &);
+  Arena &operator=(const Arena &);
+};
+
+/**
+  Standard allocator handing out memory from an Arena, for containers that
+  only live as long as a request.
+*/
+template <class T>
+struct ArenaAllocator {
+  typedef T value_type;
+
+  ArenaAllocator(Arena &arena_) : arena(&arena_) {}
+  template <class U>
+  ArenaAllocator(const ArenaAllocator<U> &other) : arena(other.arena) {}
+
+  T *allocate(size_t n) { return static_cast<T *>(arena->allocate(n * sizeof(T))); }
+  void deallocate(T *, size_t) {}
+
+  template <class U>
+  bool operator==(const ArenaAllocator<U> &other) const { return arena == other.arena; }
+  template <class U>
+  bool operator!=(const ArenaAllocator<U> &other) const { return arena != other.arena; }
+
+  Arena *arena;
+};
+
+/**
+  A named path parameter captured by the router, e.g. "id" for /users/:id
+*/
+struct CIVETTA_EXPORT Capture {
+  const char *name;
+  Slice value;
+};
+
+typedef std::vector<Capture, ArenaAllocator<Capture> > Captures;
+
+/**
+  Name/value pairs such as decoded parameters or response headers.
+*/
+typedef std::pair<Slice, Slice> Field;
+typedef std::vector<Field, ArenaAllocator<Field> > Fields;
+
+/**
+  Headers of one part of a multipart/form-data body. The slices are only
+  valid until the next part starts.
+*/
+struct CIVETTA_EXPORT Part {
+  Slice name;          // form field name
+  Slice filename;      // empty unless the part is an uploaded file
+  Slice content_type;  // empty if the part has no Content-Type
+};
+
+/**
+  Incremental multipart/form-data parser. The body can be fed in chunks of
+  any size, and part contents are handed to the handler as they arrive, so
+  memory use does not depend on the size of the body.
+*/
+class CIVETTA_EXPORT MultipartParser {
+ public:
+  /**
+    Receives the parts as they are parsed.
+  */
+  class Handler {
+   public:
+    virtual ~Handler() {}
+    virtual void onPartBegin(const Part &part) = 0;
+    virtual void onPartData(const char *data, size_t len) = 0;
+    virtual void onPartEnd() = 0;
+  };
+
+  /**
+     @param boundary the boundary parameter of the Content-Type header
+     @param handler receives the parts
+   */
+  MultipartParser(Slice boundary, Handler &handler);
+
+  /**
+     Parses the next chunk of the body.
+     @return false if the body is malformed
+   */
+  bool feed(const char *data, size_t len);
+
+  /**
+     Tells whether the closing boundary has been seen.
+   */
+  bool done() const { return state == DONE; }
+
+  /**
+     Extracts the boundary from a Content-Type header value.
+   */
+  static Slice getBoundary(const char *content_type);
+
+ private:
+  enum State { PREAMBLE, BODY, BOUNDARY_END, HEADERS, DONE, FAILED };
+
+  const char *scanBody(const char *data, const char *end);
+  const char *scanHeaders(const char *data, const char *end);
+  void parseHeaders();
+
+  Handler &handler;
+  State state;
+  char delimiter[4 + 70];  // "\r\n--" and a boundary of at most 70 characters
+  size_t delimiter_len;
+  size_t matched;          // delimiter bytes seen at the end of the last chunk
+  char headers[2048];
+  size_t headers_len;
+  Part part;
+};
+
+/**
+  Request is a wrapper for the clients requests
+
+  The body, the form fields and the query string are only read and parsed
+  the first time a handler asks for them.
+*/
+class CIVETTA_EXPORT Request {
+ public:
+  /**
+    Size at which the parts of a multipart/form-data body kept in memory are
+    truncated: plain fields, and uploaded files when neither an upload
+    destination nor a part handler is set. Larger files should be saved
+    with getUploads() or streamed with setPartHandler().
+  */
+  static const size_t max_field_size = 1 << 20;
+
+  /**
+    Request constructor.
+    @param connection the request connection
+  */
+  Request(struct mg_connection *connection);
+  virtual ~Request();
+
+  /**
+    Information about the request.
+  */
+  const struct mg_request_info *request_info;
+
+  /**
+    Accessor for the request uri matches, against "METHOD:uri".
+    Routes using regular expression syntax fill the groups. Router routes
+    have no groups, see getCapture() for their :name parameters, and their
+    whole match is only made when asked for.
+    @return the uri route pattern matches
+  */
+  std::smatch getMatches();
+
+  /**
+    Gets a path parameter captured by the route, e.g. "id" for /users/:id.
+    @param name the parameter name, without the leading ':' or '*'
+    @return a slice of the request uri, empty if the parameter does not exist
+  */
+  Slice getCapture(const char *name) const;
+
+  /**
+    Gets a path parameter converted to an integer.
+    @param name the parameter name
+    @param dst the parsed value
+    @return true if the parameter exists and is a number
+  */
+  bool getCapture(const char *name, long &dst) const;
+
+  /**
+    All the path parameters captured by the route, in path order.
+  */
+  const Captures &getCaptures() const { return captures; }
+
+  /**
+     Gets a cookie.
+     @param cookieName - cookie name to get the value from
+     @param cookieValue - cookie value is returned using this reference
+     @puts the cookie value string that matches the cookie name in the _cookieValue string.
+     @returns the size of the cookie value string read.
+  */
+  int getCookie(const std::string &cookieName, std::string &cookieValue);
+
+  /**
+     Gets a header.
+     @param headerName - header name to get the value from
+     @returns a char array whcih contains the header value as
+     string
+  */
+  const char *getHeader(const std::string &headerName);
+  
+  /**
+     Gets a param.
+     Returns a query paramter contained in the supplied buffer.
+     The occurence value is a zero-based index of a particular key name.
+     This should not be confused with the index over all of the keys.
+     @param name the key to search for
+     @param the destination string
+     @param occurrence the occurrence of the selected name in the query (0 based).
+     @return true of key was found
+  */
+  bool getParam(const char *name, std::string &dst, size_t occurrence = 0);
+
+  /**
+     Gets a param without copying it.
+     @param name the key to search for
+     @param occurrence the occurrence of the selected name in the body (0 based).
+     @return the decoded value, NULL data if the key was not found
+  */
+  Slice getParamView(const char *name, size_t occurrence = 0);
+
+  /**
+     Gets a param as Array.
+     Returns array of strings containing the values passed in the varios occurrences of the param.
+     @param name the key to search for
+     @param the destination string
+     @param occurrence the occurrence of the selected name in the query (0 based).
+     @return true of key was found
+  */
+  std::vector<std::string> getParamArray(const char *name);
+  
+  /**
+     Gets a query string param.
+     Returns a query paramter contained in the supplied buffer.
+     The occurence value is a zero-based index of a particular key name.
+     This should not be confused with the index over all of the keys.
+     @param name the key to search for
+     @param the destination string
+     @param occurrence the occurrence of the selected name in the query (0 based).
+     @return true of key was found
+  */
+  bool getQueryParam(const char *name, std::string &dst, size_t occurrence = 0);
+
+  /**
+     Gets a query string param without copying it.
+     @param name the key to search for
+     @param occurrence the occurrence of the selected name in the query (0 based).
+     @return the decoded value, NULL data if the key was not found
+  */
+  Slice getQueryParamView(const char *name, size_t occurrence = 0);
+
+  /**
+     Gets a query string param as Array.
+     Returns array of strings containing the values passed in the varios occurrences of the param.
+     @param name the key to search for
+     @param the destination string
+     @param occurrence the occurrence of the selected name in the query (0 based).
+     @return true of key was found
+  */
+  std::vector<std::string> getQueryParamArray(const char *name);
+
+  /**
+     Gets the raw body. A multipart/form-data body is streamed through the
+     parser instead of being kept, so this is NULL once params were read.
+  */
+  const char* getPostData();
+
+  /**
+     Gets the raw body without copying it, see getPostData().
+  */
+  Slice getPostDataView();
+
+  /**
+     Saves the files uploaded in a multipart/form-data body to a directory,
+     unless Server::setUploadDestination() already chose one. The param of
+     a saved file is its path. Must be called before any param is read.
+     @param destination_path the directory to save files to
+     @return the paths of the saved files
+  */
+  std::vector<std::string> getUploads(std::string destination_path);
+
+  /**
+     Streams the files uploaded in a multipart/form-data body to a handler
+     instead of saving them. Must be called before any param is read.
+  */
+  void setPartHandler(MultipartParser::Handler *handler);
+
+ protected:
+  void readBody();
+  void discardBody();
+  const Fields &getValues();
+  const Fields &getQuery();
+
+  Arena &arena;
+  char *postData;
+  size_t postDataLen;
+  bool body_read;
+  bool values_parsed;
+  bool query_parsed;
+  Fields values;
+  Fields query;
+  struct mg_connection *connection;
+  std::smatch matches;
+  Captures captures;
+  std::vector<std::string> upload_filepaths;
+  const char *upload_destination;
+  MultipartParser::Handler *part_handler;
+  std::chrono::steady_clock::time_point started;  // set by Timing::before()
+  bool routed;      // matched by the Router, see getMatches()
+  std::string key;  // "METHOD:uri" the matches of a Router route point into
+
+  friend class PartStore;
+
+  friend class Deferred;
+  friend class Server;
+  friend class Timing;
+};
+
+/**
+  Response is written to like an std::ostringstream. The body and headers are
+  kept in the request Arena and sent once the route callback returns, unless
+  the callback streams them earlier with flush().
+*/
+class CIVETTA_EXPORT Response : public std::ostream {
+ public:
+  /**
+    Some of the HTTP response codes
+  */
+  enum codes { OK = 200, NOT_FOUND = 404, FORBIDDEN = 403, SERVER_ERROR = 500, BAD_REQUEST = 400 };
+  Response();
+
+  /**
+    Test if the given header is present
+    @param string the header key
+    @return bool true if the header is set
+  */
+  bool hasHeader(const std::string &key) const;
+
+  /**
+     Sets the header
+     @param key the header key
+     @param value the header value
+   */
+  void setHeader(const std::string &key, const std::string &value);
+  void setHeader(const char *key, const char *value);
+
+  /**
+     Get the data of the response, this will contain headers and body.
+     @return string the response data
+   */
+  std::string getData();
+
+  /**
+     Gets the response body.
+     @return string the response body
+   */
+  std::string getBody();
+
+  /**
+     Gets the response body without copying it.
+   */
+  Slice getBodyView() const;
+
+  /**
+     Same as getBody(), for code written against std::ostringstream.
+   */
+  std::string str() const;
+
+  /**
+     Sets the cookie, note that you can only define one cookie by request for now.
+     @param string the key of the cookie
+     @param string value the cookie value
+   */
+  void setCookie(const std::string &key, const std::string &value);
+
+  /**
+     Sets the response code
+   */
+  void setCode(int code);
+
+  /**
+     Sends the headers and the body written so far, and keeps sending what is
+     written next on each call. Without a Content-Length header, the body is
+     sent with chunked transfer encoding, which HTTP/1.0 clients do not
+     support: for them the body is still sent as a whole at the end. Headers
+     and code set after the first flush are ignored.
+
+     std::flush and std::endl do not stream the response, only this does.
+   */
+  Response &flush();
+
+ protected:
+  /**
+    Stream buffer growing in the arena.
+  */
+  class Buffer : public std::streambuf {
+   public:
+    Buffer(Arena &arena);
+    Slice data() const { return Slice(pbase(), pptr() - pbase()); }
+    void clear() { setp(pbase(), epptr()); }
+
+   protected:
+    int_type overflow(int_type c);
+    std::streamsize xsputn(const char *s, std::streamsize n);
+
+   private:
+    void reserve(size_t size);
+    Arena &arena;
+  };
+
+  /**
+     Formats the status line, the headers and the body into one buffer.
+   */
+  Slice serialize();
+
+  /**
+     Upper bound of the size of the status line and headers.
+   */
+  size_t headersSize() const;
+
+  /**
+     Formats the status line and headers into buf, which must hold
+     headersSize() bytes.
+     @return size_t the formatted length
+   */
+  size_t writeHeaders(char *buf) const;
+
+  /**
+     Sends the headers and the body to the client with a single writev, the
+     headers being formatted on the stack unless they are unusually large.
+     Ends the body instead when the response is being streamed.
+   */
+  void send();
+  void sendHeaders();
+  void sendBody();
+  void setHeader(Slice key, Slice value);
+
+  Arena &arena;
+  Buffer buffer;
+  int code;
+  Fields headers;
+  struct mg_connection *connection;  // NULL unless served by a Server
+  bool http11;                       // the request is HTTP/1.1
+  bool keep_alive;                   // the connection is reused afterwards
+  bool streaming;                    // the headers are already sent
+  bool chunked;
+  const std::function<void(Deferred &)> *async;  // set by Server::routeAsync routes
+
+  friend class Deferred;
+  friend class Server;
+};
+
+typedef std::function<void(Request &request, Response &response)> Callback;
+
+/**
+  A request whose response is completed after its route callback returned,
+  possibly from another thread. Meanwhile the connection is parked, leaving
+  the worker threads free to serve other requests. See Server::routeAsync().
+*/
+class CIVETTA_EXPORT Deferred {
+ public:
+  Request &getRequest() { return request; }
+  Response &getResponse() { return response; }
+
+  /**
+     Sends the response and gives the connection back to the server. Must be
+     called exactly once, and deletes the Deferred.
+   */
+  void complete();
+
+  /**
+     Calls func(arg) on a worker thread of the server, once the route callback
+     returned, so that threads producing responses, such as timers, do not
+     write them themselves. func may complete the Deferred, or keep it and
+     resume it again later. Called at most once until func runs.
+   */
+  void resume(void (*func)(void *arg), void *arg);
+
+ private:
+  Deferred(Request &request, Response &response);
+  ~Deferred();
+
+  static void resumed(struct mg_connection *connection, void *deferred);
+
+  Arena *arena;  // owns the request, the response and this
+  Request &request;
+  Response &response;
+  std::string key;  // regular expression matches point into it
+  void (*resumeFunc)(void *arg);
+  void *resumeArg;
+
+  friend class Server;
+};
+
+typedef std::function<void(Deferred &deferred)> AsyncCallback;
+
+/**
+  Base of route middlewares, see Chain. Middlewares hide before() to act
+  ahead of the handler, returning false to answer the request themselves,
+  and after() to act once the handler returned. Both are called from many
+  worker threads at once, hence const.
+*/
+struct CIVETTA_EXPORT Middleware {
+  bool before(Request &, Response &) const { return true; }
+  void after(Request &, Response &) const {}
+};
+
+/**
+  A route handler wrapped in a chain of middlewares, see Chain::wrap().
+*/
+template <class Chain, class Handler>
+struct Chained {
+  Chain chain;
+  Handler handler;
+
+  void operator()(Request &request, Response &response) const { chain.run(request, response, handler); }
+};
+
+/**
+  Middlewares run around route handlers, outermost first. The chain is
+  composed at compile time, so a wrapped handler is a single call with the
+  middleware hooks inlined around the handler.
+
+  When a before() hook returns false, the inner middlewares and the handler
+  are skipped, and the after() hooks of the outer middlewares still run.
+*/
+template <class... Middlewares>
+class Chain;
+
+template <>
+class Chain<> {
+ public:
+  template <class Handler>
+  void run(Request &request, Response &response, const Handler &handler) const {
+    handler(request, response);
+  }
+
+  template <class Handler>
+  Chained<Chain, Handler> wrap(Handler handler) const {
+    return Chained<Chain, Handler>{*this, handler};
+  }
+};
+
+template <class First, class... Rest>
+class Chain<First, Rest...> {
+ public:
+  Chain(First first_, Rest... rest_) : first(first_), rest(rest_...) {}
+
+  template <class Handler>
+  void run(Request &request, Response &response, const Handler &handler) const {
+    if (!first.before(request, response))
+      return;
+    rest.run(request, response, handler);
+    first.after(request, response);
+  }
+
+  /**
+     Wraps a route handler in the middlewares.
+   */
+  template <class Handler>
+  Chained<Chain, Handler> wrap(Handler handler) const {
+    return Chained<Chain, Handler>{*this, handler};
+  }
+
+ private:
+  First first;
+  Chain<Rest...> rest;
+};
+
+/**
+  Makes a middleware chain, deducing its type.
+*/
+template <class... Middlewares>
+Chain<Middlewares...> makeChain(Middlewares... middlewares) {
+  return Chain<Middlewares...>(middlewares...);
+}
+
+/**
+  Latency histogram with power of two buckets, in microseconds. Recording is
+  lock free, so many workers can share one histogram.
+*/
+class CIVETTA_EXPORT Histogram {
+ public:
+  static const int buckets = 32;
+
+  Histogram();
+
+  /**
+     Records a latency.
+   */
+  void record(unsigned long micros);
+
+  /**
+     Number of latencies recorded in a bucket: below 1 us for bucket 0, then
+     from 2^(bucket - 1) us up to 2^bucket us.
+   */
+  unsigned long count(int bucket) const;
+
+  /**
+     Number of latencies recorded.
+   */
+  unsigned long total() const;
+
+  /**
+     Upper bound, in microseconds, of the given percentile of latencies.
+     @param p the percentile, between 0 and 100
+   */
+  unsigned long percentile(double p) const;
+
+ private:
+  std::atomic<unsigned long> counts[buckets];
+
+  Histogram(const Histogram &);
+  Histogram &operator=(const Histogram &);
+};
+
+/**
+  Middleware recording how long requests take, middlewares inner to it
+  included, into a histogram. Only one Timing should be part of a chain, as
+  the start time is kept in the request.
+*/
+class CIVETTA_EXPORT Timing : public Middleware {
+ public:
+  explicit Timing(Histogram &histogram);
+
+  bool before(Request &request, Response &response) const;
+  void after(Request &request, Response &response) const;
+
+ private:
+  Histogram *histogram;
+};
+
+/**
+  Compressed radix tree of routes, one tree per HTTP method.
+
+  Paths are made of literal text, named parameters matching one segment
+  ("/users/:id", or "/users/:id<int>" to only match digits) and a last
+  segment "*name" (or a bare "*") matching the rest of the path. Literal text
+  wins over parameters, and parameters win over wildcards. A trailing slash in
+  the request is ignored, like the "/?" suffix of regular expression routes.
+  Paths with a '.' or other regular expression syntax are left to regular
+  expressions, where '.' matches any character. A path using only '*' and
+  ':' goes to the tree, although it used to be a regular expression too: a
+  last '*' segment after "/static" now matches "/static/css/site.css", where
+  it only matched "/static" followed by slashes, as "/static/{0,}" does.
+ */
+class CIVETTA_EXPORT Router {
+ public:
+  Router();
+  ~Router();
+
+  /**
+     Tells whether a route path can be stored in the tree, or needs to be
+     matched as a regular expression.
+   */
+  static bool accepts(const std::string &path);
+
+  /**
+     Adds or replaces a route.
+     @param method the HTTP method
+     @param path the route path, must be accepted by accepts()
+     @param callback the request handler for this route
+   */
+  void add(const std::string &method, const std::string &path, const Callback &callback);
+
+  /**
+     Looks up the handler of a request.
+     @param method the HTTP method
+     @param path the request uri
+     @param captures receives the path parameters, pointing into path
+     @return the route handler, or NULL if no route matches
+   */
+  const Callback *find(const char *method, const char *path, Captures &captures) const;
+
+ private:
+  struct Node;
+  std::vector<std::pair<std::string, Node *> > trees;
+
+  Router(const Router &);
+  Router &operator=(const Router &);
+};
+
+/**
+  Basic class for embedded web server.  This has a URL mapping built-in.
+ */
+class CIVETTA_EXPORT Server {
+ public:
+  /**
+     Constructor.
+
+     This automatically starts the sever.
+     It is good practice to call getContext() after this in case there
+     were errors starting the server.
+
+     @param options - the web server options.
+     @param callbacks - optional web server callback methods.
+   */
+  Server(const char **options, const struct mg_callbacks *callbacks = 0);
+
+  /**
+     Destructor
+   */
+  virtual ~Server();
+
+  /**
+    Stops server and frees resources.
+  */
+  void close();
+
+  /**
+     Accessor for the server context.
+     @return the context or 0 if not running.
+  */
+  const struct mg_context *getContext() const { return context; }
+
+  /**
+     Registers a route to the server
+     The url is either a Router path, see Router, or a regular expression
+     whose groups are available through
+     Request::getMatches().
+     @param string the method
+     @param string the url path
+     @param Callback the request handler for this route
+   */
+  Callback route(std::string httpMethod, std::string url, Callback callback);
+
+  /**
+     Registers a route whose response is completed later, through the
+     Deferred passed to the callback. The callback should return quickly,
+     handing the Deferred to whatever produces the response, so that a few
+     worker threads can keep many slow requests pending. All of them must be
+     completed before the server is closed.
+     @param string the method
+     @param string the url path, as for route()
+     @param AsyncCallback the request handler for this route
+   */
+  void routeAsync(std::string httpMethod, std::string url, AsyncCallback callback);
+
+  /**
+     Registers a route whose handler is wrapped in a middleware chain.
+     @param string the method
+     @param string the url path, as for route()
+     @param Chain the middlewares, see Chain
+     @param Handler the request handler for this route
+   */
+  template <class... Middlewares, class Handler>
+  Callback route(std::string httpMethod, std::string url, const Chain<Middlewares...> &chain, Handler handler) {
+    return route(httpMethod, url, Callback(chain.wrap(handler)));
+  }
+  
+  /**
+     Sets the routes prefix.
+   */
+  void setPrefix(std::string prefix);
+
+  /**
+     Sets the directory files uploaded with multipart/form-data are saved
+     to. When unset, uploaded files are kept in memory like other params,
+     up to Request::max_field_size bytes.
+   */
+  void setUploadDestination(std::string upload_destination);
+  std::string getUploadDestination() const;
+
+ protected:
+  /**
+    A route using regular expression syntax, compiled once when it is added.
+  */
+  struct Route {
+    std::regex pattern;   // compiled "METHOD:/path/?" expression
+    std::string literal;  // literal prefix every matching key starts with
+    Callback callback;
+
+    bool match(const std::string &key, std::smatch &matches) const;
+  };
+
+  struct mg_context *context;
+  Router router;
+  std::map<std::string, Route> routes;  // routes the router does not accept
+  std::string prefix;
+  std::string upload_destination;
+
+ private:
+  /**
+     Handles the incomming request.
+     @param conn - the connection information
+     @param cbdata - pointer to the CivetHandler instance.
+     @returns 0 if implemented, false otherwise
+   */
+  int requestHandler(struct mg_connection *conn, void *cbdata);
+  static int globalHandler(struct mg_connection *conn, void *cbdata);
+
+  /**
+     Handles closing a request (internal handler)
+     @param conn - the connection information
+   */
+  static void closeHandler(struct mg_connection *conn);
+
+  static void uploadHandler(struct mg_connection *conn, const char *file_name);
+
+  /**
+     Stores the user provided close handler
+   */
+  void (*userCloseHandler)(struct mg_connection *conn);
+  void (*userUploadHandler)(struct mg_connection *conn, const char *filename);
+};
+
+class CIVETTA_EXPORT Util {
+ public:
+  /**
+     Url decoder.
+     @param src buffer to be decoded
+     @param src_len length of buffer to be decoded
+     @param dst destination string
+     @param is_form_url_encoded true if form url encoded form-url-encoded data differs from URI encoding in a way that
+     it uses '+' as character for space, see RFC 1866 section 8.2.1 http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
+   */
+  static void urlDecode(const char *src, size_t src_len, std::string &dst, bool is_form_url_encoded = true);
+
+  /**
+     Url decoder.
+     @param src string to be decoded
+     @param dst destination string
+     @param is_form_url_encoded true if form url encoded form-url-encoded data differs from URI encoding in a way that
+     it uses '+' as character for space, see RFC 1866 section 8.2.1 http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
+   */
+  static void urlDecode(const std::string &src, std::string &dst, bool is_form_url_encoded = true);
+
+  /**
+     Url decoder.
+     @param src buffer to be decoded (0 terminated)
+     @param dst destination string
+     @param is_form_url_encoded true if form url encoded form-url-encoded data differs from URI encoding in a way that
+     it uses '+' as character for space, see RFC 1866 section 8.2.1 http://ftp.ics.uci.edu/pub/ietf/html/rfc1866.txt
+   */
+  static void urlDecode(const char *src, std::string &dst, bool is_form_url_encoded = true);
+
+  /**
+     Url encoder.
+     @param src buffer to be encoded
+     @param src_len length of buffer to be decoded
+     @param dst destination string
+     @param append true if string should not be cleared before encoding.
+   */
+  static void urlEncode(const char *src, size_t src_len, std::string &dst, bool append = false);
+
+  /**
+     Url encoder.
+     @param src buffer to be encoded (0 terminated)
+     @param dst destination string
+     @param append true if string should not be cleared before encoding.
+   */
+  static void urlEncode(const char *src, std::string &dst, bool append = false);
+
+  /**
+     Url encoder.
+     @param src buffer to be encoded
+     @param dst destination string
+     @param append true if string should not be cleared before
+     encoding.
+   */
+  static void urlEncode(const std::string &src, std::string &dst, bool append = false);
+};
+
+#if defined(__cpp_impl_coroutine)
+/**
+  Coroutine frames of the calling thread, recycled by size. A frame freed on
+  another thread, e.g. the worker thread a handler was resumed on, goes back
+  to the pool of the thread that allocated it.
+*/
+class FramePool {
+ public:
+  static void *allocate(size_t size) {
+    size_t slot = (size - 1) / granularity;
+    if (slot >= slots)
+      return ::operator new(size);
+    Pool &pool = local();
+    if (pool.lists[slot] == NULL)
+      pool.reclaim();
+    Header *header = pool.lists[slot];
+    if (header == NULL) {
+      header = static_cast<Header *>(::operator new(sizeof(Header) + (slot + 1) * granularity));
+      header->owner = &pool;
+      header->slot = slot;
+    } else {
+      pool.lists[slot] = header->next;
+      pool.counts[slot]--;
+    }
+    pool.refs.fetch_add(1, std::memory_order_relaxed);
+    return header + 1;
+  }
+
+  static void release(void *frame, size_t size) {
+    if ((size - 1) / granularity >= slots) {
+      ::operator delete(frame);
+      return;
+    }
+    Header *header = static_cast<Header *>(frame) - 1;
+    Pool *owner = header->owner;
+    if (owner != &local()) {
+      owner->giveBack(header);
+      return;
+    }
+    owner->keep(header);
+    owner->refs.fetch_sub(1, std::memory_order_relaxed);  // the thread holds one
+  }
+
+ private:
+  static const size_t granularity = 64;
+  static const size_t slots = 32;  // frames up to 2 KB are pooled
+  static const size_t max_cached = 1024;
+
+  struct Pool;
+
+  // Ahead of each pooled frame, keeping its alignment
+  struct alignas(std::max_align_t) Header {
+    Pool *owner;
+    size_t slot;
+    Header *next;  // while in a free list
+  };
+
+  // Outlives its thread until the frames it allocated are all freed
+  struct Pool {
+    Header *lists[slots];
+    size_t counts[slots];
+    std::atomic<Header *> returned;  // freed on other threads
+    std::atomic<size_t> refs;        // allocated frames, plus one for the thread
+
+    Pool() : lists(), counts(), returned(NULL), refs(1) {}
+    ~Pool() {
+      reclaim();
+      for (size_t i = 0; i < slots; i++) {
+        while (Header *header = lists[i]) {
+          lists[i] = header->next;
+          ::operator delete(header);
+        }
+      }
+    }
+
+    void keep(Header *header) {
+      if (counts[header->slot] >= max_cached) {
+        ::operator delete(header);
+        return;
+      }
+      header->next = lists[header->slot];
+      lists[header->slot] = header;
+      counts[header->slot]++;
+    }
+
+    void reclaim() {
+      Header *header = returned.exchange(NULL, std::memory_order_acquire);
+      while (header != NULL) {
+        Header *next = header->next;
+        keep(header);
+        header = next;
+      }
+    }
+
+    void giveBack(Header *header) {
+      header->next = returned.load(std::memory_order_relaxed);
+      while (!returned.compare_exchange_weak(header->next, header, std::memory_order_release,
+                                             std::memory_order_relaxed)) {
+      }
+      unref();
+    }
+
+    void unref() {
+      if (refs.fetch_sub(1, std::memory_order_acq_rel) == 1)
+        delete this;
+    }
+  };
+
+  struct Local {
+    Pool *pool;
+
+    Local() : pool(new Pool) {}
+    ~Local() { pool->unref(); }
+  };
+
+  static Pool &local() {
+    static thread_local Local local;
+    return *local.pool;
+  }
+};
+
+/**
+  Return type of coroutine route handlers, see routeTask(). The handler starts
+  on a worker thread, which it leaves at its first suspension, and the
+  response is sent when it returns.
+*/
+class Task {
+ public:
+  struct promise_type;
+
+  Task(Task &&other) : handle(other.handle) { other.handle = nullptr; }
+  ~Task() {
+    if (handle)
+      handle.destroy();
+  }
+
+  /**
+     Runs the handler up to its first suspension.
+   */
+  void start(Deferred &deferred) {
+    handle.promise().deferred = &deferred;
+    std::coroutine_handle<promise_type> started = handle;
+    handle = nullptr;
+    started.resume();
+  }
+
+ private:
+  // Completes the request once the frame, and the locals in it, are gone
+  struct Completion {
+    bool await_ready() noexcept { return false; }
+    void await_suspend(std::coroutine_handle<promise_type> frame) noexcept;
+    void await_resume() noexcept {}
+  };
+
+ public:
+  struct promise_type {
+    Deferred *deferred = nullptr;
+
+    Task get_return_object() { return Task(std::coroutine_handle<promise_type>::from_promise(*this)); }
+    std::suspend_always initial_suspend() noexcept { return {}; }
+    Completion final_suspend() noexcept { return {}; }
+    void return_void() {}
+    void unhandled_exception() { deferred->getResponse().setCode(Response::SERVER_ERROR); }
+
+    static void *operator new(size_t size) { return FramePool::allocate(size); }
+    static void operator delete(void *frame, size_t size) { FramePool::release(frame, size); }
+  };
+
+ private:
+  explicit Task(std::coroutine_handle<promise_type> handle_) : handle(handle_) {}
+
+  std::coroutine_handle<promise_type> handle;
+};
+
+inline void Task::Completion::await_suspend(std::coroutine_handle<promise_type> frame) noexcept {
+  Deferred *deferred = frame.promise().deferred;
+  frame.destroy();
+  deferred->complete();
+}
+
+typedef std::function<Task(Request &request, Response &response)> TaskCallback;
+
+/**
+  Registers a coroutine route handler on the server, on top of
+  Server::routeAsync().
+  @param server the server
+  @param string the method
+  @param string the url path, as for Server::route()
+  @param TaskCallback the coroutine handler for this route
+*/
+inline void routeTask(Server &server, std::string httpMethod, std::string url, TaskCallback callback) {
+  server.routeAsync(httpMethod, url, [callback](Deferred &deferred) {
+    callback(deferred.getRequest(), deferred.getResponse()).start(deferred);
+  });
+}
+
+/**
+  Wakes suspended coroutine handlers at their deadline, from a thread of its
+  own, and has the worker threads of their server resume them.
+*/
+class Timers {
+ public:
+  typedef std::chrono::steady_clock Clock;
+
+  static Timers &instance() {
+    static Timers timers;
+    return timers;
+  }
+
+  void add(Clock::time_point deadline, Deferred &deferred, std::coroutine_handle<> coroutine) {
+    std::lock_guard<std::mutex> lock(mutex);
+    queue.push(Entry{deadline, &deferred, coroutine});
+    wakeup.notify_one();
+  }
+
+ private:
+  struct Entry {
+    Clock::time_point deadline;
+    Deferred *deferred;
+    std::coroutine_handle<> coroutine;
+  };
+
+  struct Later {
+    bool operator()(const Entry &a, const Entry &b) const { return a.deadline > b.deadline; }
+  };
+
+  static void resume(void *coroutine) { std::coroutine_handle<>::from_address(coroutine).resume(); }
+
+  Timers() : stop(false), thread([this] { run(); }) {}
+  ~Timers() {
+    {
+      std::lock_guard<std::mutex> lock(mutex);
+      stop = true;
+    }
+    wakeup.notify_one();
+    thread.join();
+  }
+
+  void run() {
+    std::unique_lock<std::mutex> lock(mutex);
+    while (!stop) {
+      if (queue.empty()) {
+        wakeup.wait(lock);
+      } else if (queue.top().deadline > Clock::now()) {
+        wakeup.wait_until(lock, queue.top().deadline);
+      } else {
+        Entry entry = queue.top();
+        queue.pop();
+        lock.unlock();
+        entry.deferred->resume(resume, entry.coroutine.address());
+        lock.lock();
+      }
+    }
+  }
+
+  std::mutex mutex;
+  std::condition_variable wakeup;
+  std::priority_queue<Entry, std::vector<Entry>, Later> queue;
+  bool stop;
+  std::thread thread;
+};
+
+/**
+  Awaitable suspending a coroutine handler for a while, without holding a
+  thread meanwhile. The handler then goes on on a worker thread.
+*/
+class Sleep {
+ public:
+  explicit Sleep(std::chrono::milliseconds delay_) : delay(delay_) {}
+
+  bool await_ready() const { return delay.count() <= 0; }
+  void await_suspend(std::coroutine_handle<Task::promise_type> coroutine) {
+    Timers::instance().add(Timers::Clock::now() + delay, *coroutine.promise().deferred, coroutine);
+  }
+  void await_resume() {}
+
+ private:
+  std::chrono::milliseconds delay;
+};
+
+/**
+  Awaitable reading the request body. civetweb sockets are blocking, so the
+  body is read right away, on the thread running the handler.
+*/
+class ReadBody {
+ public:
+  explicit ReadBody(Request &request_) : request(request_) {}
+
+  bool await_ready() const { return true; }
+  void await_suspend(std::coroutine_handle<>) {}
+  Slice await_resume() { return request.getPostDataView(); }
+
+ private:
+  Request &request;
+};
+
+/**
+  Awaitable sending what was written to the response so far, see
+  Response::flush(). The write happens right away, like with ReadBody.
+*/
+class Flush {
+ public:
+  explicit Flush(Response &response_) : response(response_) {}
+
+  bool await_ready() const { return true; }
+  void await_suspend(std::coroutine_handle<>) {}
+  void await_resume() { response.flush(); }
+
+ private:
+  Response &response;
+};
+#endif  // __cpp_impl_coroutine
+}  // namespace Civetta
+#endif  // _CIVETTA_H
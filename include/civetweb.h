@@ -194,6 +194,31 @@ CIVETWEB_API struct mg_context *mg_start(const struct mg_callbacks *callbacks,
 CIVETWEB_API void mg_stop(struct mg_context *);
 
 
+/* Stop the web server gracefully.
+
+   The server stops accepting connections, then lets the requests in flight
+   complete, closing keep-alive connections once their response is sent and
+   idle ones right away. It stops like mg_stop() once every connection is
+   closed, or after timeout_ms at the latest. Context pointer becomes
+   invalid. */
+CIVETWEB_API void mg_stop_gracefully(struct mg_context *, int timeout_ms);
+
+
+/* Hand the listening sockets over to another server.
+
+   Stores the comma-separated descriptors of duplicates of the listening
+   sockets of every acceptor in buf, e.g. "5,6". They stay open across
+   exec() and mg_stop(), and a server given them as the "listening_sockets"
+   option, in this process or in one it executes, takes over the ones
+   matching its "listening_ports" instead of binding new ones, one per port
+   and acceptor. It closes the others.
+   Calling mg_stop_gracefully() on the old server next restarts without
+   refusing any connection.
+   Return value is the number of sockets, or -1 on error, e.g. when buf is
+   too small. Not supported on Windows. */
+CIVETWEB_API int mg_export_listening_sockets(struct mg_context *ctx, char *buf, size_t buf_len);
+
+
 /* mg_request_handler
 
    Called when a new request comes in.  This callback is URI based
@@ -279,6 +304,34 @@ CIVETWEB_API const struct mg_option *mg_get_valid_options(void);
 CIVETWEB_API size_t mg_get_ports(const struct mg_context *ctx, size_t size, int* ports, int* ssl);
 
 
+/* Get the number of accepted connections waiting for a worker thread, for
+   each socket queue: one per shard with the num_shards option, otherwise
+   one per acceptor. size is the number of elements of the depths array.
+   Return value is the number of queues filled in. */
+CIVETWEB_API size_t mg_get_queue_depths(const struct mg_context *ctx, size_t size, int *depths);
+
+
+/* Get the number of worker threads running. It varies between the
+   min_threads and max_threads options. */
+CIVETWEB_API int mg_get_thread_count(const struct mg_context *ctx);
+
+
+/* Counters of the static file cache, see the file_cache_size option. */
+struct mg_file_cache_stats {
+    unsigned long hits;       /* Files served from memory */
+    unsigned long misses;     /* Files read from disk */
+    unsigned long evictions;  /* Files evicted to stay within the budget */
+    unsigned long files;      /* Files in the cache */
+    size_t bytes;             /* Their total size */
+};
+
+
+/* Get the counters of the static file cache. Return value is 0 if the
+   cache is disabled, in which case stats is left untouched, 1 otherwise. */
+CIVETWEB_API int mg_get_file_cache_stats(const struct mg_context *ctx,
+                                         struct mg_file_cache_stats *stats);
+
+
 /* Add, edit or delete the entry in the passwords file.
 
    This function allows an application to manipulate .htpasswd files on the
@@ -309,6 +362,46 @@ CIVETWEB_API struct mg_request_info *mg_get_request_info(struct mg_connection *)
 CIVETWEB_API int mg_write(struct mg_connection *, const void *buf, size_t len);
 
 
+/* A buffer passed to mg_writev(). */
+struct mg_iovec {
+    const void *buf;
+    size_t len;
+};
+
+
+/* Send several buffers to the client, as if each of them was passed to
+   mg_write() in turn. On plain sockets, they are handed to the kernel in a
+   single sendmsg() call, so headers and body need not be copied together.
+   Return: same as mg_write(), counting the bytes of all buffers. */
+CIVETWEB_API int mg_writev(struct mg_connection *, const struct mg_iovec *iov,
+                           int iovcnt);
+
+
+/* Defer the reply to the request being handled. Called from a request
+   handler, which then returns without replying. The worker thread goes on
+   serving other connections, while this one stays open until
+   mg_complete_request() is called, from any thread, once the reply has been
+   sent with mg_write(). The connection remains valid until then, and must
+   be completed before mg_stop() is called. */
+CIVETWEB_API void mg_defer_request(struct mg_connection *);
+
+
+/* Complete a request deferred with mg_defer_request(). The connection is
+   given back to the server for its next request, or closed. */
+CIVETWEB_API void mg_complete_request(struct mg_connection *);
+
+
+/* Go on with a request deferred with mg_defer_request() on a worker thread:
+   func(conn, arg) is called there, as if from the request handler, once the
+   handler returned. func may complete the request, or leave it deferred and
+   have it resumed again later. Called from any thread, e.g. a timer thread
+   that should not write replies itself, at most once until func runs. */
+CIVETWEB_API void mg_resume_request(struct mg_connection *,
+                                    void (*func)(struct mg_connection *,
+                                                 void *),
+                                    void *arg);
+
+
 /* Send data to a websocket client wrapped in a websocket frame.  Uses mg_lock
    to ensure that the transmission is not interrupted, i.e., when the
    application is proactively communicating and responding to a request
@@ -390,6 +483,14 @@ CIVETWEB_API int mg_read(struct mg_connection *, void *buf, size_t len);
 CIVETWEB_API const char *mg_get_header(const struct mg_connection *, const char *name);
 
 
+/* Tell whether the connection serves another request once the current one
+   is replied to, given the request headers, the enable_keep_alive option
+   and whether the server is stopping. Replies written by request handlers
+   should send the matching Connection header.
+   Return: 1 to keep the connection alive, 0 to close it. */
+CIVETWEB_API int mg_should_keep_alive(const struct mg_connection *);
+
+
 /* Get a value of particular form variable.
 
    Parameters:
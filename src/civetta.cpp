@@ -1,315 +1,1294 @@
-/* Copyright (c) 2013-2014 the Civetta developers
- * Copyright (c) 2004-2013 Sergey Lyubka
- *
- * Permission is hereby granted, free of charge, to any person obtaining a copy
- * of this software and associated documentation files (the "Software"), to deal
- * in the Software without restriction, including without limitation the rights
- * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
- * copies of the Software, and to permit persons to whom the Software is
- * furnished to do so, subject to the following conditions:
- *
- * The above copyright notice and this permission notice shall be included in
- * all copies or substantial portions of the Software.
- *
- * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
- * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
- * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
- * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
- * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
- * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
- * THE SOFTWARE.
- */
-
-#include <assert.h>
-#include <map>
-#include "civetta.h"
-
-using namespace std;
-
-namespace Civetta {
-
-void Util::urlDecode(const string &src, string &dst, bool is_form_url_encoded) {
-  urlDecode(src.c_str(), src.length(), dst, is_form_url_encoded);
-}
-
-void Util::urlDecode(const char *src, string &dst, bool is_form_url_encoded) {
-  urlDecode(src, strlen(src), dst, is_form_url_encoded);
-}
-
-void Util::urlDecode(const char *src, size_t src_len, string &dst, bool is_form_url_encoded) {
-  int i, j, a, b;
-#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
-  dst.clear();
-  for (i = j = 0; i < (int)src_len; i++, j++)
-    if (src[i] == '%' && i < (int)src_len - 2 && isxdigit(*(const unsigned char *)(src + i + 1)) &&
-        isxdigit(*(const unsigned char *)(src + i + 2))) {
-      a = tolower(*(const unsigned char *)(src + i + 1));
-      b = tolower(*(const unsigned char *)(src + i + 2));
-      dst.push_back((char)((HEXTOI(a) << 4) | HEXTOI(b)));
-      i += 2;
-    } else if (is_form_url_encoded && src[i] == '+') {
-      dst.push_back(' ');
-    } else {
-      dst.push_back(src[i]);
-    }
-}
-
-void Util::urlEncode(const string &src, string &dst, bool append) {
-  urlEncode(src.c_str(), src.length(), dst, append);
-}
-
-void Util::urlEncode(const char *src, string &dst, bool append) {
-  urlEncode(src, strlen(src), dst, append);
-}
-
-void Util::urlEncode(const char *src, size_t src_len, string &dst, bool append) {
-  static const char *dont_escape = "._-$,;~()";
-  static const char *hex = "0123456789abcdef";
-
-  if (!append)
-    dst.clear();
-
-  for (; src_len > 0; src++, src_len--)
-    if (isalnum(*(const unsigned char *)src) || strchr(dont_escape, *(const unsigned char *)src) != NULL) {
-      dst.push_back(*src);
-    } else {
-      dst.push_back('%');
-      dst.push_back(hex[(*(const unsigned char *)src) >> 4]);
-      dst.push_back(hex[(*(const unsigned char *)src) & 0xf]);
-    }
-}
-
-int Server::globalHandler(struct mg_connection *conn, void *cbdata) {
-  return ((Server *)cbdata)->requestHandler(conn, cbdata);
-}
-
-Server::Server(const char **options, const struct mg_callbacks *_callbacks) : context(0), prefix("") {
-  struct mg_callbacks callbacks;
-  memset(&callbacks, 0, sizeof(callbacks));
-  if (_callbacks) {
-    callbacks = *_callbacks;
-    userCloseHandler = _callbacks->connection_close;
-  } else {
-    userCloseHandler = NULL;
-  }
-  callbacks.connection_close = closeHandler;
-
-  context = mg_start(&callbacks, this, options);
-  mg_set_request_handler(context, "", &Server::globalHandler, this);
-}
-
-Server::~Server() {
-  close();
-}
-
-void Server::setPrefix(string prefix_) {
-  prefix = prefix_;
-}
-
-void Server::closeHandler(struct mg_connection *conn) {
-  struct mg_request_info *request_info = mg_get_request_info(conn);
-  assert(request_info != NULL);
-  Server *me = (Server *)(request_info->user_data);
-  assert(me != NULL);
-
-  if (me->userCloseHandler)
-    me->userCloseHandler(conn);
-}
-
-void Server::close() {
-  if (context) {
-    mg_stop(context);
-    context = 0;
-  }
-}
-
-Callback Server::route(string httpMethod, string url, Callback callback) {
-  string key = httpMethod + ":" + prefix + url + "/?";
-  routes[key] = callback;
-  return callback;
-}
-
-int Server::requestHandler(struct mg_connection *conn, void *cbdata) {
-  struct mg_request_info *request_info = mg_get_request_info(conn);
-  assert(request_info != NULL);
-  Server *me = (Server *)(request_info->user_data);
-  assert(me != NULL);
-  smatch matches;
-  string key, data;
-  for (auto it = routes.begin(); it != routes.end(); it++) {
-    key = string(request_info->request_method) + ":" + string(request_info->uri);
-    if (regex_match(key, matches, regex(it->first))) {
-      Request *request = new Request(conn);
-      Response *response = new Response();
-      request->matches = matches;
-      it->second(*request, *response);
-      data = response->getData();
-      mg_write(conn, data.c_str(), data.size());
-      return 1;
-    }
-  }
-  return 0;
-}
-
-int Request::getCookie(const string &cookieName, string &cookieValue) {
-  // Maximum cookie length as per microsoft is 4096. http://msdn.microsoft.com/en-us/library/ms178194.aspx
-  char _cookieValue[4096];
-  const char *cookie = mg_get_header(connection, "Cookie");
-  int lRead = mg_get_cookie(cookie, cookieName.c_str(), _cookieValue, sizeof(_cookieValue));
-  cookieValue.clear();
-  cookieValue.append(_cookieValue);
-  return lRead;
-}
-
-const char *Request::getHeader(const string &headerName) {
-  return mg_get_header(connection, headerName.c_str());
-}
-
-const char *Request::getPostData() {
-  return postData;
-}
-
-bool Request::getParam(const char *name, string &dst, size_t occurrence) {
-  auto i = values.find(name);
-  if (i != values.end()) {
-    dst = i->second[occurrence];
-    return true;
-  }
-  return false;
-}
-
-vector<string> Request::getParamArray(const char *name) {
-  return values[name];
-}
-
-bool Request::getQueryParam(const char *name, string &dst, size_t occurrence) {
-  auto i = query.find(name);
-  if (i != query.end()) {
-    dst = i->second[occurrence];
-    return true;
-  }
-  return false;
-}
-
-vector<string> Request::getQueryParamArray(const char *name) {
-  return query[name];
-}
-
-map<string, vector<string> > parse_values(string data, string boundary, bool multipart = false) {
-  map<string, vector<string> > result;
-  string block, block_header, block_body, delim;
-  smatch field_name;
-  regex name_regex;
-  int start = 0, end = 0, delim_pos = 0, type;
-  if (multipart) {
-    data = "\r\n" + data;
-    boundary = "\r\n--" + boundary;
-    name_regex = regex("name=\"([^\"]+)\"");
-    delim = "\r\n\r\n";
-  } else {
-    name_regex = regex("(.+)");
-    delim = "=";
-  }
-  while (start >= 0) {
-    end = data.find(boundary, start);
-    if (end == start) {
-      start += boundary.size();
-      end = data.find(boundary, start);
-    }
-    block = data.substr(start, end - start);
-    start = end;
-    delim_pos = block.find(delim);
-    if (delim_pos < 0)
-      continue;
-    block_header = block.substr(0, delim_pos);
-    block_body = block.substr(delim_pos + delim.size());
-    if (regex_search(block_header, field_name, name_regex)) {
-      if (result.find(field_name[1]) == result.end())
-        result[field_name[1]] = vector<string>();
-      if (multipart)
-        Util::urlDecode(std::string(block_body), block_body);
-      result[field_name[1]].push_back(block_body);
-    }
-  }
-  return result;
-}
-
-Request::Request(struct mg_connection *connection_)
-    : connection(connection_), request_info(mg_get_request_info(connection_)), postData(NULL), matches() {
-  // postData
-  unsigned long con_len;
-  const char *con_len_str = mg_get_header(connection, "Content-Length");
-  if (con_len_str) {
-    con_len = atoi(con_len_str);
-    if (con_len > 0) {
-      postData = (char *)calloc(con_len, sizeof(char));
-      if (postData != NULL)
-        mg_read(connection, postData, con_len);  // malloc may fail for huge requests
-    }
-  }
-  const char* temp = mg_get_request_info(connection)->query_string;
-  if(temp!=NULL)
-    query = parse_values(temp, "&");
-  
-  temp = mg_get_header(connection, "Content-Type");
-  if(temp!=NULL){
-    string content_type = temp;
-    values = parse_values(string(postData).substr(0, con_len), content_type.substr(content_type.find("boundary=") + 9),
-                          content_type.find("multipart/form-data") >= 0);
-  }
-}
-
-Request::~Request() {
-  if (postData) {
-    free(postData);
-    postData = NULL;
-  }
-}
-
-smatch Request::getMatches() {
-  return matches;
-}
-
-Response::Response() : code(Response::codes::OK), headers() {};
-
-void Response::setHeader(string key, string value) {
-  headers[key] = value;
-}
-
-bool Response::hasHeader(string key) {
-  return headers.find(key) != headers.end();
-}
-
-string Response::getData() {
-  string body = getBody();
-  ostringstream data;
-  data << "HTTP/1.0 " << code << "\r\n";
-  if (!hasHeader("Content-Length")) {
-    ostringstream length;
-    length << body.size();
-    setHeader("Content-Length", length.str());
-  }
-  map<string, string>::iterator it;
-  for (it = headers.begin(); it != headers.end(); it++) {
-    data << (*it).first << ": " << (*it).second << "\r\n";
-  }
-  data << "\r\n";
-  data << body;
-  return data.str();
-}
-
-void Response::setCookie(string key, string value) {
-  ostringstream definition;
-  definition << key << "=" << value << "; path=/";
-  setHeader("Set-cookie", definition.str());
-}
-
-void Response::setCode(int code_) {
-  code = code_;
-}
-
-string Response::getBody() {
-  return this->str();
-}
-
-}  // namespace Civetta
+/* Copyright (c) 2013-2014 the Civetta developers
+ * Copyright (c) 2004-2013 Sergey Lyubka
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <map>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <new>
+#include "civetta.h"
+
+using namespace std;
+
+namespace Civetta {
+
+void Util::urlDecode(const string &src, string &dst, bool is_form_url_encoded) {
+  urlDecode(src.c_str(), src.length(), dst, is_form_url_encoded);
+}
+
+void Util::urlDecode(const char *src, string &dst, bool is_form_url_encoded) {
+  urlDecode(src, strlen(src), dst, is_form_url_encoded);
+}
+
+void Util::urlDecode(const char *src, size_t src_len, string &dst, bool is_form_url_encoded) {
+  int i, j, a, b;
+#define HEXTOI(x) (isdigit(x) ? x - '0' : x - 'W')
+  dst.clear();
+  for (i = j = 0; i < (int)src_len; i++, j++)
+    if (src[i] == '%' && i < (int)src_len - 2 && isxdigit(*(const unsigned char *)(src + i + 1)) &&
+        isxdigit(*(const unsigned char *)(src + i + 2))) {
+      a = tolower(*(const unsigned char *)(src + i + 1));
+      b = tolower(*(const unsigned char *)(src + i + 2));
+      dst.push_back((char)((HEXTOI(a) << 4) | HEXTOI(b)));
+      i += 2;
+    } else if (is_form_url_encoded && src[i] == '+') {
+      dst.push_back(' ');
+    } else {
+      dst.push_back(src[i]);
+    }
+}
+
+void Util::urlEncode(const string &src, string &dst, bool append) {
+  urlEncode(src.c_str(), src.length(), dst, append);
+}
+
+void Util::urlEncode(const char *src, string &dst, bool append) {
+  urlEncode(src, strlen(src), dst, append);
+}
+
+void Util::urlEncode(const char *src, size_t src_len, string &dst, bool append) {
+  static const char *dont_escape = "._-$,;~()";
+  static const char *hex = "0123456789abcdef";
+
+  if (!append)
+    dst.clear();
+
+  for (; src_len > 0; src++, src_len--)
+    if (isalnum(*(const unsigned char *)src) || strchr(dont_escape, *(const unsigned char *)src) != NULL) {
+      dst.push_back(*src);
+    } else {
+      dst.push_back('%');
+      dst.push_back(hex[(*(const unsigned char *)src) >> 4]);
+      dst.push_back(hex[(*(const unsigned char *)src) & 0xf]);
+    }
+}
+
+int Server::globalHandler(struct mg_connection *conn, void *cbdata) {
+  return ((Server *)cbdata)->requestHandler(conn, cbdata);
+}
+
+Server::Server(const char **options, const struct mg_callbacks *_callbacks) : context(0), prefix("") {
+  struct mg_callbacks callbacks;
+  memset(&callbacks, 0, sizeof(callbacks));
+  if (_callbacks) {
+    callbacks = *_callbacks;
+    userCloseHandler = _callbacks->connection_close;
+  } else {
+    userCloseHandler = NULL;
+  }
+  callbacks.connection_close = closeHandler;
+
+  context = mg_start(&callbacks, this, options);
+  mg_set_request_handler(context, "", &Server::globalHandler, this);
+}
+
+Server::~Server() {
+  close();
+}
+
+void Server::setPrefix(string prefix_) {
+  prefix = prefix_;
+}
+
+void Server::setUploadDestination(string upload_destination_) {
+  upload_destination = upload_destination_;
+}
+
+string Server::getUploadDestination() const {
+  return upload_destination;
+}
+
+void Server::closeHandler(struct mg_connection *conn) {
+  struct mg_request_info *request_info = mg_get_request_info(conn);
+  assert(request_info != NULL);
+  Server *me = (Server *)(request_info->user_data);
+  assert(me != NULL);
+
+  if (me->userCloseHandler)
+    me->userCloseHandler(conn);
+}
+
+void Server::close() {
+  if (context) {
+    mg_stop(context);
+    context = 0;
+  }
+}
+
+struct Router::Node {
+  enum Kind { STATIC, PARAM, WILDCARD };
+
+  Kind kind;
+  string label;             // literal text, or the parameter name
+  bool numeric;             // PARAM declared as :name<int>
+  bool has_callback;
+  Callback callback;
+  vector<Node *> children;  // STATIC children, each with a distinct first character
+  vector<Node *> params;    // PARAM children, tried in order
+  Node *wildcard;
+
+  Node(Kind kind_, const string &label_)
+      : kind(kind_), label(label_), numeric(false), has_callback(false), wildcard(NULL) {}
+  ~Node();
+
+  Node *insert(string text);
+  const Node *find(const char *path, size_t len, Captures &captures) const;
+};
+
+Router::Node::~Node() {
+  for (size_t i = 0; i < children.size(); i++)
+    delete children[i];
+  for (size_t i = 0; i < params.size(); i++)
+    delete params[i];
+  delete wildcard;
+}
+
+// Walks down the static children matching text, splitting edges where the
+// text diverges, and returns the node the text ends on.
+Router::Node *Router::Node::insert(string text) {
+  Node *node = this;
+  while (!text.empty()) {
+    size_t i;
+    for (i = 0; i < node->children.size() && node->children[i]->label[0] != text[0]; i++)
+      ;
+    if (i == node->children.size()) {
+      node->children.push_back(new Node(STATIC, text));
+      return node->children.back();
+    }
+    Node *child = node->children[i];
+    size_t n = 0;
+    while (n < child->label.size() && n < text.size() && child->label[n] == text[n])
+      n++;
+    if (n < child->label.size()) {
+      Node *split = new Node(STATIC, child->label.substr(0, n));
+      child->label.erase(0, n);
+      split->children.push_back(child);
+      node->children[i] = split;
+      child = split;
+    }
+    text.erase(0, n);
+    node = child;
+  }
+  return node;
+}
+
+// Matches the rest of a request path below this node. Literal children are
+// preferred over parameters, and parameters over the wildcard.
+const Router::Node *Router::Node::find(const char *path, size_t len, Captures &captures) const {
+  if (len == 0 && has_callback)
+    return this;
+
+  for (size_t i = 0; len > 0 && i < children.size(); i++) {
+    const Node *child = children[i];
+    if (child->label[0] != path[0])
+      continue;
+    if (child->label.size() <= len && memcmp(child->label.data(), path, child->label.size()) == 0) {
+      const Node *found = child->find(path + child->label.size(), len - child->label.size(), captures);
+      if (found != NULL)
+        return found;
+    }
+    break;
+  }
+
+  if (!params.empty()) {
+    const char *slash = (const char *)memchr(path, '/', len);
+    size_t segment = slash == NULL ? len : slash - path;
+    for (size_t i = 0; segment > 0 && i < params.size(); i++) {
+      const Node *param = params[i];
+      if (param->numeric && strspn(path, "0123456789") < segment)
+        continue;
+      Capture capture = {param->label.c_str(), Slice(path, segment)};
+      captures.push_back(capture);
+      const Node *found = param->find(path + segment, len - segment, captures);
+      if (found != NULL)
+        return found;
+      captures.pop_back();
+    }
+  }
+
+  if (wildcard != NULL && wildcard->has_callback) {
+    if (!wildcard->label.empty()) {
+      Capture capture = {wildcard->label.c_str(), Slice(path, len)};
+      captures.push_back(capture);
+    }
+    return wildcard;
+  }
+
+  if (len == 1 && path[0] == '/' && has_callback)
+    return this;
+  return NULL;
+}
+
+Router::Router() {
+}
+
+Router::~Router() {
+  for (size_t i = 0; i < trees.size(); i++)
+    delete trees[i].second;
+}
+
+bool Router::accepts(const string &path) {
+  for (size_t i = 0; i < path.size(); i++) {
+    if (path[i] == '*') {
+      // A wildcard has to be the whole last segment
+      if ((i > 0 && path[i - 1] != '/') || path.find('/', i) != string::npos)
+        return false;
+    } else if (strchr(".[]{}()\\+?^$|", path[i]) != NULL) {
+      return false;
+    }
+  }
+  return true;
+}
+
+void Router::add(const string &method, const string &path, const Callback &callback) {
+  Node *node = NULL;
+  for (size_t i = 0; i < trees.size() && node == NULL; i++)
+    if (trees[i].first == method)
+      node = trees[i].second;
+  if (node == NULL) {
+    node = new Node(Node::STATIC, "");
+    trees.push_back(make_pair(method, node));
+  }
+
+  size_t i = 0;
+  while (i < path.size()) {
+    bool segment_start = i == 0 || path[i - 1] == '/';
+    if (segment_start && path[i] == '*') {
+      if (node->wildcard == NULL)
+        node->wildcard = new Node(Node::WILDCARD, "");
+      node = node->wildcard;
+      node->label = path.substr(i + 1);
+      break;
+    }
+    if (segment_start && path[i] == ':') {
+      size_t end = min(path.find('/', i), path.size());
+      string name = path.substr(i + 1, end - i - 1);
+      size_t type = name.find('<');
+      bool numeric = type != string::npos && name.compare(type, string::npos, "<int>") == 0;
+      if (type != string::npos)
+        name.erase(type);
+      Node *param = NULL;
+      for (size_t j = 0; j < node->params.size() && param == NULL; j++)
+        if (node->params[j]->label == name && node->params[j]->numeric == numeric)
+          param = node->params[j];
+      if (param == NULL) {
+        param = new Node(Node::PARAM, name);
+        param->numeric = numeric;
+        // Typed parameters are more specific, so they are tried first
+        node->params.insert(numeric ? node->params.begin() : node->params.end(), param);
+      }
+      node = param;
+      i = end;
+      continue;
+    }
+    size_t end = i + 1;
+    while (end < path.size() && !(path[end - 1] == '/' && (path[end] == ':' || path[end] == '*')))
+      end++;
+    node = node->insert(path.substr(i, end - i));
+    i = end;
+  }
+  node->callback = callback;
+  node->has_callback = true;
+}
+
+const Callback *Router::find(const char *method, const char *path, Captures &captures) const {
+  for (size_t i = 0; i < trees.size(); i++) {
+    if (trees[i].first == method) {
+      const Node *node = trees[i].second->find(path, strlen(path), captures);
+      return node == NULL ? NULL : &node->callback;
+    }
+  }
+  return NULL;
+}
+
+// Returns the literal text a key must start with to match the given route
+// pattern.
+static string literal_prefix(const string &pattern) {
+  string literal;
+  for (size_t i = 0; i < pattern.size(); i++) {
+    char c = pattern[i];
+    if (strchr(".[]{}()\\*+?^$|", c) == NULL) {
+      literal.push_back(c);
+      continue;
+    }
+    // A quantifier applies to the previous character, so it is not required
+    if (!literal.empty() && strchr("?*{", c) != NULL)
+      literal.erase(literal.size() - 1);
+    break;
+  }
+  return literal;
+}
+
+Callback Server::route(string httpMethod, string url, Callback callback) {
+  string path = prefix + url;
+  if (Router::accepts(path)) {
+    router.add(httpMethod, path, callback);
+    return callback;
+  }
+  string key = httpMethod + ":" + path;
+  Route &entry = routes[key + "/?"];
+  entry.literal = literal_prefix(key);
+  entry.pattern = regex(key + "/?", regex::ECMAScript | regex::optimize);
+  entry.callback = callback;
+  return callback;
+}
+
+void Server::routeAsync(string httpMethod, string url, AsyncCallback callback) {
+  // The callback runs once the request is detached from the worker thread
+  route(httpMethod, url, [callback](Request &, Response &response) { response.async = &callback; });
+}
+
+// Checks a request key against the route, only running the regex engine when
+// the literal prefix of the route already matches.
+bool Server::Route::match(const string &key, smatch &matches) const {
+  if (key.compare(0, literal.size(), literal) != 0)
+    return false;
+  return regex_match(key, matches, pattern);
+}
+
+int Server::requestHandler(struct mg_connection *conn, void *cbdata) {
+  struct mg_request_info *request_info = mg_get_request_info(conn);
+  assert(request_info != NULL);
+  Server *me = (Server *)(request_info->user_data);
+  assert(me != NULL);
+  Arena &arena = Arena::current();
+  smatch matches;
+  Captures captures(arena);
+  string key;
+  const Route *route = NULL;
+  const Callback *callback = router.find(request_info->request_method, request_info->uri, captures);
+  if (callback == NULL && !routes.empty()) {
+    key = string(request_info->request_method) + ":" + string(request_info->uri);
+    for (auto it = routes.begin(); it != routes.end() && route == NULL; it++) {
+      if (it->second.match(key, matches))
+        route = &it->second;
+    }
+    if (route != NULL)
+      callback = &route->callback;
+  }
+  if (callback == NULL) {
+    arena.reset();
+    return 0;
+  }
+
+  Request *request = new (arena.allocate(sizeof(Request))) Request(conn);
+  Response *response = new (arena.allocate(sizeof(Response))) Response();
+  request->matches = matches;
+  request->routed = route == NULL;
+  request->captures.swap(captures);
+  if (!upload_destination.empty())
+    request->upload_destination = upload_destination.c_str();
+
+  response->connection = conn;
+  response->http11 = strcmp(mg_get_request_info(conn)->http_version, "1.1") == 0;
+  response->keep_alive = mg_should_keep_alive(conn) != 0;
+
+  (*callback)(*request, *response);
+  if (response->async != NULL) {
+    Deferred *deferred = new (arena.allocate(sizeof(Deferred))) Deferred(*request, *response);
+    if (route != NULL) {
+      deferred->key = key;
+      route->match(deferred->key, request->matches);
+    }
+    mg_defer_request(conn);
+    (*response->async)(*deferred);
+    return 1;
+  }
+  request->discardBody();
+  response->send();
+
+  response->~Response();
+  request->~Request();
+  arena.reset();
+  return 1;
+}
+
+int Request::getCookie(const string &cookieName, string &cookieValue) {
+  // Maximum cookie length as per microsoft is 4096. http://msdn.microsoft.com/en-us/library/ms178194.aspx
+  char _cookieValue[4096];
+  const char *cookie = mg_get_header(connection, "Cookie");
+  int lRead = mg_get_cookie(cookie, cookieName.c_str(), _cookieValue, sizeof(_cookieValue));
+  cookieValue.clear();
+  cookieValue.append(_cookieValue);
+  return lRead;
+}
+
+const char *Request::getHeader(const string &headerName) {
+  return mg_get_header(connection, headerName.c_str());
+}
+
+const char *Request::getPostData() {
+  readBody();
+  return postData;
+}
+
+Slice Request::getPostDataView() {
+  readBody();
+  return Slice(postData == NULL ? "" : postData, postDataLen);
+}
+
+// Finds the given occurrence of a name in decoded fields.
+static const Field *find_field(const Fields &fields, const char *name, size_t occurrence) {
+  for (size_t i = 0; i < fields.size(); i++)
+    if (fields[i].first == name && occurrence-- == 0)
+      return &fields[i];
+  return NULL;
+}
+
+static vector<string> field_array(const Fields &fields, const char *name) {
+  vector<string> result;
+  for (size_t i = 0; i < fields.size(); i++)
+    if (fields[i].first == name)
+      result.push_back(fields[i].second.str());
+  return result;
+}
+
+bool Request::getParam(const char *name, string &dst, size_t occurrence) {
+  const Field *field = find_field(getValues(), name, occurrence);
+  if (field != NULL) {
+    dst.assign(field->second.data, field->second.size);
+    return true;
+  }
+  return false;
+}
+
+Slice Request::getParamView(const char *name, size_t occurrence) {
+  const Field *field = find_field(getValues(), name, occurrence);
+  return field != NULL ? field->second : Slice();
+}
+
+vector<string> Request::getParamArray(const char *name) {
+  return field_array(getValues(), name);
+}
+
+bool Request::getQueryParam(const char *name, string &dst, size_t occurrence) {
+  const Field *field = find_field(getQuery(), name, occurrence);
+  if (field != NULL) {
+    dst.assign(field->second.data, field->second.size);
+    return true;
+  }
+  return false;
+}
+
+Slice Request::getQueryParamView(const char *name, size_t occurrence) {
+  const Field *field = find_field(getQuery(), name, occurrence);
+  return field != NULL ? field->second : Slice();
+}
+
+vector<string> Request::getQueryParamArray(const char *name) {
+  return field_array(getQuery(), name);
+}
+
+// Url-decodes a string. Strings without escapes are returned as they are, so
+// the result only points into the arena when something had to be decoded.
+static Slice decode(Arena &arena, const char *src, size_t len) {
+  if (memchr(src, '%', len) == NULL && memchr(src, '+', len) == NULL)
+    return Slice(src, len);
+  char *dst = (char *)arena.allocate(len + 1);
+  int n = mg_url_decode(src, (int)len, dst, (int)len + 1, 1);
+  return Slice(dst, n < 0 ? 0 : n);
+}
+
+// Parses application/x-www-form-urlencoded data, like a query string.
+static void parse_urlencoded(Arena &arena, const char *data, size_t len, Fields &fields) {
+  const char *end = data + len;
+  while (data < end) {
+    const char *amp = (const char *)memchr(data, '&', end - data);
+    const char *pair_end = amp == NULL ? end : amp;
+    const char *eq = (const char *)memchr(data, '=', pair_end - data);
+    if (eq != NULL)
+      fields.push_back(Field(decode(arena, data, eq - data), decode(arena, eq + 1, pair_end - eq - 1)));
+    data = pair_end + 1;
+  }
+}
+
+MultipartParser::MultipartParser(Slice boundary, Handler &handler_)
+    : handler(handler_), state(PREAMBLE), delimiter_len(0), matched(2), headers_len(0) {
+  if (boundary.empty() || boundary.size > sizeof(delimiter) - 4) {
+    state = FAILED;
+    return;
+  }
+  memcpy(delimiter, "\r\n--", 4);
+  memcpy(delimiter + 4, boundary.data, boundary.size);
+  delimiter_len = boundary.size + 4;
+  // The first boundary is not preceded by a line break, so the parser starts
+  // as if the "\r\n" of the delimiter had already been seen.
+}
+
+Slice MultipartParser::getBoundary(const char *content_type) {
+  const char *boundary = content_type == NULL ? NULL : strstr(content_type, "boundary=");
+  if (boundary == NULL)
+    return Slice();
+  boundary += 9;
+  if (*boundary == '"') {
+    const char *end = strchr(++boundary, '"');
+    return end == NULL ? Slice() : Slice(boundary, end - boundary);
+  }
+  return Slice(boundary, strcspn(boundary, "; \t"));
+}
+
+bool MultipartParser::feed(const char *data, size_t len) {
+  const char *end = data + len;
+  while (data < end && state != DONE && state != FAILED) {
+    switch (state) {
+      case PREAMBLE:
+      case BODY:
+        data = scanBody(data, end);
+        break;
+      case BOUNDARY_END:
+        // A delimiter is followed by "--" on the last one, or a line break
+        headers[headers_len++] = *data++;
+        if (headers_len == 2) {
+          if (memcmp(headers, "--", 2) == 0)
+            state = DONE;
+          else if (memcmp(headers, "\r\n", 2) == 0)
+            state = HEADERS;
+          else
+            state = FAILED;
+          headers_len = 0;
+        }
+        break;
+      case HEADERS:
+        data = scanHeaders(data, end);
+        break;
+      default:
+        break;
+    }
+  }
+  return state != FAILED;
+}
+
+// Passes body data on until the next delimiter. A delimiter cut by the end of
+// the chunk is held back until the next chunk tells whether it is one.
+const char *MultipartParser::scanBody(const char *data, const char *end) {
+  if (matched > 0) {
+    size_t n = min(delimiter_len - matched, (size_t)(end - data));
+    if (memcmp(data, delimiter + matched, n) == 0) {
+      matched += n;
+      if (matched < delimiter_len)
+        return end;
+      matched = 0;
+      if (state == BODY)
+        handler.onPartEnd();
+      state = BOUNDARY_END;
+      return data + n;
+    }
+    // The held back bytes were data after all. A delimiter cannot start
+    // inside them, since '\r' only appears at its beginning.
+    if (state == BODY)
+      handler.onPartData(delimiter, matched);
+    matched = 0;
+  }
+
+  for (const char *p = data; (p = (const char *)memchr(p, '\r', end - p)) != NULL; p++) {
+    size_t n = min(delimiter_len, (size_t)(end - p));
+    if (memcmp(p, delimiter, n) != 0)
+      continue;
+    if (state == BODY && p > data)
+      handler.onPartData(data, p - data);
+    if (n < delimiter_len) {
+      matched = n;
+      return end;
+    }
+    if (state == BODY)
+      handler.onPartEnd();
+    state = BOUNDARY_END;
+    return p + delimiter_len;
+  }
+  if (state == BODY)
+    handler.onPartData(data, end - data);
+  return end;
+}
+
+const char *MultipartParser::scanHeaders(const char *data, const char *end) {
+  while (data < end) {
+    if (headers_len == sizeof(headers)) {
+      state = FAILED;
+      return end;
+    }
+    headers[headers_len++] = *data++;
+    if (headers_len >= 2 && memcmp(headers + headers_len - 2, "\r\n", 2) == 0 &&
+        (headers_len == 2 || (headers_len >= 4 && memcmp(headers + headers_len - 4, "\r\n", 2) == 0))) {
+      parseHeaders();
+      headers_len = 0;
+      state = BODY;
+      handler.onPartBegin(part);
+      return data;
+    }
+  }
+  return end;
+}
+
+// Finds a parameter such as name="value" in a header value.
+static Slice header_param(const char *p, const char *end, const char *key) {
+  size_t key_len = strlen(key);
+  while (p < end) {
+    while (p < end && (*p == ' ' || *p == ';'))
+      p++;
+    const char *value = p + key_len + 1;
+    bool found = value <= end && mg_strncasecmp(p, key, key_len) == 0 && p[key_len] == '=';
+    const char *value_end = found ? value : p;
+    if (value_end < end && *value_end == '"') {
+      const char *quote = (const char *)memchr(value_end + 1, '"', end - value_end - 1);
+      value_end = quote == NULL ? end : quote;
+      if (found)
+        return Slice(value + 1, value_end - value - 1);
+    }
+    while (value_end < end && *value_end != ';')
+      value_end++;
+    if (found)
+      return Slice(value, value_end - value);
+    p = value_end;
+  }
+  return Slice();
+}
+
+void MultipartParser::parseHeaders() {
+  part = Part();
+  const char *end = headers + headers_len;
+  for (const char *line = headers; line < end;) {
+    const char *eol = (const char *)memchr(line, '\r', end - line);
+    eol = eol == NULL ? end : eol;
+    const char *colon = (const char *)memchr(line, ':', eol - line);
+    if (colon != NULL) {
+      const char *value = colon + 1;
+      while (value < eol && *value == ' ')
+        value++;
+      if (colon - line == 19 && mg_strncasecmp(line, "Content-Disposition", 19) == 0) {
+        part.name = header_param(value, eol, "name");
+        part.filename = header_param(value, eol, "filename");
+      } else if (colon - line == 12 && mg_strncasecmp(line, "Content-Type", 12) == 0) {
+        part.content_type = Slice(value, eol - value);
+      }
+    }
+    line = eol + 2;
+  }
+}
+
+/**
+  Stores the parts of a multipart body for a Request: plain fields in the
+  request arena, uploaded files on disk or in the request part handler.
+*/
+class PartStore : public MultipartParser::Handler {
+ public:
+  PartStore(Request &request_) : request(request_), forward(false), fp(NULL), data(NULL), size(0), capacity(0) {}
+
+  void onPartBegin(const Part &part) {
+    name = request.arena.copy(part.name.data, part.name.size);
+    forward = false;
+    fp = NULL;
+    data = NULL;
+    size = capacity = 0;
+    if (part.filename.empty())
+      return;
+    if (request.part_handler != NULL) {
+      forward = true;
+      request.part_handler->onPartBegin(part);
+    } else if (request.upload_destination != NULL) {
+      openFile(part.filename);
+    }
+  }
+
+  void onPartData(const char *buf, size_t len) {
+    if (forward) {
+      request.part_handler->onPartData(buf, len);
+    } else if (fp != NULL) {
+      fwrite(buf, 1, len, fp);
+    } else {
+      // Truncated so that memory use stays bounded, see Request::max_field_size
+      append(buf, min(len, Request::max_field_size - size));
+    }
+  }
+
+  void onPartEnd() {
+    if (forward) {
+      request.part_handler->onPartEnd();
+      return;
+    }
+    if (fp != NULL) {
+      fclose(fp);
+      request.upload_filepaths.push_back(path.str());
+      request.values.push_back(Field(name, path));
+    } else {
+      request.values.push_back(Field(name, Slice(data == NULL ? "" : data, size)));
+    }
+  }
+
+ private:
+  // Opens the destination file, without letting the client pick a directory.
+  void openFile(Slice filename) {
+    size_t i = filename.size;
+    while (i > 0 && filename.data[i - 1] != '/' && filename.data[i - 1] != '\\')
+      i--;
+    Slice base(filename.data + i, filename.size - i);
+    if (base.empty() || base == "." || base == "..")
+      return;
+    size_t dir_len = strlen(request.upload_destination);
+    char *p = (char *)request.arena.allocate(dir_len + base.size + 2);
+    sprintf(p, "%s/%.*s", request.upload_destination, (int)base.size, base.data);
+    path = Slice(p, dir_len + base.size + 1);
+    fp = fopen(p, "wb");
+  }
+
+  void append(const char *buf, size_t len) {
+    if (size + len > capacity) {
+      capacity = max(max(capacity * 2, size + len), (size_t)256);
+      char *grown = (char *)request.arena.allocate(capacity);
+      if (size > 0)
+        memcpy(grown, data, size);
+      data = grown;
+    }
+    memcpy(data + size, buf, len);
+    size += len;
+  }
+
+  Request &request;
+  Slice name;
+  bool forward;
+  FILE *fp;
+  Slice path;
+  char *data;
+  size_t size;
+  size_t capacity;
+};
+
+Request::Request(struct mg_connection *connection_)
+    : request_info(mg_get_request_info(connection_)),
+      arena(Arena::current()),
+      postData(NULL),
+      postDataLen(0),
+      body_read(false),
+      values_parsed(false),
+      query_parsed(false),
+      values(arena),
+      query(arena),
+      connection(connection_),
+      matches(),
+      captures(arena),
+      upload_destination(NULL),
+      part_handler(NULL),
+      started(),
+      routed(false) {
+}
+
+Request::~Request() {
+}
+
+// Reads the body into the arena. The Content-Length comes from the client:
+// a body that is malformed, or too large to allocate, is left unread and
+// getPostData() returns NULL, as when the baseline calloc() failed.
+void Request::readBody() {
+  if (body_read)
+    return;
+  body_read = true;
+  const char *con_len_str = mg_get_header(connection, "Content-Length");
+  if (con_len_str == NULL || *con_len_str < '0' || *con_len_str > '9')
+    return;
+  errno = 0;
+  char *digits_end;
+  unsigned long long con_len = strtoull(con_len_str, &digits_end, 10);
+  if (con_len == 0 || errno == ERANGE || *digits_end != '\0' || con_len >= (unsigned long long)~(size_t)0)
+    return;
+  if ((postData = (char *)arena.tryAllocate((size_t)con_len + 1)) == NULL)
+    return;
+  // mg_read() returns an int, so larger bodies are read in several calls
+  int n;
+  while (postDataLen < con_len &&
+         (n = mg_read(connection, postData + postDataLen, min((size_t)con_len - postDataLen, (size_t)1 << 30))) > 0)
+    postDataLen += (size_t)n;
+  postData[postDataLen] = '\0';
+}
+
+// Skips what the handler did not read of the body, so the next request on a
+// kept alive connection starts at the right place.
+void Request::discardBody() {
+  if (mg_get_header(connection, "Content-Length") == NULL)
+    return;
+  char buf[4096];
+  while (mg_read(connection, buf, sizeof(buf)) > 0)
+    ;
+}
+
+const Fields &Request::getValues() {
+  if (!values_parsed) {
+    values_parsed = true;
+    const char *content_type = mg_get_header(connection, "Content-Type");
+    if (content_type != NULL && strstr(content_type, "multipart/form-data") != NULL) {
+      PartStore store(*this);
+      MultipartParser parser(MultipartParser::getBoundary(content_type), store);
+      if (body_read) {
+        parser.feed(postData, postDataLen);
+      } else {
+        body_read = true;
+        char buf[8192];
+        int n;
+        while ((n = mg_read(connection, buf, sizeof(buf))) > 0)
+          parser.feed(buf, n);
+      }
+    } else if (content_type != NULL && strstr(content_type, "application/x-www-form-urlencoded") != NULL) {
+      readBody();
+      if (postData != NULL)
+        parse_urlencoded(arena, postData, postDataLen, values);
+    }
+  }
+  return values;
+}
+
+const Fields &Request::getQuery() {
+  if (!query_parsed) {
+    query_parsed = true;
+    if (request_info->query_string != NULL)
+      parse_urlencoded(arena, request_info->query_string, strlen(request_info->query_string), query);
+  }
+  return query;
+}
+
+vector<string> Request::getUploads(string destination_path) {
+  if (!values_parsed && upload_destination == NULL)
+    upload_destination = arena.copy(destination_path.data(), destination_path.size()).data;
+  getValues();
+  return upload_filepaths;
+}
+
+void Request::setPartHandler(MultipartParser::Handler *handler) {
+  part_handler = handler;
+}
+
+smatch Request::getMatches() {
+  if (routed && matches.empty()) {
+    // Router paths have no groups, so the whole key is the only match
+    static const regex whole("[\\s\\S]*");
+    key = string(request_info->request_method) + ":" + request_info->uri;
+    regex_match(key, matches, whole);
+  }
+  return matches;
+}
+
+Slice Request::getCapture(const char *name) const {
+  for (size_t i = 0; i < captures.size(); i++)
+    if (strcmp(captures[i].name, name) == 0)
+      return captures[i].value;
+  return Slice();
+}
+
+bool Request::getCapture(const char *name, long &dst) const {
+  Slice value = getCapture(name);
+  if (value.empty() || strspn(value.data, "0123456789") < value.size)
+    return false;
+  dst = 0;
+  for (size_t i = 0; i < value.size; i++)
+    dst = dst * 10 + (value.data[i] - '0');
+  return true;
+}
+
+bool Slice::operator==(const char *other) const {
+  return strlen(other) == size && (size == 0 || memcmp(data, other, size) == 0);
+}
+
+ostream &operator<<(ostream &os, const Slice &slice) {
+  return os.write(slice.data, slice.size);
+}
+
+Arena::Arena(size_t block_size_)
+    : block_size(block_size_), first(NULL), block(NULL), large(NULL), ptr(NULL), end(NULL) {
+}
+
+Arena::~Arena() {
+  reset();
+  while (first != NULL) {
+    Block *next = first->next;
+    free(first);
+    first = next;
+  }
+}
+
+static atomic<unsigned long> arena_allocations(0);
+
+// Block headers are padded so the memory after them stays aligned.
+static const size_t arena_alignment = 16;
+static const size_t block_header = (sizeof(void *) + sizeof(size_t) + arena_alignment - 1) & ~(arena_alignment - 1);
+
+Arena::Block *Arena::newBlock(size_t size) {
+  Block *b = (Block *)malloc(block_header + size);
+  if (b == NULL)
+    return NULL;
+  b->next = NULL;
+  b->size = size;
+  arena_allocations++;
+  return b;
+}
+
+void *Arena::allocate(size_t size) {
+  void *result = tryAllocate(size);
+  if (result == NULL)
+    throw bad_alloc();
+  return result;
+}
+
+void *Arena::tryAllocate(size_t size) {
+  // Rounding up and adding the block header must not wrap around
+  if (size > ~(size_t)0 - block_header - arena_alignment)
+    return NULL;
+  size = (size + arena_alignment - 1) & ~(arena_alignment - 1);
+  if (size > block_size / 4) {
+    Block *b = newBlock(size);
+    if (b == NULL)
+      return NULL;
+    b->next = large;
+    large = b;
+    return (char *)b + block_header;
+  }
+  if (size > (size_t)(end - ptr)) {
+    Block *next = block == NULL ? first : block->next;
+    if (next == NULL && (next = newBlock(block_size)) == NULL)
+      return NULL;
+    if (block == NULL)
+      first = next;
+    else
+      block->next = next;
+    block = next;
+    ptr = (char *)block + block_header;
+    end = ptr + block->size;
+  }
+  void *result = ptr;
+  ptr += size;
+  return result;
+}
+
+Slice Arena::copy(const char *data, size_t size) {
+  char *dst = (char *)allocate(size + 1);
+  memcpy(dst, data, size);
+  dst[size] = '\0';
+  return Slice(dst, size);
+}
+
+void Arena::reset() {
+  while (large != NULL) {
+    Block *next = large->next;
+    free(large);
+    large = next;
+  }
+  block = NULL;
+  ptr = end = NULL;
+}
+
+static thread_local unique_ptr<Arena> thread_arena;
+
+Arena &Arena::current() {
+  if (!thread_arena)
+    thread_arena.reset(new Arena());
+  return *thread_arena;
+}
+
+Arena *Arena::detach() {
+  current();
+  return thread_arena.release();
+}
+
+unsigned long Arena::allocations() {
+  return arena_allocations;
+}
+
+Response::Buffer::Buffer(Arena &arena_) : arena(arena_) {
+}
+
+void Response::Buffer::reserve(size_t size) {
+  size_t used = pptr() - pbase();
+  size_t capacity = epptr() - pbase();
+  if (used + size <= capacity)
+    return;
+  capacity = max(max(capacity * 2, used + size), (size_t)256);
+  char *data = (char *)arena.allocate(capacity);
+  if (used > 0)
+    memcpy(data, pbase(), used);
+  setp(data, data + capacity);
+  pbump((int)used);
+}
+
+Response::Buffer::int_type Response::Buffer::overflow(int_type c) {
+  if (traits_type::eq_int_type(c, traits_type::eof()))
+    return traits_type::not_eof(c);
+  reserve(1);
+  *pptr() = traits_type::to_char_type(c);
+  pbump(1);
+  return c;
+}
+
+streamsize Response::Buffer::xsputn(const char *s, streamsize n) {
+  reserve(n);
+  memcpy(pptr(), s, n);
+  pbump((int)n);
+  return n;
+}
+
+Response::Response()
+    : std::ostream(NULL),
+      arena(Arena::current()),
+      buffer(arena),
+      code(Response::codes::OK),
+      headers(arena),
+      connection(NULL),
+      http11(false),
+      keep_alive(false),
+      streaming(false),
+      chunked(false),
+      async(NULL) {
+  rdbuf(&buffer);
+}
+
+void Response::setHeader(Slice key, Slice value) {
+  for (size_t i = 0; i < headers.size(); i++) {
+    if (headers[i].first.size == key.size && mg_strncasecmp(headers[i].first.data, key.data, key.size) == 0) {
+      headers[i].second = arena.copy(value.data, value.size);
+      return;
+    }
+  }
+  headers.push_back(Field(arena.copy(key.data, key.size), arena.copy(value.data, value.size)));
+}
+
+void Response::setHeader(const string &key, const string &value) {
+  setHeader(Slice(key.data(), key.size()), Slice(value.data(), value.size()));
+}
+
+void Response::setHeader(const char *key, const char *value) {
+  setHeader(Slice(key, strlen(key)), Slice(value, strlen(value)));
+}
+
+bool Response::hasHeader(const string &key) const {
+  for (size_t i = 0; i < headers.size(); i++)
+    if (headers[i].first.size == key.size() && mg_strncasecmp(headers[i].first.data, key.data(), key.size()) == 0)
+      return true;
+  return false;
+}
+
+size_t Response::headersSize() const {
+  size_t size = 128;
+  for (size_t i = 0; i < headers.size(); i++)
+    size += headers[i].first.size + headers[i].second.size + 4;
+  return size;
+}
+
+size_t Response::writeHeaders(char *buf) const {
+  char *p = buf + sprintf(buf, "HTTP/1.%d %d\r\n", http11 ? 1 : 0, code);
+  if (chunked)
+    p += sprintf(p, "Transfer-Encoding: chunked\r\n");
+  else if (!hasHeader("Content-Length"))
+    p += sprintf(p, "Content-Length: %lu\r\n", (unsigned long)buffer.data().size);
+  if (connection != NULL && !hasHeader("Connection"))
+    p += sprintf(p, "Connection: %s\r\n", keep_alive ? "keep-alive" : "close");
+  for (size_t i = 0; i < headers.size(); i++) {
+    memcpy(p, headers[i].first.data, headers[i].first.size);
+    p += headers[i].first.size;
+    *p++ = ':';
+    *p++ = ' ';
+    memcpy(p, headers[i].second.data, headers[i].second.size);
+    p += headers[i].second.size;
+    *p++ = '\r';
+    *p++ = '\n';
+  }
+  *p++ = '\r';
+  *p++ = '\n';
+  return p - buf;
+}
+
+Slice Response::serialize() {
+  Slice body = getBodyView();
+  char *data = (char *)arena.allocate(headersSize() + body.size);
+  size_t size = writeHeaders(data);
+  if (body.size > 0)
+    memcpy(data + size, body.data, body.size);
+  return Slice(data, size + body.size);
+}
+
+void Response::send() {
+  if (streaming) {
+    sendBody();
+    if (chunked)
+      mg_write(connection, "0\r\n\r\n", 5);
+    return;
+  }
+  char stack[1024];
+  size_t size = headersSize();
+  char *head = size <= sizeof(stack) ? stack : (char *)arena.allocate(size);
+  Slice body = getBodyView();
+  struct mg_iovec iov[2] = {{head, writeHeaders(head)}, {body.data, body.size}};
+  mg_writev(connection, iov, body.size > 0 ? 2 : 1);
+}
+
+void Response::sendHeaders() {
+  char stack[1024];
+  size_t size = headersSize();
+  char *head = size <= sizeof(stack) ? stack : (char *)arena.allocate(size);
+  mg_write(connection, head, writeHeaders(head));
+}
+
+// Sends the buffered body, as one chunk when chunked, and empties the buffer
+// so it is reused for what comes next.
+void Response::sendBody() {
+  Slice body = getBodyView();
+  if (body.empty())
+    return;  // an empty chunk would end the body
+  if (chunked) {
+    char size[20];
+    struct mg_iovec iov[3] = {{size, (size_t)sprintf(size, "%lx\r\n", (unsigned long)body.size)},
+                              {body.data, body.size},
+                              {"\r\n", 2}};
+    mg_writev(connection, iov, 3);
+  } else {
+    mg_write(connection, body.data, body.size);
+  }
+  buffer.clear();
+}
+
+Response &Response::flush() {
+  if (connection == NULL)
+    return *this;
+  if (!streaming) {
+    if (!hasHeader("Content-Length")) {
+      if (!http11)
+        return *this;
+      chunked = true;
+    }
+    streaming = true;
+    sendHeaders();
+  }
+  sendBody();
+  return *this;
+}
+
+Deferred::Deferred(Request &request_, Response &response_)
+    : arena(Arena::detach()), request(request_), response(response_), resumeFunc(NULL), resumeArg(NULL) {
+}
+
+Deferred::~Deferred() {
+  response.~Response();
+  request.~Request();
+}
+
+void Deferred::resume(void (*func)(void *arg), void *arg) {
+  resumeFunc = func;
+  resumeArg = arg;
+  mg_resume_request(response.connection, resumed, this);
+}
+
+void Deferred::resumed(struct mg_connection *, void *deferred) {
+  Deferred *self = static_cast<Deferred *>(deferred);
+  self->resumeFunc(self->resumeArg);
+}
+
+void Deferred::complete() {
+  struct mg_connection *connection = response.connection;
+  request.discardBody();
+  response.send();
+  Arena *owner = arena;
+  this->~Deferred();
+  delete owner;
+  mg_complete_request(connection);
+}
+
+Histogram::Histogram() {
+  for (int i = 0; i < buckets; i++)
+    counts[i] = 0;
+}
+
+void Histogram::record(unsigned long micros) {
+  int bucket = 0;
+  while (micros > 0 && bucket < buckets - 1) {
+    micros >>= 1;
+    bucket++;
+  }
+  counts[bucket].fetch_add(1, std::memory_order_relaxed);
+}
+
+unsigned long Histogram::count(int bucket) const {
+  return counts[bucket].load(std::memory_order_relaxed);
+}
+
+unsigned long Histogram::total() const {
+  unsigned long total = 0;
+  for (int i = 0; i < buckets; i++)
+    total += count(i);
+  return total;
+}
+
+unsigned long Histogram::percentile(double p) const {
+  unsigned long total = this->total();
+  if (total == 0)
+    return 0;
+  double target = total * p / 100;
+  unsigned long seen = 0;
+  for (int i = 0; i < buckets; i++) {
+    seen += count(i);
+    if (seen > 0 && seen >= target)
+      return 1UL << i;
+  }
+  return 1UL << (buckets - 1);
+}
+
+Timing::Timing(Histogram &histogram_) : histogram(&histogram_) {
+}
+
+bool Timing::before(Request &request, Response &) const {
+  request.started = std::chrono::steady_clock::now();
+  return true;
+}
+
+void Timing::after(Request &request, Response &) const {
+  std::chrono::steady_clock::duration elapsed = std::chrono::steady_clock::now() - request.started;
+  histogram->record((unsigned long)std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count());
+}
+
+string Response::getData() {
+  return serialize().str();
+}
+
+void Response::setCookie(const string &key, const string &value) {
+  static const char suffix[] = "; path=/";
+  size_t size = key.size() + 1 + value.size() + sizeof(suffix) - 1;
+  char *definition = (char *)arena.allocate(size + 1);
+  sprintf(definition, "%s=%s%s", key.c_str(), value.c_str(), suffix);
+  setHeader(Slice("Set-cookie", 10), Slice(definition, size));
+}
+
+void Response::setCode(int code_) {
+  code = code_;
+}
+
+string Response::getBody() {
+  return getBodyView().str();
+}
+
+Slice Response::getBodyView() const {
+  return buffer.data();
+}
+
+string Response::str() const {
+  return getBodyView().str();
+}
+
+}  // namespace Civetta
@@ -27,6 +27,7 @@
 #else
 #ifdef __linux__
 #define _XOPEN_SOURCE 600     /* For flockfile() on Linux */
+#define _GNU_SOURCE           /* For SO_REUSEPORT, CPU affinity on Linux */
 #endif
 #ifndef _LARGEFILE_SOURCE
 #define _LARGEFILE_SOURCE     /* For fseeko(), ftello() */
@@ -89,6 +90,12 @@
 #include <stddef.h>
 #include <stdio.h>
 
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
 #ifndef MAX_WORKER_THREADS
 #define MAX_WORKER_THREADS 1024
 #endif
@@ -265,6 +272,7 @@ struct pollfd {
 #include <sys/socket.h>
 #include <sys/poll.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <arpa/inet.h>
 #include <sys/time.h>
 #include <sys/utsname.h>
@@ -279,6 +287,18 @@ typedef unsigned short int in_port_t;
 #include <pwd.h>
 #include <unistd.h>
 #include <dirent.h>
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define HAVE_EPOLL /* Idle keep-alive connections wait in epoll */
+#include <sys/epoll.h>
+#endif
+#if defined(__linux__) && !defined(NO_SENDFILE)
+#define HAVE_SENDFILE /* Files and pipes go to sockets without a copy */
+#include <sys/sendfile.h>
+#endif
+#if defined(__linux__) && !defined(NO_INOTIFY)
+#define HAVE_INOTIFY /* The stat cache follows the document root */
+#include <sys/inotify.h>
+#endif
 #if !defined(NO_SSL_DL) && !defined(NO_SSL)
 #include <dlfcn.h>
 #endif
@@ -515,9 +535,12 @@ typedef int socklen_t;
 #define PATH_MAX 4096
 #endif
 
-/* Size of the accepted socket queue */
+/* Size of the accepted socket queue, a power of two */
 #if !defined(MGSQLEN)
-#define MGSQLEN 20
+#define MGSQLEN 256
+#endif
+#if (MGSQLEN & (MGSQLEN - 1)) != 0
+#error MGSQLEN must be a power of two
 #endif
 
 static const char *http_500_error = "Internal Server Error";
@@ -666,8 +689,14 @@ enum {
     PROTECT_URI, AUTHENTICATION_DOMAIN, SSI_EXTENSIONS, THROTTLE,
     ACCESS_LOG_FILE, ENABLE_DIRECTORY_LISTING, ERROR_LOG_FILE,
     GLOBAL_PASSWORDS_FILE, INDEX_FILES, ENABLE_KEEP_ALIVE, ACCESS_CONTROL_LIST,
-    EXTRA_MIME_TYPES, LISTENING_PORTS, DOCUMENT_ROOT, SSL_CERTIFICATE,
-    NUM_THREADS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
+    EXTRA_MIME_TYPES, LISTENING_PORTS, LISTENING_SOCKETS, DOCUMENT_ROOT,
+    SSL_CERTIFICATE,
+    NUM_THREADS, MIN_THREADS, MAX_THREADS, THREAD_IDLE_TIMEOUT,
+    NUM_ACCEPTORS, NUM_SHARDS, RUN_AS_USER, REWRITE, HIDE_FILES, REQUEST_TIMEOUT,
+    TCP_DEFER_ACCEPT_SECONDS, TCP_NO_DELAY, TCP_QUICK_ACK, TCP_FAST_OPEN,
+    SOCKET_SEND_BUFFER, SOCKET_RECEIVE_BUFFER, LISTEN_BACKLOG, ENABLE_SENDFILE,
+    FILE_CACHE_SIZE, FILE_CACHE_MAX_FILE_SIZE, FILE_CACHE_REVALIDATE_MS,
+    ENABLE_STAT_CACHE,
 
 #if defined(USE_LUA)
     LUA_PRELOAD_FILE, LUA_SCRIPT_EXTENSIONS, LUA_SERVER_PAGE_EXTENSIONS,
@@ -707,13 +736,31 @@ static struct mg_option config_options[] = {
     {"access_control_list",         12345,                     NULL},
     {"extra_mime_types",            12345,                     NULL},
     {"listening_ports",             12345,                     "8080"},
+    {"listening_sockets",           CONFIG_TYPE_STRING,        NULL},
     {"document_root",               CONFIG_TYPE_DIRECTORY,     NULL},
     {"ssl_certificate",             CONFIG_TYPE_FILE,          NULL},
     {"num_threads",                 CONFIG_TYPE_NUMBER,        "50"},
+    {"min_threads",                 CONFIG_TYPE_NUMBER,        NULL},
+    {"max_threads",                 CONFIG_TYPE_NUMBER,        NULL},
+    {"thread_idle_timeout_ms",      CONFIG_TYPE_NUMBER,        "10000"},
+    {"num_acceptors",               CONFIG_TYPE_NUMBER,        "1"},
+    {"num_shards",                  CONFIG_TYPE_NUMBER,        "0"},
     {"run_as_user",                 CONFIG_TYPE_STRING,        NULL},
     {"url_rewrite_patterns",        12345,                     NULL},
     {"hide_files_patterns",         12345,                     NULL},
     {"request_timeout_ms",          CONFIG_TYPE_NUMBER,        "30000"},
+    {"tcp_defer_accept",            CONFIG_TYPE_NUMBER,        "0"},
+    {"tcp_nodelay",                 CONFIG_TYPE_BOOLEAN,       "no"},
+    {"tcp_quickack",                CONFIG_TYPE_BOOLEAN,       "no"},
+    {"tcp_fastopen",                CONFIG_TYPE_NUMBER,        "0"},
+    {"socket_send_buffer",          CONFIG_TYPE_NUMBER,        "0"},
+    {"socket_receive_buffer",       CONFIG_TYPE_NUMBER,        "0"},
+    {"listen_backlog",              CONFIG_TYPE_NUMBER,        NULL},
+    {"enable_sendfile",             CONFIG_TYPE_BOOLEAN,       "yes"},
+    {"file_cache_size",             CONFIG_TYPE_NUMBER,        "0"},
+    {"file_cache_max_file_size",    CONFIG_TYPE_NUMBER,        "262144"},
+    {"file_cache_revalidate_ms",    CONFIG_TYPE_NUMBER,        "1000"},
+    {"enable_stat_cache",           CONFIG_TYPE_BOOLEAN,       "no"},
 
 #if defined(USE_LUA)
     {"lua_preload_file",            CONFIG_TYPE_FILE,          NULL},
@@ -739,8 +786,157 @@ struct mg_request_handler_info {
     struct mg_request_handler_info *next;
 };
 
+/* A slot of the socket queue. seq equals the position of the next producer
+   while the slot is free, and that position + 1 once the entry is stored. */
+struct sq_slot {
+    volatile unsigned long seq;
+    struct socket sock;          /* Accepted socket, */
+    struct mg_connection *conn;  /* or connection ready for its next request */
+};
+
+/* Accepted sockets waiting for a group of worker threads. Pushing and
+   popping are lock-free, the mutex is only taken to sleep and wake up. */
+struct socket_queue {
+    struct sq_slot slots[MGSQLEN];
+    volatile unsigned long head;     /* Next position to produce */
+    volatile unsigned long tail;     /* Next position to consume */
+    volatile unsigned long idle;     /* Workers waiting on sq_full */
+    volatile unsigned long blocked;  /* Producers waiting on sq_empty */
+    pthread_mutex_t mutex;
+    pthread_cond_t sq_full;    /* Signaled when socket is produced */
+    pthread_cond_t sq_empty;   /* Signaled when socket is consumed */
+    struct mg_connection *resumed_head; /* Resumed connections that found */
+    struct mg_connection *resumed_tail; /* the queue full, FIFO */
+};
+
+/* A worker thread slot */
+struct mg_worker {
+    struct mg_context *ctx;
+    struct socket_queue *queue;  /* Where the thread takes sockets from */
+    pthread_t thread_id;
+    int state;                   /* WORKER_* */
+};
+
+enum {
+    WORKER_FREE,     /* The slot is unused */
+    WORKER_RUNNING,
+    WORKER_RETIRED   /* The thread exited after being idle, join it */
+};
+
+/* A thread accepting connections on its own listening sockets */
+struct mg_acceptor {
+    struct mg_context *ctx;
+    struct socket *listening_sockets; /* num_listening_sockets of them */
+    struct socket_queue *queue;       /* Where accepted sockets go */
+    pthread_t thread_id;
+};
+
+#define FILE_CACHE_SHARDS 16
+#define FILE_CACHE_BUCKETS 256  /* Per shard, a power of two */
+
+/* A static file held in memory with the headers describing it */
+struct file_cache_entry {
+    struct file_cache_entry *next;      /* In the hash bucket */
+    struct file_cache_entry *lru_prev;  /* Toward the most recently used */
+    struct file_cache_entry *lru_next;  /* Toward the least recently used */
+    unsigned hash;
+    int refs;                  /* 1 while cached, plus 1 per connection
+                                  serving it */
+    int64_t size;
+    time_t modification_time;
+    double validated;          /* Monotonic time of the last stat() */
+    const char *path;
+    const char *headers;       /* Last-Modified, Etag and Content-Type */
+    size_t headers_len;
+    char *data;                /* size bytes */
+};
+
+struct file_cache_shard {
+    pthread_mutex_t mutex;
+    struct file_cache_entry *buckets[FILE_CACHE_BUCKETS];
+    struct file_cache_entry *lru_head;
+    struct file_cache_entry *lru_tail;
+    int64_t used;              /* Size of the cached files */
+    unsigned long files, hits, misses, evictions;
+};
+
+/* Hot static files, hashed by path to shards with their own lock and their
+   share of the memory budget */
+struct file_cache {
+    struct file_cache_shard shards[FILE_CACHE_SHARDS];
+    int64_t shard_budget;
+    int64_t max_file_size;
+    double revalidate;         /* In seconds */
+};
+
+/* An extension of the extra_mime_types option */
+struct extra_mime_type {
+    struct vec ext;
+    struct vec mime;
+    int next;                  /* In the hash bucket, -1 at the end */
+};
+
+/* The extra_mime_types option, parsed by mg_start(). Extensions made of a
+   dot and no other dot are looked up by hash, the others are matched as
+   suffixes of the path, as listed. */
+struct extra_mime_types {
+    int num_types;
+    int num_suffixes;
+    unsigned mask;             /* Number of buckets minus one */
+    struct extra_mime_type *types;
+    int *buckets;              /* First type of each bucket, -1 for none */
+    int *suffixes;             /* Types matched as suffixes, in order */
+};
+
+#if defined(HAVE_INOTIFY)
+#define STAT_CACHE_SHARD_ENTRIES 4096  /* A full shard is emptied */
+#define STAT_CACHE_DIR_BUCKETS 1024    /* A power of two */
+
+/* The outcome of stat() for a path, which may not exist */
+struct stat_cache_entry {
+    struct stat_cache_entry *next;  /* In the hash bucket */
+    unsigned hash;
+    int exists;
+    int is_directory;
+    int64_t size;
+    time_t modification_time;
+    char path[1];                   /* Allocated to length */
+};
+
+struct stat_cache_shard {
+    pthread_mutex_t mutex;
+    struct stat_cache_entry *buckets[FILE_CACHE_BUCKETS];
+    int num_entries;
+    unsigned long generation;  /* Bumped when entries may have changed */
+};
+
+/* A directory of the document root tree watched with inotify */
+struct watched_dir {
+    struct watched_dir *next;  /* In the hash bucket */
+    unsigned hash;
+    int wd;
+    char path[1];              /* Allocated to length */
+};
+
+/* Metadata of the document root tree, kept coherent by a thread reading
+   inotify events. Paths are only cached once their directory is watched. */
+struct stat_cache {
+    struct stat_cache_shard shards[FILE_CACHE_SHARDS];
+    pthread_mutex_t dirs_mutex;     /* Protects the fields below */
+    struct watched_dir *dirs[STAT_CACHE_DIR_BUCKETS];
+    struct watched_dir **dirs_by_wd;
+    int dirs_by_wd_size;
+    int inotify_fd;
+    pthread_t thread_id;
+    char *root;                     /* Without trailing slashes */
+    size_t root_len;
+};
+#endif
+
 struct mg_context {
     volatile int stop_flag;         /* Should we stop event loop */
+    volatile int draining;          /* 1 when stopping gracefully, 2 once
+                                       the listeners are closed */
     void *ssllib_dll_handle;        /* Store the ssl library handle. */
     void *cryptolib_dll_handle;     /* Store the crypto library handle. */
     SSL_CTX *ssl_ctx;               /* SSL context */
@@ -753,17 +949,34 @@ struct mg_context {
     int num_listening_sockets;
 
     volatile int num_threads;  /* Number of threads */
+    int min_threads;           /* Idle threads retire down to min_threads, */
+    int max_threads;           /* and busy queues get up to max_threads */
+    int thread_idle_timeout;   /* In milliseconds */
+    volatile int retired;      /* Some worker threads retired */
     pthread_mutex_t mutex;     /* Protects (max|num)_threads */
     pthread_cond_t  cond;      /* Condvar for tracking workers terminations */
 
-    struct socket queue[MGSQLEN];   /* Accepted sockets */
-    volatile int sq_head;      /* Head of the socket queue */
-    volatile int sq_tail;      /* Tail of the socket queue */
-    pthread_cond_t sq_full;    /* Signaled when socket is produced */
-    pthread_cond_t sq_empty;   /* Signaled when socket is consumed */
+    struct socket_queue *queues; /* One per group of worker threads */
+    int num_queues;
+    int sharded;               /* Connections are hashed to the queues */
+    struct mg_acceptor *acceptors; /* The master thread is acceptor 0, */
+    int num_acceptors;             /* the others have their own thread */
+#if defined(HAVE_EPOLL)
+    int epoll_fd;              /* Idle keep-alive connections, or -1 */
+    pthread_t reactorthreadid; /* Thread waiting for their next request */
+    struct mg_connection *idle_head; /* Idle keep-alive connections, */
+    struct mg_connection *idle_tail; /* oldest first */
+#endif
+    struct mg_connection *spare_conns; /* Freed worker connections kept */
+    int num_spare_conns;               /* for reuse, up to max_threads */
     pthread_t masterthreadid;  /* The master thread ID. */
-    int workerthreadcount;     /* The amount of worker threads. */
-    pthread_t *workerthreadids;/* The worker thread IDs. */
+    struct mg_worker *workers; /* max_threads worker thread slots */
+    struct file_cache *file_cache; /* NULL if file_cache_size is 0 */
+    struct extra_mime_types *extra_mime_types; /* NULL if not set */
+#if defined(HAVE_INOTIFY)
+    struct stat_cache *stat_cache; /* NULL unless enable_stat_cache */
+#endif
+    volatile unsigned long open_connections; /* Accepted, not closed yet */
 
     unsigned long start_time;  /* Server start time, used for authentication */
     unsigned long nonce_count; /* Used nonces, used for authentication */
@@ -779,6 +992,8 @@ struct mg_context {
 #endif
 };
 
+#define NUM_HEADER_SLOTS 64  /* A power of two */
+
 struct mg_connection {
     struct mg_request_info request_info;
     struct mg_context *ctx;
@@ -802,11 +1017,38 @@ struct mg_connection {
     int64_t last_throttle_bytes;/* Bytes sent this second */
     pthread_mutex_t mutex;      /* Used by mg_lock/mg_unlock to ensure atomic
                                    transmissions for websockets */
+    int headers_indexed;        /* header_index is up to date */
+    unsigned char header_index[NUM_HEADER_SLOTS]; /* Position plus one of
+                                   the first header of each slot */
+    struct file_cache_entry *cached_file; /* Held until the end of the
+                                   request */
+    time_t date_time;           /* When date was formatted */
+    char date[32];              /* Date header value, see current_date() */
+    int deferred;               /* DEFER_*, see mg_defer_request() */
+    void (*resume_func)(struct mg_connection *, void *);
+    void *resume_arg;           /* See mg_resume_request() */
+    struct socket_queue *queue; /* Where to go once resumed */
+    struct mg_connection *next_resumed;
+#if defined(HAVE_EPOLL)
+    int registered;             /* The socket is in ctx->epoll_fd */
+    double idle_since;          /* When the connection became idle, as
+                                   monotonic_seconds() */
+    struct mg_connection *idle_prev, *idle_next;
+#endif
 #if defined(USE_LUA) && defined(USE_WEBSOCKET)
     void * lua_websocket_state; /* Lua_State for a websocket connection */
 #endif
 };
 
+/* States of a request whose reply is deferred */
+enum {
+    DEFER_NONE,       /* Not deferred */
+    DEFER_HANDLER,    /* The worker thread is still in the request handler */
+    DEFER_PARKED,     /* The worker thread let go of the connection */
+    DEFER_COMPLETED,  /* Completed before the worker thread let go */
+    DEFER_RESUMED     /* resume_func is to be called by a worker thread */
+};
+
 static pthread_key_t sTlsKey;  /* Thread local storage index */
 static int sTlsInit = 0;
 
@@ -891,6 +1133,17 @@ static void mg_fclose(struct file *filep)
     }
 }
 
+/* FNV-1a hash of the first len bytes of path */
+static unsigned hash_path(const char *path, size_t len)
+{
+    unsigned hash = 2166136261U;
+
+    while (len-- > 0) {
+        hash = (hash ^ (unsigned char) *path++) * 16777619U;
+    }
+    return hash;
+}
+
 static void mg_strlcpy(register char *dst, register const char *src, size_t n)
 {
     for (; *src != '\0' && n > 1; n--) {
@@ -1051,18 +1304,67 @@ static void sockaddr_to_string(char *buf, size_t len,
 #endif
 }
 
-/* Convert time_t to a string. According to RFC2616, Sec 14.18, this must be included in all responses other than 100, 101, 5xx. */
+/* Convert time_t to a string. According to RFC2616, Sec 14.18, this must be included in all responses other than 100, 101, 5xx.
+   The date is computed by hand rather than with gmtime() and strftime(),
+   which share a static buffer between threads and follow the locale. */
 static void gmt_time_string(char *buf, size_t buf_len, time_t *t)
 {
-    struct tm *tm;
-
-    tm = gmtime(t);
-    if (tm != NULL) {
-        strftime(buf, buf_len, "%a, %d %b %Y %H:%M:%S GMT", tm);
-    } else {
+    static const char *wdays = "SunMonTueWedThuFriSat";
+    static const char *months = "JanFebMarAprMayJunJulAugSepOctNovDec";
+    char s[30];
+    int64_t days, secs, era, doe, yoe, doy, mp, year, month, mday;
+
+    /* Civil date from days since the epoch, proleptic Gregorian calendar */
+    days = (int64_t) *t / 86400;
+    secs = (int64_t) *t % 86400;
+    if (secs < 0) {
+        secs += 86400;
+        days--;
+    }
+    era = (days + 719468 >= 0 ? days + 719468 : days + 719468 - 146096) / 146097;
+    doe = days + 719468 - era * 146097;
+    yoe = (doe - doe / 1460 + doe / 36524 - doe / 146096) / 365;
+    doy = doe - (365 * yoe + yoe / 4 - yoe / 100);
+    mp = (5 * doy + 2) / 153;
+    mday = doy - (153 * mp + 2) / 5 + 1;
+    month = mp < 10 ? mp + 3 : mp - 9;
+    year = yoe + era * 400 + (month <= 2);
+
+    if (year < 0 || year > 9999) {
         mg_strlcpy(buf, "Thu, 01 Jan 1970 00:00:00 GMT", buf_len);
-        buf[buf_len - 1] = '\0';
+        return;
+    }
+    memcpy(s, wdays + 3 * ((days % 7 + 11) % 7), 3);
+    memcpy(s + 3, ", 00 ", 5);
+    s[5] = (char) ('0' + mday / 10);
+    s[6] = (char) ('0' + mday % 10);
+    memcpy(s + 8, months + 3 * (month - 1), 3);
+    s[11] = ' ';
+    s[12] = (char) ('0' + year / 1000);
+    s[13] = (char) ('0' + year / 100 % 10);
+    s[14] = (char) ('0' + year / 10 % 10);
+    s[15] = (char) ('0' + year % 10);
+    memcpy(s + 16, " 00:00:00 GMT", 14);
+    s[17] = (char) ('0' + secs / 36000);
+    s[18] = (char) ('0' + secs / 3600 % 10);
+    s[20] = (char) ('0' + secs % 3600 / 600);
+    s[21] = (char) ('0' + secs % 3600 / 60 % 10);
+    s[23] = (char) ('0' + secs % 60 / 10);
+    s[24] = (char) ('0' + secs % 10);
+    mg_strlcpy(buf, s, buf_len);
+}
+
+/* Returns the Date header value for now. It is formatted once a second at
+   most, by the thread serving the connection. */
+static const char *current_date(struct mg_connection *conn)
+{
+    time_t now = time(NULL);
+
+    if (conn->date[0] == '\0' || now != conn->date_time) {
+        gmt_time_string(conn->date, sizeof(conn->date), &now);
+        conn->date_time = now;
     }
+    return conn->date;
 }
 
 /* Print error message to the opened error log stream. */
@@ -1193,9 +1495,54 @@ static const char *get_header(const struct mg_request_info *ri,
     return NULL;
 }
 
+/* Slot of a header name in the index of a connection. The headers looked
+   up the most, Accept(-Encoding|-Language), Authorization, Cache-Control,
+   Connection, Content-(Encoding|Length|Range|Type), Cookie, Depth, Expect,
+   Host, If-Modified-Since, If-None-Match, Keep-Alive, Location, Origin,
+   Pragma, Range, Referer, Sec-WebSocket-(Key|Protocol|Version), Status,
+   Transfer-Encoding, Upgrade, User-Agent and X-Forwarded-For, all have
+   their own. */
+static int header_slot(const char *name, size_t len)
+{
+    return (int) ((len * 45 + lowercase(name) * 51 +
+                   lowercase(name + len - 1)) & (NUM_HEADER_SLOTS - 1));
+}
+
+/* Records the position of the first header of each slot, so that
+   mg_get_header() compares one header name instead of all of them */
+static void index_headers(struct mg_connection *conn)
+{
+    const struct mg_request_info *ri = &conn->request_info;
+    int i, slot;
+
+    memset(conn->header_index, 0, sizeof(conn->header_index));
+    for (i = 0; i < ri->num_headers; i++) {
+        slot = header_slot(ri->http_headers[i].name,
+                           strlen(ri->http_headers[i].name));
+        if (conn->header_index[slot] == 0) {
+            conn->header_index[slot] = (unsigned char) (i + 1);
+        }
+    }
+    conn->headers_indexed = 1;
+}
+
 const char *mg_get_header(const struct mg_connection *conn, const char *name)
 {
-    return get_header(&conn->request_info, name);
+    const struct mg_request_info *ri = &conn->request_info;
+    size_t len = strlen(name);
+    int i;
+
+    if (conn->headers_indexed && len > 0) {
+        /* No header in the slot means no header of that name */
+        if ((i = conn->header_index[header_slot(name, len)]) == 0) {
+            return NULL;
+        } else if (i <= ri->num_headers &&
+                   !mg_strcasecmp(name, ri->http_headers[i - 1].name)) {
+            return ri->http_headers[i - 1].value;
+        }
+        /* Another name took the slot first */
+    }
+    return get_header(ri, name);
 }
 
 /* A helper function for traversing a comma separated list of values.
@@ -1287,6 +1634,7 @@ static int should_keep_alive(const struct mg_connection *conn)
     const char *http_version = conn->request_info.http_version;
     const char *header = mg_get_header(conn, "Connection");
     if (conn->must_close ||
+        conn->ctx->draining ||
         conn->status_code == 401 ||
         mg_strcasecmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") != 0 ||
         (header != NULL && mg_strcasecmp(header, "keep-alive") != 0) ||
@@ -1296,6 +1644,13 @@ static int should_keep_alive(const struct mg_connection *conn)
     return 1;
 }
 
+int mg_should_keep_alive(const struct mg_connection *conn)
+{
+    return conn->ctx->stop_flag == 0 &&
+           !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes") &&
+           conn->content_len >= 0 && should_keep_alive(conn);
+}
+
 static const char *suggest_connection_header(const struct mg_connection *conn)
 {
     return should_keep_alive(conn) ? "keep-alive" : "close";
@@ -1312,16 +1667,12 @@ static void send_http_error(struct mg_connection *conn, int status,
     char buf[MG_BUF_LEN];
     va_list ap;
     int len = 0;
-    char date[64];
-    time_t curtime = time(NULL);
 
     conn->status_code = status;
     if (conn->ctx->callbacks.http_error == NULL ||
         conn->ctx->callbacks.http_error(conn, status)) {
         buf[0] = '\0';
 
-        gmt_time_string(date, sizeof(date), &curtime);
-
         /* Errors 1xx, 204 and 304 MUST NOT send a body */
         if (status > 199 && status != 204 && status != 304) {
             len = mg_snprintf(conn, buf, sizeof(buf), "Error %d: %s", status, reason);
@@ -1337,7 +1688,7 @@ static void send_http_error(struct mg_connection *conn, int status,
                         "Content-Length: %d\r\n"
                         "Date: %s\r\n"
                         "Connection: %s\r\n\r\n",
-                        status, reason, len, date,
+                        status, reason, len, current_date(conn),
                         suggest_connection_header(conn));
         conn->num_bytes_sent += mg_printf(conn, "%s", buf);
     }
@@ -1934,163 +2285,629 @@ static int set_non_blocking_mode(SOCKET sock)
 }
 
 #else
-static int mg_stat(struct mg_connection *conn, const char *path,
-                   struct file *filep)
-{
-    struct stat st;
+#if defined(HAVE_INOTIFY)
+#define STAT_CACHE_EVENTS (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | \
+                           IN_DELETE | IN_MODIFY | IN_MOVE_SELF | \
+                           IN_MOVED_FROM | IN_MOVED_TO)
 
-    if (!is_file_in_memory(conn, path, filep) && !stat(path, &st)) {
-        filep->size = st.st_size;
-        filep->modification_time = st.st_mtime;
-        filep->is_directory = S_ISDIR(st.st_mode);
-    } else {
-        filep->modification_time = (time_t) 0;
-    }
+static struct stat_cache_shard *stat_cache_shard(struct stat_cache *sc,
+                                                 unsigned hash)
+{
+    return &sc->shards[hash % FILE_CACHE_SHARDS];
+}
 
-    return filep->membuf != NULL || filep->modification_time != (time_t) 0;
+static struct stat_cache_entry **stat_cache_bucket(
+    struct stat_cache_shard *shard, unsigned hash)
+{
+    return &shard->buckets[(hash / FILE_CACHE_SHARDS) &
+                           (FILE_CACHE_BUCKETS - 1)];
 }
 
-static void set_close_on_exec(int fd, struct mg_connection *conn /* may be null */)
+/* The shard lock must be held */
+static void stat_cache_clear_shard(struct stat_cache_shard *shard)
 {
-    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
-        if (conn)
-            mg_cry(conn, "%s: fcntl(F_SETFD FD_CLOEXEC) failed: %s",
-                   __func__, strerror(ERRNO));
+    struct stat_cache_entry *e, *next;
+    int i;
+
+    for (i = 0; i < FILE_CACHE_BUCKETS; i++) {
+        for (e = shard->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            mg_free(e);
+        }
+        shard->buckets[i] = NULL;
     }
+    shard->num_entries = 0;
+    shard->generation++;
 }
 
-int mg_start_thread(mg_thread_func_t func, void *param)
+/* Drops every entry, or with flush == 0 only makes the lookups in flight
+   discard what they found */
+static void stat_cache_clear(struct stat_cache *sc, int flush)
 {
-    pthread_t thread_id;
-    pthread_attr_t attr;
-    int result;
-
-    (void) pthread_attr_init(&attr);
-    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+    int i;
 
-#if defined(USE_STACK_SIZE) && (USE_STACK_SIZE > 1)
-    /* Compile-time option to control stack size,
-       e.g. -DUSE_STACK_SIZE=16384 */
-    (void) pthread_attr_setstacksize(&attr, USE_STACK_SIZE);
-#endif /* defined(USE_STACK_SIZE) && (USE_STACK_SIZE > 1) */
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        (void) pthread_mutex_lock(&sc->shards[i].mutex);
+        if (flush) {
+            stat_cache_clear_shard(&sc->shards[i]);
+        } else {
+            sc->shards[i].generation++;
+        }
+        (void) pthread_mutex_unlock(&sc->shards[i].mutex);
+    }
+}
 
-    result = pthread_create(&thread_id, &attr, func, param);
-    pthread_attr_destroy(&attr);
+/* Returns path without repeated slashes, e.g. after a document_root
+   ending with a slash, in buf if needed */
+static const char *collapse_slashes(const char *path, char *buf,
+                                    size_t buf_len)
+{
+    char *p = buf;
 
-    return result;
+    if (strstr(path, "//") == NULL || strlen(path) >= buf_len) {
+        return path;
+    }
+    for (; *path != '\0'; path++) {
+        if (*path != '/' || p == buf || p[-1] != '/') {
+            *p++ = *path;
+        }
+    }
+    *p = '\0';
+    return buf;
 }
 
-/* Start a thread storing the thread context. */
-
-static int mg_start_thread_with_id(mg_thread_func_t func, void *param,
-                                   pthread_t *threadidptr)
+static void stat_cache_remove(struct stat_cache *sc, const char *path,
+                              size_t len)
 {
-    pthread_t thread_id;
-    pthread_attr_t attr;
-    int result;
+    unsigned hash = hash_path(path, len);
+    struct stat_cache_shard *shard = stat_cache_shard(sc, hash);
+    struct stat_cache_entry **p, *e;
 
-    (void) pthread_attr_init(&attr);
+    (void) pthread_mutex_lock(&shard->mutex);
+    for (p = stat_cache_bucket(shard, hash); (e = *p) != NULL; p = &e->next) {
+        if (e->hash == hash && !strncmp(e->path, path, len) &&
+            e->path[len] == '\0') {
+            *p = e->next;
+            shard->num_entries--;
+            mg_free(e);
+            break;
+        }
+    }
+    shard->generation++;
+    (void) pthread_mutex_unlock(&shard->mutex);
+}
 
-#if defined(USE_STACK_SIZE) && (USE_STACK_SIZE > 1)
-    /* Compile-time option to control stack size,
-       e.g. -DUSE_STACK_SIZE=16384 */
-    (void) pthread_attr_setstacksize(&attr, USE_STACK_SIZE);
-#endif /* defined(USE_STACK_SIZE) && USE_STACK_SIZE > 1 */
+/* The dirs lock must be held */
+static struct watched_dir *find_watched_dir(struct stat_cache *sc,
+                                            const char *path, size_t len)
+{
+    unsigned hash = hash_path(path, len);
+    struct watched_dir *d;
 
-    result = pthread_create(&thread_id, &attr, func, param);
-    pthread_attr_destroy(&attr);
-    if (threadidptr != NULL) {
-        *threadidptr = thread_id;
+    for (d = sc->dirs[hash & (STAT_CACHE_DIR_BUCKETS - 1)]; d != NULL;
+         d = d->next) {
+        if (d->hash == hash && !strncmp(d->path, path, len) &&
+            d->path[len] == '\0') {
+            break;
+        }
     }
-    return result;
+    return d;
 }
 
-/* Wait for a thread to finish. */
-
-static int mg_join_thread(pthread_t threadid)
+/* Returns the length of the directory part of path if it can be cached:
+   path is in the document root and its directory is watched. Returns 0
+   otherwise. */
+static size_t stat_cache_dir_len(struct stat_cache *sc, const char *path)
 {
-    int result;
+    const char *slash = strrchr(path, '/');
+    size_t len = slash == NULL ? 0 : (size_t) (slash - path);
+    int watched;
 
-    result = pthread_join(threadid, NULL);
-    return result;
+    if (len < sc->root_len || slash[1] == '\0' ||
+        strncmp(path, sc->root, sc->root_len) != 0 ||
+        path[sc->root_len] != '/') {
+        return 0;
+    }
+    (void) pthread_mutex_lock(&sc->dirs_mutex);
+    watched = find_watched_dir(sc, path, len) != NULL;
+    (void) pthread_mutex_unlock(&sc->dirs_mutex);
+    return watched ? len : 0;
 }
 
-#ifndef NO_CGI
-static pid_t spawn_process(struct mg_connection *conn, const char *prog,
-                           char *envblk, char *envp[], int fdin,
-                           int fdout, const char *dir)
+/* Watches path, and the directories below it, for changes. Called by the
+   stat cache thread only. */
+static void watch_tree(struct mg_context *ctx, char *path, size_t len)
 {
-    pid_t pid;
-    const char *interp;
+    struct stat_cache *sc = ctx->stat_cache;
+    struct watched_dir *d, **by_wd;
+    struct dirent *dp;
+    struct stat st;
+    DIR *dirp;
+    int wd, size;
 
-    (void) envblk;
+    wd = inotify_add_watch(sc->inotify_fd, path,
+                           STAT_CACHE_EVENTS | IN_ONLYDIR | IN_DONT_FOLLOW);
+    if (wd < 0) {
+        mg_cry(fc(ctx), "inotify_add_watch(%s): %s", path, strerror(ERRNO));
+        return;
+    }
 
-    if ((pid = fork()) == -1) {
-        /* Parent */
-        send_http_error(conn, 500, http_500_error, "fork(): %s", strerror(ERRNO));
-    } else if (pid == 0) {
-        /* Child */
-        if (chdir(dir) != 0) {
-            mg_cry(conn, "%s: chdir(%s): %s", __func__, dir, strerror(ERRNO));
-        } else if (dup2(fdin, 0) == -1) {
-            mg_cry(conn, "%s: dup2(%d, 0): %s", __func__, fdin, strerror(ERRNO));
-        } else if (dup2(fdout, 1) == -1) {
-            mg_cry(conn, "%s: dup2(%d, 1): %s", __func__, fdout, strerror(ERRNO));
-        } else {
-            /* Not redirecting stderr to stdout, to avoid output being littered
-               with the error messages. */
-            (void) close(fdin);
-            (void) close(fdout);
+    (void) pthread_mutex_lock(&sc->dirs_mutex);
+    if (wd >= sc->dirs_by_wd_size) {
+        size = wd * 2 + 64;
+        if ((by_wd = (struct watched_dir **)
+             mg_realloc(sc->dirs_by_wd, size * sizeof(*by_wd))) != NULL) {
+            memset(by_wd + sc->dirs_by_wd_size, 0,
+                   (size - sc->dirs_by_wd_size) * sizeof(*by_wd));
+            sc->dirs_by_wd = by_wd;
+            sc->dirs_by_wd_size = size;
+        }
+    }
+    d = NULL;
+    if (wd < sc->dirs_by_wd_size && sc->dirs_by_wd[wd] == NULL &&
+        (d = (struct watched_dir *) mg_malloc(sizeof(*d) + len)) != NULL) {
+        memcpy(d->path, path, len + 1);
+        d->hash = hash_path(path, len);
+        d->wd = wd;
+        d->next = sc->dirs[d->hash & (STAT_CACHE_DIR_BUCKETS - 1)];
+        sc->dirs[d->hash & (STAT_CACHE_DIR_BUCKETS - 1)] = d;
+        sc->dirs_by_wd[wd] = d;
+    }
+    (void) pthread_mutex_unlock(&sc->dirs_mutex);
+    if (d == NULL) {
+        return;
+    }
 
-            /* After exec, all signal handlers are restored to their default
-               values, with one exception of SIGCHLD. According to
-               POSIX.1-2001 and Linux's implementation, SIGCHLD's handler will
-               leave unchanged after exec if it was set to be ignored. Restore
-               it to default action. */
-            signal(SIGCHLD, SIG_DFL);
+    /* A lookup that stat()-ed an entry of the directory before it was
+       watched must not cache it */
+    stat_cache_clear(sc, 0);
 
-            interp = conn->ctx->config[CGI_INTERPRETER];
-            if (interp == NULL) {
-                (void) execle(prog, prog, NULL, envp);
-                mg_cry(conn, "%s: execle(%s): %s", __func__, prog, strerror(ERRNO));
-            } else {
-                (void) execle(interp, interp, prog, NULL, envp);
-                mg_cry(conn, "%s: execle(%s %s): %s", __func__, interp, prog,
-                       strerror(ERRNO));
-            }
+    if ((dirp = opendir(path)) == NULL) {
+        return;
+    }
+    while ((dp = readdir(dirp)) != NULL) {
+        if (!strcmp(dp->d_name, ".") || !strcmp(dp->d_name, "..") ||
+            len + strlen(dp->d_name) + 2 > PATH_MAX) {
+            continue;
         }
-        exit(EXIT_FAILURE);
+        path[len] = '/';
+        strcpy(path + len + 1, dp->d_name);
+        if (dp->d_type == DT_DIR ||
+            (dp->d_type == DT_UNKNOWN && lstat(path, &st) == 0 &&
+             S_ISDIR(st.st_mode))) {
+            watch_tree(ctx, path, len + 1 + strlen(dp->d_name));
+        }
+        path[len] = '\0';
     }
-
-    return pid;
+    (void) closedir(dirp);
 }
-#endif /* !NO_CGI */
 
-static int set_non_blocking_mode(SOCKET sock)
+/* Forgets all watched directories. Called by the stat cache thread only. */
+static void unwatch_all(struct stat_cache *sc)
 {
-    int flags;
-
-    flags = fcntl(sock, F_GETFL, 0);
-    (void) fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+    struct watched_dir *d, *next;
+    int i;
 
-    return 0;
+    (void) pthread_mutex_lock(&sc->dirs_mutex);
+    for (i = 0; i < STAT_CACHE_DIR_BUCKETS; i++) {
+        for (d = sc->dirs[i]; d != NULL; d = next) {
+            next = d->next;
+            (void) inotify_rm_watch(sc->inotify_fd, d->wd);
+            mg_free(d);
+        }
+        sc->dirs[i] = NULL;
+    }
+    if (sc->dirs_by_wd != NULL) {
+        memset(sc->dirs_by_wd, 0, sc->dirs_by_wd_size * sizeof(*sc->dirs_by_wd));
+    }
+    (void) pthread_mutex_unlock(&sc->dirs_mutex);
 }
-#endif /* _WIN32 */
 
-/* Write data to the IO channel - opened file descriptor, socket or SSL
-   descriptor. Return number of bytes written. */
-static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
-                    int64_t len)
+/* Forgets the directory removed from the tree with the watch wd */
+static void unwatch_dir(struct stat_cache *sc, int wd)
 {
-    int64_t sent;
-    int n, k;
+    struct watched_dir **p, *d;
 
-    (void) ssl;  /* Get rid of warning */
-    sent = 0;
-    while (sent < len) {
+    (void) pthread_mutex_lock(&sc->dirs_mutex);
+    if (wd >= 0 && wd < sc->dirs_by_wd_size &&
+        (d = sc->dirs_by_wd[wd]) != NULL) {
+        for (p = &sc->dirs[d->hash & (STAT_CACHE_DIR_BUCKETS - 1)]; *p != d;
+             p = &(*p)->next) {
+        }
+        *p = d->next;
+        sc->dirs_by_wd[wd] = NULL;
+        mg_free(d);
+    }
+    (void) pthread_mutex_unlock(&sc->dirs_mutex);
+}
 
-        /* How many bytes we send in this iteration */
-        k = len - sent > INT_MAX ? INT_MAX : (int) (len - sent);
+static void stat_cache_event(struct mg_context *ctx,
+                             const struct inotify_event *ev)
+{
+    struct stat_cache *sc = ctx->stat_cache;
+    char path[PATH_MAX];
+    size_t len = 0, name_len;
+
+    if (ev->mask & IN_Q_OVERFLOW) {
+        stat_cache_clear(sc, 1);
+        return;
+    }
+    if (ev->mask & IN_IGNORED) {
+        /* The directory was removed: so are the entries below it */
+        unwatch_dir(sc, ev->wd);
+        stat_cache_clear(sc, 1);
+        return;
+    }
+    if (ev->mask & IN_MOVE_SELF) {
+        /* The paths of the directories below it changed */
+        unwatch_all(sc);
+        stat_cache_clear(sc, 1);
+        memcpy(path, sc->root, sc->root_len + 1);
+        watch_tree(ctx, path, sc->root_len);
+        return;
+    }
+
+    (void) pthread_mutex_lock(&sc->dirs_mutex);
+    if (ev->wd >= 0 && ev->wd < sc->dirs_by_wd_size &&
+        sc->dirs_by_wd[ev->wd] != NULL) {
+        len = strlen(sc->dirs_by_wd[ev->wd]->path);
+        memcpy(path, sc->dirs_by_wd[ev->wd]->path, len + 1);
+    }
+    (void) pthread_mutex_unlock(&sc->dirs_mutex);
+    name_len = ev->len > 0 ? strlen(ev->name) : 0;
+    if (len == 0 || len + name_len + 2 > PATH_MAX) {
+        return;
+    }
+
+    /* The directory changed too, unless only the file's contents did */
+    if (!(ev->mask & (IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB))) {
+        stat_cache_remove(sc, path, len);
+    }
+    if (name_len > 0) {
+        path[len] = '/';
+        memcpy(path + len + 1, ev->name, name_len + 1);
+        stat_cache_remove(sc, path, len + 1 + name_len);
+        if ((ev->mask & IN_ISDIR) && (ev->mask & (IN_CREATE | IN_MOVED_TO))) {
+            watch_tree(ctx, path, len + 1 + name_len);
+        }
+    }
+}
+
+static void stat_cache_thread_run(struct mg_context *ctx)
+{
+    struct stat_cache *sc = ctx->stat_cache;
+    union {
+        struct inotify_event ev;
+        char buf[16384];
+    } u;
+    const struct inotify_event *ev;
+    char path[PATH_MAX];
+    struct pollfd pfd;
+    ssize_t i, n;
+
+    memcpy(path, sc->root, sc->root_len + 1);
+    watch_tree(ctx, path, sc->root_len);
+
+    pfd.fd = sc->inotify_fd;
+    pfd.events = POLLIN;
+    while (ctx->stop_flag == 0) {
+        if (poll(&pfd, 1, 200) <= 0 ||
+            (n = read(sc->inotify_fd, u.buf, sizeof(u.buf))) <= 0) {
+            continue;
+        }
+        for (i = 0; i < n; i += sizeof(*ev) + ev->len) {
+            ev = (const struct inotify_event *) (u.buf + i);
+            stat_cache_event(ctx, ev);
+        }
+    }
+}
+
+static void *stat_cache_thread(void *thread_func_param)
+{
+    stat_cache_thread_run((struct mg_context *) thread_func_param);
+    return NULL;
+}
+
+static struct stat_cache *stat_cache_create(struct mg_context *ctx)
+{
+    struct stat_cache *sc;
+    const char *root = ctx->config[DOCUMENT_ROOT];
+    size_t len = strlen(root);
+    int i;
+
+    while (len > 1 && root[len - 1] == '/') {
+        len--;
+    }
+    if ((sc = (struct stat_cache *) mg_calloc(1, sizeof(*sc))) == NULL) {
+        return NULL;
+    }
+    if ((sc->root = mg_strndup(root, len)) == NULL ||
+        (sc->inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC)) < 0) {
+        mg_free(sc->root);
+        mg_free(sc);
+        return NULL;
+    }
+    sc->root_len = len;
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        (void) pthread_mutex_init(&sc->shards[i].mutex, NULL);
+    }
+    (void) pthread_mutex_init(&sc->dirs_mutex, NULL);
+    return sc;
+}
+
+static void stat_cache_destroy(struct stat_cache *sc)
+{
+    int i;
+
+    unwatch_all(sc);
+    stat_cache_clear(sc, 1);
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        (void) pthread_mutex_destroy(&sc->shards[i].mutex);
+    }
+    (void) pthread_mutex_destroy(&sc->dirs_mutex);
+    (void) close(sc->inotify_fd);
+    mg_free(sc->dirs_by_wd);
+    mg_free(sc->root);
+    mg_free(sc);
+}
+
+/* Fills filep from the cache, or with lstat() when path is not cached.
+   Symbolic links are stat()-ed every time: their target may be out of
+   the watched tree. Returns 0 if path does not exist. */
+static int stat_cache_stat(struct mg_context *ctx, const char *path,
+                           struct file *filep)
+{
+    struct stat_cache *sc = ctx->stat_cache;
+    struct stat_cache_shard *shard;
+    struct stat_cache_entry *e;
+    struct stat st;
+    unsigned long generation;
+    unsigned hash;
+    size_t len;
+    int exists = -1, is_link;
+    char buf[PATH_MAX];
+
+    path = collapse_slashes(path, buf, sizeof(buf));
+    len = strlen(path);
+    hash = hash_path(path, len);
+    shard = stat_cache_shard(sc, hash);
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    for (e = *stat_cache_bucket(shard, hash); e != NULL; e = e->next) {
+        if (e->hash == hash && !strcmp(e->path, path)) {
+            filep->size = e->size;
+            filep->modification_time = e->modification_time;
+            filep->is_directory = e->is_directory;
+            exists = e->exists;
+            break;
+        }
+    }
+    generation = shard->generation;
+    (void) pthread_mutex_unlock(&shard->mutex);
+    if (exists >= 0) {
+        return exists;
+    }
+
+    if (lstat(path, &st) == 0) {
+        is_link = S_ISLNK(st.st_mode);
+        if (is_link && stat(path, &st) != 0) {
+            return 0;
+        }
+        filep->size = st.st_size;
+        filep->modification_time = st.st_mtime;
+        filep->is_directory = S_ISDIR(st.st_mode);
+        if (is_link) {
+            return 1;
+        }
+        exists = 1;
+    } else if (ERRNO == ENOENT || ERRNO == ENOTDIR) {
+        exists = 0;
+    } else {
+        return 0;
+    }
+
+    /* Unless an event about the path came in meanwhile */
+    if (stat_cache_dir_len(sc, path) > 0 &&
+        (e = (struct stat_cache_entry *) mg_malloc(sizeof(*e) + len)) != NULL) {
+        e->hash = hash;
+        e->exists = exists;
+        e->is_directory = exists && S_ISDIR(st.st_mode);
+        e->size = exists ? st.st_size : 0;
+        e->modification_time = exists ? st.st_mtime : 0;
+        memcpy(e->path, path, len + 1);
+        (void) pthread_mutex_lock(&shard->mutex);
+        if (shard->generation == generation) {
+            if (shard->num_entries >= STAT_CACHE_SHARD_ENTRIES) {
+                stat_cache_clear_shard(shard);
+            }
+            e->next = *stat_cache_bucket(shard, hash);
+            *stat_cache_bucket(shard, hash) = e;
+            shard->num_entries++;
+            e = NULL;
+        }
+        (void) pthread_mutex_unlock(&shard->mutex);
+        mg_free(e);
+    }
+    return exists;
+}
+
+/* Drops path after the server itself changed it, before the event comes */
+static void stat_cache_invalidate(struct mg_context *ctx, const char *path)
+{
+    char buf[PATH_MAX];
+
+    if (ctx->stat_cache != NULL) {
+        path = collapse_slashes(path, buf, sizeof(buf));
+        stat_cache_remove(ctx->stat_cache, path, strlen(path));
+    }
+}
+#endif /* HAVE_INOTIFY */
+
+static int mg_stat(struct mg_connection *conn, const char *path,
+                   struct file *filep)
+{
+    struct stat st;
+
+    if (is_file_in_memory(conn, path, filep)) {
+        filep->modification_time = (time_t) 0;
+#if defined(HAVE_INOTIFY)
+    } else if (conn->ctx->stat_cache != NULL) {
+        if (!stat_cache_stat(conn->ctx, path, filep)) {
+            filep->modification_time = (time_t) 0;
+        }
+#endif
+    } else if (!stat(path, &st)) {
+        filep->size = st.st_size;
+        filep->modification_time = st.st_mtime;
+        filep->is_directory = S_ISDIR(st.st_mode);
+    } else {
+        filep->modification_time = (time_t) 0;
+    }
+
+    return filep->membuf != NULL || filep->modification_time != (time_t) 0;
+}
+
+static void set_close_on_exec(int fd, struct mg_connection *conn /* may be null */)
+{
+    if (fcntl(fd, F_SETFD, FD_CLOEXEC) != 0) {
+        if (conn)
+            mg_cry(conn, "%s: fcntl(F_SETFD FD_CLOEXEC) failed: %s",
+                   __func__, strerror(ERRNO));
+    }
+}
+
+int mg_start_thread(mg_thread_func_t func, void *param)
+{
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    int result;
+
+    (void) pthread_attr_init(&attr);
+    (void) pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+
+#if defined(USE_STACK_SIZE) && (USE_STACK_SIZE > 1)
+    /* Compile-time option to control stack size,
+       e.g. -DUSE_STACK_SIZE=16384 */
+    (void) pthread_attr_setstacksize(&attr, USE_STACK_SIZE);
+#endif /* defined(USE_STACK_SIZE) && (USE_STACK_SIZE > 1) */
+
+    result = pthread_create(&thread_id, &attr, func, param);
+    pthread_attr_destroy(&attr);
+
+    return result;
+}
+
+/* Start a thread storing the thread context. */
+
+static int mg_start_thread_with_id(mg_thread_func_t func, void *param,
+                                   pthread_t *threadidptr)
+{
+    pthread_t thread_id;
+    pthread_attr_t attr;
+    int result;
+
+    (void) pthread_attr_init(&attr);
+
+#if defined(USE_STACK_SIZE) && (USE_STACK_SIZE > 1)
+    /* Compile-time option to control stack size,
+       e.g. -DUSE_STACK_SIZE=16384 */
+    (void) pthread_attr_setstacksize(&attr, USE_STACK_SIZE);
+#endif /* defined(USE_STACK_SIZE) && USE_STACK_SIZE > 1 */
+
+    result = pthread_create(&thread_id, &attr, func, param);
+    pthread_attr_destroy(&attr);
+    if (threadidptr != NULL) {
+        *threadidptr = thread_id;
+    }
+    return result;
+}
+
+/* Wait for a thread to finish. */
+
+static int mg_join_thread(pthread_t threadid)
+{
+    int result;
+
+    result = pthread_join(threadid, NULL);
+    return result;
+}
+
+#ifndef NO_CGI
+static pid_t spawn_process(struct mg_connection *conn, const char *prog,
+                           char *envblk, char *envp[], int fdin,
+                           int fdout, const char *dir)
+{
+    pid_t pid;
+    const char *interp;
+
+    (void) envblk;
+
+    if ((pid = fork()) == -1) {
+        /* Parent */
+        send_http_error(conn, 500, http_500_error, "fork(): %s", strerror(ERRNO));
+    } else if (pid == 0) {
+        /* Child */
+        if (chdir(dir) != 0) {
+            mg_cry(conn, "%s: chdir(%s): %s", __func__, dir, strerror(ERRNO));
+        } else if (dup2(fdin, 0) == -1) {
+            mg_cry(conn, "%s: dup2(%d, 0): %s", __func__, fdin, strerror(ERRNO));
+        } else if (dup2(fdout, 1) == -1) {
+            mg_cry(conn, "%s: dup2(%d, 1): %s", __func__, fdout, strerror(ERRNO));
+        } else {
+            /* Not redirecting stderr to stdout, to avoid output being littered
+               with the error messages. */
+            (void) close(fdin);
+            (void) close(fdout);
+
+            /* After exec, all signal handlers are restored to their default
+               values, with one exception of SIGCHLD. According to
+               POSIX.1-2001 and Linux's implementation, SIGCHLD's handler will
+               leave unchanged after exec if it was set to be ignored. Restore
+               it to default action. */
+            signal(SIGCHLD, SIG_DFL);
+
+            interp = conn->ctx->config[CGI_INTERPRETER];
+            if (interp == NULL) {
+                (void) execle(prog, prog, NULL, envp);
+                mg_cry(conn, "%s: execle(%s): %s", __func__, prog, strerror(ERRNO));
+            } else {
+                (void) execle(interp, interp, prog, NULL, envp);
+                mg_cry(conn, "%s: execle(%s %s): %s", __func__, interp, prog,
+                       strerror(ERRNO));
+            }
+        }
+        exit(EXIT_FAILURE);
+    }
+
+    return pid;
+}
+#endif /* !NO_CGI */
+
+static int set_non_blocking_mode(SOCKET sock)
+{
+    int flags;
+
+    flags = fcntl(sock, F_GETFL, 0);
+    (void) fcntl(sock, F_SETFL, flags | O_NONBLOCK);
+
+    return 0;
+}
+#endif /* _WIN32 */
+
+/* Write data to the IO channel - opened file descriptor, socket or SSL
+   descriptor. Return number of bytes written. */
+static int64_t push(FILE *fp, SOCKET sock, SSL *ssl, const char *buf,
+                    int64_t len)
+{
+    int64_t sent;
+    int n, k;
+
+    (void) ssl;  /* Get rid of warning */
+    sent = 0;
+    while (sent < len) {
+
+        /* How many bytes we send in this iteration */
+        k = len - sent > INT_MAX ? INT_MAX : (int) (len - sent);
 
 #ifndef NO_SSL
         if (ssl != NULL) {
@@ -2238,6 +3055,56 @@ int mg_write(struct mg_connection *conn, const void *buf, size_t len)
     return (int) total;
 }
 
+int mg_writev(struct mg_connection *conn, const struct mg_iovec *iov,
+              int iovcnt)
+{
+    int i, n, total = 0;
+#if !defined(_WIN32)
+    struct iovec vec[16];
+    struct msghdr msg;
+
+    /* SSL and throttled connections go through mg_write() below */
+    if (conn->ssl == NULL && conn->throttle <= 0 &&
+        iovcnt <= (int) ARRAY_SIZE(vec)) {
+        for (i = 0; i < iovcnt; i++) {
+            vec[i].iov_base = (void *) iov[i].buf;
+            vec[i].iov_len = iov[i].len;
+        }
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_iov = vec;
+        msg.msg_iovlen = iovcnt;
+        while (msg.msg_iovlen > 0 && conn->ctx->stop_flag == 0) {
+            if ((n = (int) sendmsg(conn->client.sock, &msg,
+                                   MSG_NOSIGNAL)) <= 0) {
+                break;
+            }
+            total += n;
+            /* Skip the buffers sent in full, then the sent part of the next */
+            while (msg.msg_iovlen > 0 &&
+                   (size_t) n >= msg.msg_iov[0].iov_len) {
+                n -= (int) msg.msg_iov[0].iov_len;
+                msg.msg_iov++;
+                msg.msg_iovlen--;
+            }
+            if (msg.msg_iovlen > 0) {
+                msg.msg_iov[0].iov_base = (char *) msg.msg_iov[0].iov_base + n;
+                msg.msg_iov[0].iov_len -= n;
+            }
+        }
+        return total;
+    }
+#endif
+    for (i = 0; i < iovcnt; i++) {
+        if ((n = mg_write(conn, iov[i].buf, iov[i].len)) > 0) {
+            total += n;
+        }
+        if (n != (int) iov[i].len) {
+            break;
+        }
+    }
+    return total;
+}
+
 /* Alternative alloc_vprintf() for non-compliant C runtimes */
 static int alloc_vprintf2(char **buf, const char *fmt, va_list ap)
 {
@@ -2515,6 +3382,10 @@ static int base64_decode(const unsigned char *src, int src_len, char *dst, size_
 }
 #endif
 
+static int file_cache_lookup(struct mg_connection *, const char *,
+                             struct file *);
+static void invalidate_caches(struct mg_context *, const char *);
+
 static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
                                      size_t buf_len, struct file *filep,
                                      int * is_script_ressource)
@@ -2551,7 +3422,9 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
         }
     }
 
-    if (mg_stat(conn, buf, filep)) return;
+    if (file_cache_lookup(conn, buf, filep) || mg_stat(conn, buf, filep)) {
+        return;
+    }
 
     /* if we can't find the actual file, look for the file
        with the same name but a .gz extension. If we find it,
@@ -2599,33 +3472,84 @@ static void convert_uri_to_file_name(struct mg_connection *conn, char *buf,
     }
 }
 
-/* Check whether full request is buffered. Return:
+#if defined(__GNUC__) && defined(__AVX2__)
+#define SCAN_BLOCK 32
+/* Returns a bit set for each of the 32 bytes at s that is a control
+   character: CR, LF, or one not allowed in a request */
+static unsigned scan_block(const char *s)
+{
+    __m256i v = _mm256_loadu_si256((const __m256i *) s);
+    /* Bytes >= 128 compare as negative, and are allowed */
+    __m256i ctl = _mm256_and_si256(
+                      _mm256_cmpgt_epi8(_mm256_set1_epi8(0x20), v),
+                      _mm256_cmpgt_epi8(v, _mm256_set1_epi8(-1)));
+    return (unsigned) _mm256_movemask_epi8(
+               _mm256_or_si256(ctl, _mm256_cmpeq_epi8(v,
+                                    _mm256_set1_epi8(0x7f))));
+}
+#elif defined(__GNUC__) && defined(__SSE2__)
+#define SCAN_BLOCK 16
+/* Same as above, 16 bytes at a time */
+static unsigned scan_block(const char *s)
+{
+    __m128i v = _mm_loadu_si128((const __m128i *) s);
+    __m128i ctl = _mm_and_si128(_mm_cmplt_epi8(v, _mm_set1_epi8(0x20)),
+                                _mm_cmpgt_epi8(v, _mm_set1_epi8(-1)));
+    return (unsigned) _mm_movemask_epi8(
+               _mm_or_si128(ctl, _mm_cmpeq_epi8(v, _mm_set1_epi8(0x7f))));
+}
+#endif
+
+/* Check whether full request is buffered, scanning from *scanned on, and
+   store where to resume the scan once more data is buffered. Return:
      -1  if request is malformed
       0  if request is not yet fully buffered
      >0  actual request length, including last \r\n\r\n */
-static int get_request_len(const char *buf, int buflen)
+static int scan_request(const char *buf, int buflen, int *scanned)
 {
-    const char *s, *e;
+    const char *s = buf + *scanned, *e = buf + buflen - 1;
     int len = 0;
+#if defined(SCAN_BLOCK)
+    unsigned mask;
+#endif
 
-    for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
+    while (len == 0 && s < e) {
+#if defined(SCAN_BLOCK)
+        /* Skip the printable characters a block at a time */
+        if (s + SCAN_BLOCK <= e) {
+            if ((mask = scan_block(s)) == 0) {
+                s += SCAN_BLOCK;
+                continue;
+            }
+            s += __builtin_ctz(mask);
+        }
+#endif
         /* Control characters are not allowed but >=128 is. */
         if (!isprint(* (const unsigned char *) s) && *s != '\r' &&
             *s != '\n' && * (const unsigned char *) s < 128) {
-            len = -1;
-            break;  /* [i_a] abort scan as soon as one malformed character is
-                       found; */
-            /* don't let subsequent \r\n\r\n win us over anyhow */
+            len = -1;  /* [i_a] abort scan as soon as one malformed character
+                          is found; don't let subsequent \r\n\r\n win us
+                          over anyhow */
         } else if (s[0] == '\n' && s[1] == '\n') {
             len = (int) (s - buf) + 2;
         } else if (s[0] == '\n' && &s[1] < e &&
                    s[1] == '\r' && s[2] == '\n') {
             len = (int) (s - buf) + 3;
         }
+        s++;
+    }
 
+    /* The last bytes may start the end of the headers, look again */
+    *scanned = len == 0 && buflen > 3 ? buflen - 3 : 0;
     return len;
 }
 
+static int get_request_len(const char *buf, int buflen)
+{
+    int scanned = 0;
+    return scan_request(buf, buflen, &scanned);
+}
+
 /* Convert month to the month number. Return -1 on error, or month number */
 static int get_month_index(const char *s)
 {
@@ -2789,45 +3713,185 @@ static const struct {
     {NULL, 0, NULL}
 };
 
+#define MIME_HASH_SEED 2166390702U
+
+/* FNV-1a of the lower case extension, starting from seed */
+static unsigned hash_extension(const char *ext, size_t len, unsigned seed)
+{
+    while (len-- > 0) {
+        seed = (seed ^ (unsigned char) lowercase(ext++)) * 16777619U;
+    }
+    return seed;
+}
+
+/* Entry of builtin_mime_types plus one for each value of the top byte of
+   hash_extension(extension, MIME_HASH_SEED), 0 for none. The seed is one
+   for which no two builtin extensions share a slot, so a lookup compares
+   a single extension. A type added to builtin_mime_types needs a seed and
+   a table generated again: test_mime_types() checks both. */
+static const unsigned char builtin_mime_slots[256] = {
+     0,  0,  0,  0, 19,  0,  0,  0,  0, 31, 18,  0,  0,  0,  0, 20,
+     0, 36, 49,  0,  0,  0, 12,  0,  0, 34,  0,  0,  0,  0,  0, 27,
+     0, 29,  0,  0, 26,  0, 64, 28,  0,  0,  0, 14,  0,  0,  0,  0,
+     0, 13,  0,  0,  0,  0, 52,  5,  0,  0, 39,  0, 24,  0,  0, 37,
+     0,  0, 38,  0,  0,  0,  0,  0,  0,  0,  0, 51, 41, 23,  0,  0,
+     0, 46, 45,  0,  0, 65,  0,  0,  0, 33,  0,  0,  0,  0, 62, 53,
+     8, 35, 66,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0, 54,  0,  0, 43,  0,  0,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0, 56,  0, 25, 11,  0,  0,  0,  7,  0,
+     0,  0,  0,  0, 48, 40,  0,  0,  1,  0,  0,  0, 16,  0, 58, 42,
+     9, 57,  0,  0,  0,  0,  4, 60, 55,  0,  0,  0,  0,  0,  0,  0,
+     0,  0,  0, 15,  0, 59,  0,  6, 21,  0, 61,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0,  0, 17, 32,  0,  0,
+     0,  0,  0,  0,  0,  0,  0,  3,  0,  0, 30,  0,  0, 50,  0,  0,
+    22,  0,  0,  0, 47,  0,  0,  0,  0,  0, 63,  0,  0,  0,  0,  0,
+     0,  0,  0,  0,  0, 10,  0,  0,  0,  0,  0,  0,  0,  2,  0, 44
+};
+
+/* Returns the part of path from its last dot on, or NULL */
+static const char *path_extension(const char *path, size_t path_len)
+{
+    const char *ext = path + path_len;
+
+    while (ext > path && *ext != '.') {
+        ext--;
+    }
+    return *ext == '.' ? ext : NULL;
+}
+
 const char *mg_get_builtin_mime_type(const char *path)
 {
     const char *ext;
-    size_t i, path_len;
+    size_t path_len, ext_len;
+    int i;
 
     path_len = strlen(path);
 
-    for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
-        ext = path + (path_len - builtin_mime_types[i].ext_len);
-        if (path_len > builtin_mime_types[i].ext_len &&
-            mg_strcasecmp(ext, builtin_mime_types[i].extension) == 0) {
-            return builtin_mime_types[i].mime_type;
+    /* The extension must follow a file name */
+    if ((ext = path_extension(path, path_len)) != NULL && ext > path) {
+        ext_len = path + path_len - ext;
+        i = builtin_mime_slots[(hash_extension(ext, ext_len, MIME_HASH_SEED) >>
+                                24) & 255];
+        if (i > 0 && builtin_mime_types[i - 1].ext_len == ext_len &&
+            mg_strcasecmp(ext, builtin_mime_types[i - 1].extension) == 0) {
+            return builtin_mime_types[i - 1].mime_type;
         }
     }
 
     return "text/plain";
 }
 
+static int is_plain_extension(const struct vec *ext)
+{
+    return ext->len > 1 && ext->ptr[0] == '.' &&
+           memchr(ext->ptr + 1, '.', ext->len - 1) == NULL;
+}
+
+/* Parses the extra_mime_types option. Returns NULL when out of memory. */
+static struct extra_mime_types *extra_mime_types_create(const char *list)
+{
+    struct extra_mime_types *t;
+    struct extra_mime_type *type;
+    struct vec ext_vec, mime_vec;
+    const char *p;
+    unsigned num_buckets, b;
+    int i, n = 0;
+
+    for (p = list; (p = next_option(p, &ext_vec, &mime_vec)) != NULL; ) {
+        n++;
+    }
+    for (num_buckets = 16; num_buckets < 2 * (unsigned) n; ) {
+        num_buckets *= 2;
+    }
+    if ((t = (struct extra_mime_types *)
+         mg_calloc(1, sizeof(*t) + n * sizeof(t->types[0]) +
+                   num_buckets * sizeof(int) + n * sizeof(int))) == NULL) {
+        return NULL;
+    }
+    t->types = (struct extra_mime_type *) (t + 1);
+    t->buckets = (int *) (t->types + n);
+    t->suffixes = t->buckets + num_buckets;
+    t->mask = num_buckets - 1;
+    for (b = 0; b < num_buckets; b++) {
+        t->buckets[b] = -1;
+    }
+
+    for (p = list; (p = next_option(p, &ext_vec, &mime_vec)) != NULL; ) {
+        type = &t->types[t->num_types];
+        type->ext = ext_vec;
+        type->mime = mime_vec;
+        type->next = -1;
+        if (!is_plain_extension(&ext_vec)) {
+            t->suffixes[t->num_suffixes++] = t->num_types;
+        } else {
+            /* The first of the same extensions is the one that counts */
+            b = hash_extension(ext_vec.ptr, ext_vec.len, MIME_HASH_SEED) &
+                t->mask;
+            for (i = t->buckets[b]; i >= 0; i = t->types[i].next) {
+                if (t->types[i].ext.len == ext_vec.len &&
+                    mg_strncasecmp(t->types[i].ext.ptr, ext_vec.ptr,
+                                   ext_vec.len) == 0) {
+                    break;
+                }
+            }
+            if (i < 0) {
+                type->next = t->buckets[b];
+                t->buckets[b] = t->num_types;
+            }
+        }
+        t->num_types++;
+    }
+    return t;
+}
+
+/* Returns the first type of the list that path ends with, or NULL */
+static const struct extra_mime_type *
+find_extra_mime_type(const struct extra_mime_types *t, const char *path)
+{
+    const struct extra_mime_type *type;
+    const char *ext;
+    size_t path_len, ext_len;
+    int i, found = t->num_types;
+
+    path_len = strlen(path);
+    if ((ext = path_extension(path, path_len)) != NULL) {
+        ext_len = path + path_len - ext;
+        for (i = t->buckets[hash_extension(ext, ext_len, MIME_HASH_SEED) &
+                            t->mask]; i >= 0; i = t->types[i].next) {
+            if (t->types[i].ext.len == ext_len &&
+                mg_strncasecmp(t->types[i].ext.ptr, ext, ext_len) == 0) {
+                found = i;
+                break;
+            }
+        }
+    }
+
+    /* A suffix listed before the extension found comes first */
+    for (i = 0; i < t->num_suffixes && t->suffixes[i] < found; i++) {
+        type = &t->types[t->suffixes[i]];
+        if (type->ext.len <= path_len &&
+            mg_strncasecmp(path + path_len - type->ext.len, type->ext.ptr,
+                           type->ext.len) == 0) {
+            found = t->suffixes[i];
+            break;
+        }
+    }
+    return found < t->num_types ? &t->types[found] : NULL;
+}
+
 /* Look at the "path" extension and figure what mime type it has.
    Store mime type in the vector. */
 static void get_mime_type(struct mg_context *ctx, const char *path,
                           struct vec *vec)
 {
-    struct vec ext_vec, mime_vec;
-    const char *list, *ext;
-    size_t path_len;
-
-    path_len = strlen(path);
+    const struct extra_mime_type *type;
 
-    /* Scan user-defined mime types first, in case user wants to
+    /* User-defined mime types first, in case user wants to
        override default mime types. */
-    list = ctx->config[EXTRA_MIME_TYPES];
-    while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
-        /* ext now points to the path suffix */
-        ext = path + path_len - ext_vec.len;
-        if (mg_strncasecmp(ext, ext_vec.ptr, ext_vec.len) == 0) {
-            *vec = mime_vec;
-            return;
-        }
+    if (ctx->extra_mime_types != NULL &&
+        (type = find_extra_mime_type(ctx->extra_mime_types, path)) != NULL) {
+        *vec = type->mime;
+        return;
     }
 
     vec->ptr = mg_get_builtin_mime_type(path);
@@ -2897,6 +3961,23 @@ static int check_password(const char *method, const char *ha1, const char *uri,
     return mg_strcasecmp(response, expected_response) == 0;
 }
 
+/* Returns 0 if the stat cache knows path does not exist, which saves
+   trying to open it */
+static int may_exist(struct mg_connection *conn, const char *path)
+{
+#if defined(HAVE_INOTIFY)
+    struct file file = STRUCT_FILE_INITIALIZER;
+
+    if (conn->ctx->stat_cache != NULL) {
+        return mg_stat(conn, path, &file);
+    }
+#else
+    (void) conn;
+    (void) path;
+#endif
+    return 1;
+}
+
 /* Use the global passwords file, if specified by auth_gpass option,
    or search for .htpasswd in the requested directory. */
 static void open_auth_file(struct mg_connection *conn, const char *path,
@@ -2920,7 +4001,7 @@ static void open_auth_file(struct mg_connection *conn, const char *path,
     } else if (mg_stat(conn, path, &file) && file.is_directory) {
         mg_snprintf(conn, name, sizeof(name), "%s%c%s",
                     path, '/', PASSWORDS_FILE_NAME);
-        if (!mg_fopen(conn, name, "r", filep)) {
+        if (!may_exist(conn, name) || !mg_fopen(conn, name, "r", filep)) {
 #ifdef DEBUG
             mg_cry(conn, "fopen(%s): %s", name, strerror(ERRNO));
 #endif
@@ -2932,7 +4013,7 @@ static void open_auth_file(struct mg_connection *conn, const char *path,
                 break;
         mg_snprintf(conn, name, sizeof(name), "%.*s%c%s",
                     (int) (e - p), p, '/', PASSWORDS_FILE_NAME);
-        if (!mg_fopen(conn, name, "r", filep)) {
+        if (!may_exist(conn, name) || !mg_fopen(conn, name, "r", filep)) {
 #ifdef DEBUG
             mg_cry(conn, "fopen(%s): %s", name, strerror(ERRNO));
 #endif
@@ -3441,6 +4522,7 @@ static int remove_directory(struct mg_connection *conn, const char *dir)
                 } else {
                     mg_remove(path);
                 }
+                invalidate_caches(conn->ctx, path);
             }
 
         }
@@ -3547,11 +4629,47 @@ static void handle_directory_request(struct mg_connection *conn,
 }
 
 /* Send len bytes from the opened file to the client. */
+#if defined(HAVE_SENDFILE)
+/* Sends len bytes of a regular file from offset on, or a pipe until its
+   end, with sendfile() or splice(): the data goes from the page cache or
+   the pipe to the socket without a copy through user space. Returns the
+   number of bytes sent, or -1 when the file cannot be sent this way and
+   nothing was sent. */
+static int64_t send_file_zero_copy(struct mg_connection *conn, int fd,
+                                   int is_pipe, int64_t offset, int64_t len)
+{
+    off_t off = (off_t) offset;
+    int64_t sent = 0;
+    ssize_t n = 0;
+    size_t k;
+
+    while (sent < len && conn->ctx->stop_flag == 0) {
+        k = len - sent > INT_MAX ? INT_MAX : (size_t) (len - sent);
+        /* Not SPLICE_F_MORE: the end of the pipe is only known once it
+           has been sent, and the last bytes would then wait for more */
+        n = is_pipe ?
+            splice(fd, NULL, conn->client.sock, NULL, k, SPLICE_F_MOVE) :
+            sendfile(conn->client.sock, fd, &off, k);
+        if (n <= 0) {
+            break;
+        }
+        sent += n;
+    }
+
+    return sent == 0 && n < 0 && (errno == EINVAL || errno == ENOSYS) ?
+           -1 : sent;
+}
+#endif
+
 static void send_file_data(struct mg_connection *conn, struct file *filep,
                            int64_t offset, int64_t len)
 {
     char buf[MG_BUF_LEN];
     int to_read, num_read, num_written;
+#if defined(HAVE_SENDFILE)
+    struct stat st;
+    int64_t sent;
+#endif
 
     /* Sanity check the offset */
     offset = offset < 0 ? 0 : offset > filep->size ? filep->size : offset;
@@ -3562,6 +4680,21 @@ static void send_file_data(struct mg_connection *conn, struct file *filep,
         }
         mg_write(conn, filep->membuf + offset, (size_t) len);
     } else if (len > 0 && filep->fp != NULL) {
+#if defined(HAVE_SENDFILE)
+        /* SSL and throttling need the data in user space. The FILE has
+           nothing buffered yet: files are read from an explicit offset,
+           and CGI output with read() by pull(). */
+        if (conn->ssl == NULL && conn->throttle <= 0 &&
+            !mg_strcasecmp(conn->ctx->config[ENABLE_SENDFILE], "yes") &&
+            fstat(fileno(filep->fp), &st) == 0 &&
+            (S_ISREG(st.st_mode) || S_ISFIFO(st.st_mode)) &&
+            (sent = send_file_zero_copy(conn, fileno(filep->fp),
+                                        S_ISFIFO(st.st_mode), offset,
+                                        len)) >= 0) {
+            conn->num_bytes_sent += sent;
+            return;
+        }
+#endif
         if (offset > 0 && fseeko(filep->fp, offset, SEEK_SET) != 0) {
             mg_cry(conn, "%s: fseeko() failed: %s",
                    __func__, strerror(ERRNO));
@@ -3616,40 +4749,409 @@ static void fclose_on_exec(struct file *filep, struct mg_connection *conn)
     }
 }
 
+static double monotonic_seconds(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static struct file_cache_shard *file_cache_shard(struct file_cache *cache,
+                                                 unsigned hash)
+{
+    return &cache->shards[hash % FILE_CACHE_SHARDS];
+}
+
+static struct file_cache_entry **file_cache_bucket(
+    struct file_cache_shard *shard, unsigned hash)
+{
+    return &shard->buckets[(hash / FILE_CACHE_SHARDS) &
+                           (FILE_CACHE_BUCKETS - 1)];
+}
+
+/* The shard lock must be held by the callers of the functions below */
+static struct file_cache_entry *file_cache_find(struct file_cache_shard *shard,
+                                                const char *path,
+                                                unsigned hash)
+{
+    struct file_cache_entry *e;
+
+    for (e = *file_cache_bucket(shard, hash); e != NULL; e = e->next) {
+        if (e->hash == hash && !strcmp(e->path, path)) {
+            break;
+        }
+    }
+    return e;
+}
+
+static void file_cache_lru_unlink(struct file_cache_shard *shard,
+                                  struct file_cache_entry *e)
+{
+    if (e->lru_prev != NULL) {
+        e->lru_prev->lru_next = e->lru_next;
+    } else {
+        shard->lru_head = e->lru_next;
+    }
+    if (e->lru_next != NULL) {
+        e->lru_next->lru_prev = e->lru_prev;
+    } else {
+        shard->lru_tail = e->lru_prev;
+    }
+}
+
+static void file_cache_lru_push(struct file_cache_shard *shard,
+                                struct file_cache_entry *e)
+{
+    e->lru_prev = NULL;
+    e->lru_next = shard->lru_head;
+    if (shard->lru_head != NULL) {
+        shard->lru_head->lru_prev = e;
+    } else {
+        shard->lru_tail = e;
+    }
+    shard->lru_head = e;
+}
+
+static void file_cache_unref(struct file_cache_entry *e)
+{
+    if (--e->refs == 0) {
+        mg_free(e);
+    }
+}
+
+/* Takes e out of the cache. Connections serving it keep it alive. */
+static void file_cache_remove(struct file_cache_shard *shard,
+                              struct file_cache_entry *e)
+{
+    struct file_cache_entry **p = file_cache_bucket(shard, e->hash);
+
+    while (*p != e) {
+        p = &(*p)->next;
+    }
+    *p = e->next;
+    file_cache_lru_unlink(shard, e);
+    shard->used -= e->size;
+    shard->files--;
+    file_cache_unref(e);
+}
+
+/* Makes e the most recently used file of its shard */
+static void file_cache_touch(struct file_cache_shard *shard,
+                             struct file_cache_entry *e)
+{
+    if (shard->lru_head != e) {
+        file_cache_lru_unlink(shard, e);
+        file_cache_lru_push(shard, e);
+    }
+}
+
+/* Fills filep from the cache, revalidating the entry with stat() when it
+   is older than file_cache_revalidate_ms. The connection holds the entry
+   until file_cache_release(). Returns 0 if path is not cached, or was
+   modified. */
+static int file_cache_lookup(struct mg_connection *conn, const char *path,
+                             struct file *filep)
+{
+    struct file_cache *cache = conn->ctx->file_cache;
+    struct file_cache_shard *shard;
+    struct file_cache_entry *e;
+    struct file st = STRUCT_FILE_INITIALIZER;
+    unsigned hash;
+    double now;
+    int fresh = 0, cached;
+
+    if (cache == NULL || conn->cached_file != NULL) {
+        return 0;
+    }
+    hash = hash_path(path, strlen(path));
+    shard = file_cache_shard(cache, hash);
+    now = monotonic_seconds();
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    if ((e = file_cache_find(shard, path, hash)) != NULL) {
+        e->refs++;
+        if ((fresh = now - e->validated < cache->revalidate) != 0) {
+            file_cache_touch(shard, e);
+            shard->hits++;
+        }
+    }
+    (void) pthread_mutex_unlock(&shard->mutex);
+    if (e == NULL) {
+        return 0;
+    }
+
+    /* Other requests for the file keep going while it is stat()-ed */
+    if (!fresh) {
+        fresh = mg_stat(conn, path, &st) && st.membuf == NULL &&
+                !st.is_directory && st.size == e->size &&
+                st.modification_time == e->modification_time;
+
+        (void) pthread_mutex_lock(&shard->mutex);
+        cached = file_cache_find(shard, path, hash) == e;
+        if (fresh) {
+            e->validated = now;
+            if (cached) {
+                file_cache_touch(shard, e);
+            }
+            shard->hits++;
+        } else {
+            if (cached) {
+                file_cache_remove(shard, e);
+            }
+            file_cache_unref(e);
+        }
+        (void) pthread_mutex_unlock(&shard->mutex);
+    }
+
+    if (fresh) {
+        conn->cached_file = e;
+        filep->is_directory = 0;
+        filep->modification_time = e->modification_time;
+        filep->size = e->size;
+        filep->membuf = e->data;
+        filep->gzipped = 0;
+    }
+    return fresh;
+}
+
+/* Reads the file filep describes into a new cache entry, with the headers
+   describing it, evicting the least recently used files of its shard to
+   make room. On success, the connection holds the entry and filep points
+   to its data. */
+static int file_cache_load(struct mg_connection *conn, const char *path,
+                           struct file *filep, const char *headers)
+{
+    struct file_cache *cache = conn->ctx->file_cache;
+    struct file_cache_shard *shard;
+    struct file_cache_entry *e, *old;
+    struct file file = STRUCT_FILE_INITIALIZER;
+    size_t path_len, headers_len;
+    char *p;
+    unsigned hash;
+    int ok;
+
+    hash = hash_path(path, strlen(path));
+    shard = file_cache_shard(cache, hash);
+    (void) pthread_mutex_lock(&shard->mutex);
+    shard->misses++;
+    (void) pthread_mutex_unlock(&shard->mutex);
+
+    if (conn->cached_file != NULL || filep->membuf != NULL ||
+        filep->gzipped || filep->size > cache->max_file_size ||
+        filep->size > cache->shard_budget) {
+        return 0;
+    }
+
+    path_len = strlen(path) + 1;
+    headers_len = strlen(headers) + 1;
+    if ((e = (struct file_cache_entry *)
+         mg_malloc(sizeof(*e) + path_len + headers_len +
+                   (size_t) filep->size)) == NULL) {
+        return 0;
+    }
+    p = (char *) (e + 1);
+    e->path = (const char *) memcpy(p, path, path_len);
+    e->headers = (const char *) memcpy(p + path_len, headers, headers_len);
+    e->headers_len = headers_len - 1;
+    e->data = p + path_len + headers_len;
+    e->hash = hash;
+    e->refs = 2;
+    e->size = filep->size;
+    e->modification_time = filep->modification_time;
+    e->validated = monotonic_seconds();
+
+    /* A file that changed size since mg_stat() is not cached */
+    ok = mg_fopen(conn, path, "rb", &file) && file.fp != NULL &&
+         fread(e->data, 1, (size_t) e->size, file.fp) == (size_t) e->size &&
+         fgetc(file.fp) == EOF;
+    mg_fclose(&file);
+    if (!ok) {
+        mg_free(e);
+        return 0;
+    }
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    if ((old = file_cache_find(shard, path, hash)) != NULL) {
+        file_cache_remove(shard, old);
+    }
+    while (shard->used + e->size > cache->shard_budget) {
+        file_cache_remove(shard, shard->lru_tail);
+        shard->evictions++;
+    }
+    e->next = *file_cache_bucket(shard, hash);
+    *file_cache_bucket(shard, hash) = e;
+    file_cache_lru_push(shard, e);
+    shard->used += e->size;
+    shard->files++;
+    (void) pthread_mutex_unlock(&shard->mutex);
+
+    conn->cached_file = e;
+    filep->membuf = e->data;
+    return 1;
+}
+
+/* Lets go of the entry the connection was serving */
+static void file_cache_release(struct mg_connection *conn)
+{
+    struct file_cache_shard *shard;
+
+    if (conn->cached_file != NULL) {
+        shard = file_cache_shard(conn->ctx->file_cache,
+                                 conn->cached_file->hash);
+        (void) pthread_mutex_lock(&shard->mutex);
+        file_cache_unref(conn->cached_file);
+        (void) pthread_mutex_unlock(&shard->mutex);
+        conn->cached_file = NULL;
+    }
+}
+
+static void file_cache_invalidate(struct mg_context *ctx, const char *path)
+{
+    struct file_cache_shard *shard;
+    struct file_cache_entry *e;
+    unsigned hash;
+
+    if (ctx->file_cache != NULL) {
+        hash = hash_path(path, strlen(path));
+        shard = file_cache_shard(ctx->file_cache, hash);
+        (void) pthread_mutex_lock(&shard->mutex);
+        if ((e = file_cache_find(shard, path, hash)) != NULL) {
+            file_cache_remove(shard, e);
+        }
+        (void) pthread_mutex_unlock(&shard->mutex);
+    }
+}
+
+/* Drops path from the caches after a PUT or a DELETE changed it */
+static void invalidate_caches(struct mg_context *ctx, const char *path)
+{
+    file_cache_invalidate(ctx, path);
+#if defined(HAVE_INOTIFY)
+    stat_cache_invalidate(ctx, path);
+#endif
+}
+
+static struct file_cache *file_cache_create(struct mg_context *ctx)
+{
+    struct file_cache *cache;
+    int i;
+
+    if ((cache = (struct file_cache *) mg_calloc(1, sizeof(*cache))) == NULL) {
+        return NULL;
+    }
+    cache->shard_budget = strtoll(ctx->config[FILE_CACHE_SIZE], NULL, 10) /
+                          FILE_CACHE_SHARDS;
+    cache->max_file_size = strtoll(ctx->config[FILE_CACHE_MAX_FILE_SIZE],
+                                   NULL, 10);
+    cache->revalidate = atoi(ctx->config[FILE_CACHE_REVALIDATE_MS]) / 1000.0;
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        (void) pthread_mutex_init(&cache->shards[i].mutex, NULL);
+    }
+    return cache;
+}
+
+static void file_cache_destroy(struct file_cache *cache)
+{
+    struct file_cache_entry *e, *next;
+    int i;
+
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        for (e = cache->shards[i].lru_head; e != NULL; e = next) {
+            next = e->lru_next;
+            mg_free(e);
+        }
+        (void) pthread_mutex_destroy(&cache->shards[i].mutex);
+    }
+    mg_free(cache);
+}
+
+int mg_get_file_cache_stats(const struct mg_context *ctx,
+                            struct mg_file_cache_stats *stats)
+{
+    struct file_cache_shard *shard;
+    int i;
+
+    if (ctx == NULL || ctx->file_cache == NULL) {
+        return 0;
+    }
+    memset(stats, 0, sizeof(*stats));
+    for (i = 0; i < FILE_CACHE_SHARDS; i++) {
+        shard = &ctx->file_cache->shards[i];
+        (void) pthread_mutex_lock(&shard->mutex);
+        stats->hits += shard->hits;
+        stats->misses += shard->misses;
+        stats->evictions += shard->evictions;
+        stats->files += shard->files;
+        stats->bytes += (size_t) shard->used;
+        (void) pthread_mutex_unlock(&shard->mutex);
+    }
+    return 1;
+}
+
+/* Writes the decimal digits of v >= 0 backwards, the last one before end.
+   Returns the first digit. */
+static char *int64_digits(char *end, int64_t v)
+{
+    do {
+        *--end = (char) ('0' + v % 10);
+        v /= 10;
+    } while (v > 0);
+    return end;
+}
+
 static void handle_file_request(struct mg_connection *conn, const char *path,
                                 struct file *filep)
 {
-    char date[64], lm[64], etag[64], range[64];
-    const char *msg = "OK", *hdr;
-    time_t curtime = time(NULL);
+    char lm[64], etag[64], range[64], file_headers[512], cl_buf[24];
+    char reply[1024], *p;
+    const char *hdr, *headers = file_headers;
+    size_t headers_len, reply_len;
     int64_t cl, r1, r2;
     struct vec mime_vec;
-    int n;
+    struct mg_iovec parts[16];
+    int i, n, num_parts;
     char gz_path[PATH_MAX];
     const char *encoding = "";
-    const char *cors1, *cors2, *cors3;
 
-    get_mime_type(conn->ctx, path, &mime_vec);
     cl = filep->size;
     conn->status_code = 200;
     range[0] = '\0';
 
-    /* if this file is in fact a pre-gzipped file, rewrite its filename
-       it's important to rewrite the filename after resolving
-       the mime type from it, to preserve the actual file's type */
-    if (filep->gzipped) {
-        snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
-        path = gz_path;
-        encoding = "Content-Encoding: gzip\r\n";
-    }
+    /* Files from the cache come with their headers, see file_cache_lookup().
+       Etag and Last-Modified must be in UTC, according to
+       http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3 */
+    if (conn->cached_file != NULL && filep->membuf == conn->cached_file->data) {
+        headers = conn->cached_file->headers;
+        headers_len = conn->cached_file->headers_len;
+    } else {
+        get_mime_type(conn->ctx, path, &mime_vec);
+        gmt_time_string(lm, sizeof(lm), &filep->modification_time);
+        construct_etag(etag, sizeof(etag), filep);
+        mg_snprintf(conn, file_headers, sizeof(file_headers),
+                    "Last-Modified: %s\r\nEtag: %s\r\nContent-Type: %.*s\r\n",
+                    lm, etag, (int) mime_vec.len, mime_vec.ptr);
+        headers_len = strlen(file_headers);
+
+        /* if this file is in fact a pre-gzipped file, rewrite its filename
+           it's important to rewrite the filename after resolving
+           the mime type from it, to preserve the actual file's type */
+        if (filep->gzipped) {
+            snprintf(gz_path, sizeof(gz_path), "%s.gz", path);
+            path = gz_path;
+            encoding = "Content-Encoding: gzip\r\n";
+        }
 
-    if (!mg_fopen(conn, path, "rb", filep)) {
-        send_http_error(conn, 500, http_500_error,
-                        "fopen(%s): %s", path, strerror(ERRNO));
-        return;
-    }
+        if ((conn->ctx->file_cache == NULL ||
+             !file_cache_load(conn, path, filep, file_headers)) &&
+            !mg_fopen(conn, path, "rb", filep)) {
+            send_http_error(conn, 500, http_500_error,
+                            "fopen(%s): %s", path, strerror(ERRNO));
+            return;
+        }
 
-    fclose_on_exec(filep, conn);
+        fclose_on_exec(filep, conn);
+    }
 
     /* If Range: header specified, act accordingly */
     r1 = r2 = 0;
@@ -3670,41 +5172,61 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
                     "%" INT64_FMT "-%"
                     INT64_FMT "/%" INT64_FMT "\r\n",
                     r1, r1 + cl - 1, filep->size);
-        msg = "Partial Content";
     }
 
+    /* The reply headers are copied together from strings at hand, with
+       nothing formatted but the Content-Length */
+    num_parts = 0;
+#define ADD_PART(s, n) (parts[num_parts].buf = (s), \
+                        parts[num_parts++].len = (n))
+#define ADD_STRING(s) ADD_PART(s, sizeof(s) - 1)
+    if (conn->status_code == 206) {
+        ADD_STRING("HTTP/1.1 206 Partial Content\r\n");
+    } else {
+        ADD_STRING("HTTP/1.1 200 OK\r\n");
+    }
     hdr = mg_get_header(conn, "Origin");
     if (hdr) {
         /* Cross-origin resource sharing (CORS), see http://www.html5rocks.com/en/tutorials/cors/,
            http://www.html5rocks.com/static/images/cors_server_flowchart.png - preflight is not supported for files. */
-        cors1 = "Access-Control-Allow-Origin: ";
-        cors2 = conn->ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
-        cors3 = "\r\n";
+        ADD_STRING("Access-Control-Allow-Origin: ");
+        hdr = conn->ctx->config[ACCESS_CONTROL_ALLOW_ORIGIN];
+        ADD_PART(hdr, strlen(hdr));
+        ADD_STRING("\r\n");
+    }
+    ADD_STRING("Date: ");
+    ADD_PART(current_date(conn), strlen(conn->date));
+    ADD_STRING("\r\n");
+    ADD_PART(headers, headers_len);
+    ADD_STRING("Content-Length: ");
+    p = int64_digits(cl_buf + sizeof(cl_buf), cl);
+    ADD_PART(p, (size_t) (cl_buf + sizeof(cl_buf) - p));
+    if (should_keep_alive(conn)) {
+        ADD_STRING("\r\nConnection: keep-alive\r\n");
     } else {
-        cors1 = cors2 = cors3 = "";
+        ADD_STRING("\r\nConnection: close\r\n");
     }
+    ADD_STRING("Accept-Ranges: bytes\r\n");
+    ADD_PART(range, strlen(range));
+    ADD_PART(encoding, strlen(encoding));
+    ADD_STRING("\r\n");
+#undef ADD_STRING
+#undef ADD_PART
 
-    /* Prepare Etag, Date, Last-Modified headers. Must be in UTC, according to
-       http://www.w3.org/Protocols/rfc2616/rfc2616-sec3.html#sec3.3 */
-    gmt_time_string(date, sizeof(date), &curtime);
-    gmt_time_string(lm, sizeof(lm), &filep->modification_time);
-    construct_etag(etag, sizeof(etag), filep);
-
-    (void) mg_printf(conn,
-                     "HTTP/1.1 %d %s\r\n"
-                     "%s%s%s"
-                     "Date: %s\r\n"
-                     "Last-Modified: %s\r\n"
-                     "Etag: %s\r\n"
-                     "Content-Type: %.*s\r\n"
-                     "Content-Length: %" INT64_FMT "\r\n"
-                     "Connection: %s\r\n"
-                     "Accept-Ranges: bytes\r\n"
-                     "%s%s\r\n",
-                     conn->status_code, msg,
-                     cors1, cors2, cors3,
-                     date, lm, etag, (int) mime_vec.len,
-                     mime_vec.ptr, cl, suggest_connection_header(conn), range, encoding);
+    reply_len = 0;
+    for (i = 0; i < num_parts; i++) {
+        reply_len += parts[i].len;
+    }
+    if (reply_len <= sizeof(reply)) {
+        for (p = reply, i = 0; i < num_parts; i++) {
+            memcpy(p, parts[i].buf, parts[i].len);
+            p += parts[i].len;
+        }
+        (void) mg_write(conn, reply, reply_len);
+    } else {
+        /* A long Access-Control-Allow-Origin */
+        (void) mg_writev(conn, parts, num_parts);
+    }
 
     if (strcmp(conn->request_info.request_method, "HEAD") != 0) {
         send_file_data(conn, filep, r1, cl);
@@ -3715,27 +5237,73 @@ static void handle_file_request(struct mg_connection *conn, const char *path,
 void mg_send_file(struct mg_connection *conn, const char *path)
 {
     struct file file = STRUCT_FILE_INITIALIZER;
-    if (mg_stat(conn, path, &file)) {
+    int held = conn->cached_file != NULL;
+
+    if (file_cache_lookup(conn, path, &file) || mg_stat(conn, path, &file)) {
         handle_file_request(conn, path, &file);
     } else {
         send_http_error(conn, 404, "Not Found", "%s", "File not found");
     }
+
+    /* The handler may send more files in the same request */
+    if (!held) {
+        file_cache_release(conn);
+    }
 }
 
 
-/* Parse HTTP headers from the given buffer, advance buffer to the point
-   where parsing stopped. */
-static void parse_http_headers(char **buf, struct mg_request_info *ri)
+/* Returns the first CR, LF or NUL from s on, in a header block ending with
+   the NUL at end */
+static char *find_line_end(char *s, const char *end)
 {
-    int i;
+#if defined(SCAN_BLOCK)
+    unsigned mask;
 
-    for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
-        ri->http_headers[i].name = skip_quoted(buf, ":", " ", 0);
-        ri->http_headers[i].value = skip(buf, "\r\n");
-        if (ri->http_headers[i].name[0] == '\0')
-            break;
+    while (s + SCAN_BLOCK <= end) {
+        if ((mask = scan_block(s)) == 0) {
+            s += SCAN_BLOCK;
+            continue;
+        }
+        s += __builtin_ctz(mask);
+        if (*s == '\r' || *s == '\n' || *s == '\0') {
+            return s;
+        }
+        s++;  /* Another control character, e.g. a tab from CGI */
+    }
+#else
+    (void) end;
+#endif
+    return s + strcspn(s, "\r\n");
+}
+
+/* Parse HTTP headers from the given buffer, advance buffer to the point
+   where parsing stopped. The header lines from *buf to the NUL at end are
+   split into names and values, like skip_quoted(buf, ":", " ", 0) then
+   skip(buf, "\r\n") would, the values being scanned a block at a time. */
+static void parse_http_headers(char **buf, char *end,
+                               struct mg_request_info *ri)
+{
+    char *s = *buf, *e;
+    int i;
+
+    for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
+        ri->http_headers[i].name = s;
+        e = s + strcspn(s, ":");
+        if (*e != '\0') {
+            do {
+                *e++ = '\0';
+            } while (*e == ' ');
+        }
+        ri->http_headers[i].value = e;
+        s = find_line_end(e, end);
+        while (*s == '\r' || *s == '\n') {
+            *s++ = '\0';
+        }
+        if (ri->http_headers[i].name[0] == '\0')
+            break;
         ri->num_headers = i + 1;
     }
+    *buf = s;
 }
 
 static int is_valid_http_method(const char *method)
@@ -3748,13 +5316,18 @@ static int is_valid_http_method(const char *method)
            ;
 }
 
-/* Parse HTTP request, fill in mg_request_info structure.
+/* Parse HTTP request of request_length bytes, as found by get_request_len(),
+   fill in mg_request_info structure.
    This function modifies the buffer by NUL-terminating
    HTTP request components, header names and header values. */
-static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
+static int tokenize_http_message(char *buf, int request_length,
+                                 struct mg_request_info *ri)
 {
-    int is_request, request_length = get_request_len(buf, len);
+    char *end;
+    int is_request;
+
     if (request_length > 0) {
+        end = buf + request_length - 1;
         /* Reset attributes. DO NOT TOUCH is_ssl, remote_ip, remote_port */
         ri->remote_user = ri->request_method = ri->uri = ri->http_version = NULL;
         ri->num_headers = 0;
@@ -3779,7 +5352,7 @@ static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
             if (is_request) {
                 ri->http_version += 5;
             }
-            parse_http_headers(&buf, ri);
+            parse_http_headers(&buf, end, ri);
         }
     }
     return request_length;
@@ -3793,15 +5366,16 @@ static int parse_http_message(char *buf, int len, struct mg_request_info *ri)
 static int read_request(FILE *fp, struct mg_connection *conn,
                         char *buf, int bufsiz, int *nread)
 {
-    int request_len, n = 0;
+    int request_len, n = 0, scanned = 0;
 
-    request_len = get_request_len(buf, *nread);
+    request_len = scan_request(buf, *nread, &scanned);
     while (conn->ctx->stop_flag == 0 &&
            *nread < bufsiz && request_len == 0 &&
            (n = pull(fp, conn, buf + *nread, bufsiz - *nread)) > 0) {
         *nread += n;
         assert(*nread <= bufsiz);
-        request_len = get_request_len(buf, *nread);
+        /* Only the new bytes need a look */
+        request_len = scan_request(buf, *nread, &scanned);
     }
 
     return request_len <= 0 && n <= 0 ? -1 : request_len;
@@ -3839,7 +5413,8 @@ static int substitute_index_file(struct mg_connection *conn, char *path,
         mg_strlcpy(path + n + 1, filename_vec.ptr, filename_vec.len + 1);
 
         /* Does it exist? */
-        if (mg_stat(conn, path, &file)) {
+        if (file_cache_lookup(conn, path, &file) ||
+            mg_stat(conn, path, &file)) {
             /* Yes it does, break the loop */
             *filep = file;
             found = 1;
@@ -4196,7 +5771,7 @@ static void handle_cgi_request(struct mg_connection *conn, const char *prog)
     }
     pbuf = buf;
     buf[headers_len - 1] = '\0';
-    parse_http_headers(&pbuf, &ri);
+    parse_http_headers(&pbuf, buf + headers_len - 1, &ri);
 
     /* Make up and send the status line */
     status_text = "OK";
@@ -4363,6 +5938,7 @@ static void put_file(struct mg_connection *conn, const char *path)
     conn->status_code = mg_stat(conn, path, &file) ? 200 : 201;
 
     if ((rc = put_dir(conn, path)) == 0) {
+        invalidate_caches(conn->ctx, path);
         gmt_time_string(date, sizeof(date), &curtime);
         mg_printf(conn, "HTTP/1.1 %d OK\r\nDate: %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
                   conn->status_code, date, suggest_connection_header(conn));
@@ -4384,10 +5960,11 @@ static void put_file(struct mg_connection *conn, const char *path)
         if (!forward_body_data(conn, file.fp, INVALID_SOCKET, NULL)) {
             conn->status_code = 500;
         }
+        mg_fclose(&file);
+        invalidate_caches(conn->ctx, path);
         gmt_time_string(date, sizeof(date), &curtime);
         mg_printf(conn, "HTTP/1.1 %d OK\r\nDate: %s\r\nContent-Length: 0\r\nConnection: %s\r\n\r\n",
                   conn->status_code, date, suggest_connection_header(conn));
-        mg_fclose(&file);
     }
 }
 
@@ -5520,8 +7097,10 @@ static void handle_request(struct mg_connection *conn)
             if(de.file.modification_time) {
                 if(de.file.is_directory) {
                     remove_directory(conn, path);
+                    invalidate_caches(conn->ctx, path);
                     send_http_error(conn, 204, "No Content", "%s", "");
                 } else if (mg_remove(path) == 0) {
+                    invalidate_caches(conn->ctx, path);
                     send_http_error(conn, 204, "No Content", "%s", "");
                 } else {
                     send_http_error(conn, 423, "Locked", "remove(%s): %s", path,
@@ -5581,11 +7160,35 @@ static void handle_request(struct mg_connection *conn)
     } else {
         handle_file_request(conn, path, &file);
     }
+    file_cache_release(conn);
+}
+
+/* Closes the listening sockets of an acceptor other than the master */
+static void close_acceptor_sockets(struct mg_context *ctx,
+                                   struct mg_acceptor *acceptor)
+{
+    int i;
+    if (acceptor->listening_sockets != NULL) {
+        for (i = 0; i < ctx->num_listening_sockets; i++) {
+            if (acceptor->listening_sockets[i].sock != INVALID_SOCKET) {
+                closesocket(acceptor->listening_sockets[i].sock);
+            }
+        }
+        mg_free(acceptor->listening_sockets);
+        acceptor->listening_sockets = NULL;
+    }
 }
 
 static void close_all_listening_sockets(struct mg_context *ctx)
 {
     int i;
+    for (i = 1; i < ctx->num_acceptors; i++) {
+        close_acceptor_sockets(ctx, &ctx->acceptors[i]);
+    }
+    if (ctx->acceptors != NULL) {
+        ctx->acceptors[0].listening_sockets = NULL;
+    }
+
     for (i = 0; i < ctx->num_listening_sockets; i++) {
         closesocket(ctx->listening_sockets[i].sock);
     }
@@ -5593,6 +7196,7 @@ static void close_all_listening_sockets(struct mg_context *ctx)
     ctx->listening_sockets=0;
     mg_free(ctx->listening_ports);
     ctx->listening_ports=0;
+    ctx->num_listening_sockets = 0;
 }
 
 static int is_valid_port(unsigned int port)
@@ -5645,6 +7249,314 @@ static int parse_port_string(const struct vec *vec, struct socket *so)
            (ch == '\0' || ch == 's' || ch == 'r' || ch == ',');
 }
 
+static int set_sock_timeout(SOCKET sock, int milliseconds)
+{
+#ifdef _WIN32
+    DWORD t = milliseconds;
+#else
+    struct timeval t;
+    t.tv_sec = milliseconds / 1000;
+    t.tv_usec = (milliseconds * 1000) % 1000000;
+#endif
+    return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &t, sizeof(t)) ||
+           setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &t, sizeof(t));
+}
+
+/* Sets up a listening socket, before it listens, once for all the
+   connections it accepts: accepted sockets inherit TCP_NODELAY and the
+   buffer sizes of their listener, and the receive buffer must be set before
+   listen() to size the TCP window. On Linux, they also inherit SO_KEEPALIVE
+   and the timeouts, and the listener is non-blocking so that its backlog can
+   be drained in one go. */
+static int set_listening_socket_options(struct mg_context *ctx, SOCKET sock)
+{
+    int on = 1, sndbuf = atoi(ctx->config[SOCKET_SEND_BUFFER]),
+        rcvbuf = atoi(ctx->config[SOCKET_RECEIVE_BUFFER]);
+#if defined(TCP_FASTOPEN)
+    int fastopen = atoi(ctx->config[TCP_FAST_OPEN]);
+#endif
+#if defined(__linux__)
+    int defer = atoi(ctx->config[TCP_DEFER_ACCEPT_SECONDS]);
+#endif
+
+    if ((!mg_strcasecmp(ctx->config[TCP_NO_DELAY], "yes") &&
+         setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (void *) &on,
+                    sizeof(on)) != 0) ||
+        (sndbuf > 0 &&
+         setsockopt(sock, SOL_SOCKET, SO_SNDBUF, (void *) &sndbuf,
+                    sizeof(sndbuf)) != 0) ||
+        (rcvbuf > 0 &&
+         setsockopt(sock, SOL_SOCKET, SO_RCVBUF, (void *) &rcvbuf,
+                    sizeof(rcvbuf)) != 0) ||
+#if defined(TCP_FASTOPEN)
+        /* Length of the queue of pending fast open requests */
+        (fastopen > 0 &&
+         setsockopt(sock, IPPROTO_TCP, TCP_FASTOPEN, (void *) &fastopen,
+                    sizeof(fastopen)) != 0) ||
+#endif
+#if defined(__linux__)
+        setsockopt(sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on,
+                   sizeof(on)) != 0 ||
+        set_sock_timeout(sock, atoi(ctx->config[REQUEST_TIMEOUT])) != 0 ||
+        /* Wake up the acceptor only once the request starts arriving */
+        (defer > 0 &&
+         setsockopt(sock, IPPROTO_TCP, TCP_DEFER_ACCEPT, (void *) &defer,
+                    sizeof(defer)) != 0) ||
+        set_non_blocking_mode(sock) != 0 ||
+#endif
+        0) {
+        mg_cry(fc(ctx), "%s: cannot set listening socket options: %s",
+               __func__, strerror(ERRNO));
+        return 0;
+    }
+    return 1;
+}
+
+static int listen_backlog(const struct mg_context *ctx)
+{
+    const char *backlog = ctx->config[LISTEN_BACKLOG];
+    return backlog != NULL && atoi(backlog) > 0 ? atoi(backlog) : SOMAXCONN;
+}
+
+#if !defined(_WIN32)
+/* Tells whether two socket addresses have the same address and port */
+static int same_address(const union usa *a, const union usa *b)
+{
+    if (a->sa.sa_family != b->sa.sa_family) {
+        return 0;
+    }
+#if defined(USE_IPV6)
+    if (a->sa.sa_family == AF_INET6) {
+        return a->sin6.sin6_port == b->sin6.sin6_port &&
+               !memcmp(&a->sin6.sin6_addr, &b->sin6.sin6_addr,
+                       sizeof(a->sin6.sin6_addr));
+    }
+#endif
+    return a->sin.sin_port == b->sin.sin_port &&
+           a->sin.sin_addr.s_addr == b->sin.sin_addr.s_addr;
+}
+
+/* Tells whether sock is a TCP socket listening for connections */
+static int is_listening_socket(SOCKET sock)
+{
+    int type = 0, listening = 0;
+    socklen_t len = sizeof(type);
+
+    if (getsockopt(sock, SOL_SOCKET, SO_TYPE, (void *) &type, &len) != 0 ||
+        type != SOCK_STREAM) {
+        return 0;
+    }
+#if defined(SO_ACCEPTCONN)
+    len = sizeof(listening);
+    return getsockopt(sock, SOL_SOCKET, SO_ACCEPTCONN, (void *) &listening,
+                      &len) == 0 && listening;
+#else
+    (void) listening;
+    return 1;
+#endif
+}
+
+/* Tells whether a listening socket was taken by this server already, by
+   any acceptor */
+static int is_adopted(const struct mg_context *ctx, SOCKET sock)
+{
+    const struct socket *so;
+    int i, j;
+
+    for (i = 0; i < ctx->num_acceptors; i++) {
+        so = i == 0 ? ctx->listening_sockets :
+             ctx->acceptors[i].listening_sockets;
+        for (j = 0; so != NULL && j < ctx->num_listening_sockets; j++) {
+            if (so[j].sock == sock) {
+                return 1;
+            }
+        }
+    }
+    return 0;
+}
+#endif
+
+/* Takes, out of the listening_sockets option, a socket handed over by
+   another server for a port spec: one bound to the same address and port.
+   Returns INVALID_SOCKET when there is none left. */
+static SOCKET adopt_listening_socket(struct mg_context *ctx,
+                                     const union usa *lsa)
+{
+#if !defined(_WIN32)
+    const char *list = ctx->config[LISTENING_SOCKETS];
+    struct vec vec;
+    union usa usa;
+    socklen_t len;
+    SOCKET sock;
+#if defined(SO_REUSEPORT)
+    int on = 1;
+#endif
+
+    while (list != NULL && (list = next_option(list, &vec, NULL)) != NULL) {
+        sock = (SOCKET) atoi(vec.ptr);
+        len = sizeof(usa);
+        memset(&usa, 0, sizeof(usa));
+        if (is_listening_socket(sock) &&
+            getsockname(sock, &usa.sa, &len) == 0 &&
+            same_address(&usa, lsa) && !is_adopted(ctx, sock)
+#if defined(SO_REUSEPORT)
+            /* A server with one acceptor hands over sockets without it. Set
+               late, it still lets the other acceptors bind to the port. */
+            && (ctx->num_acceptors == 1 ||
+                setsockopt(sock, SOL_SOCKET, SO_REUSEPORT, (void *) &on,
+                           sizeof(on)) == 0)
+#endif
+           ) {
+            return sock;
+        }
+    }
+#else
+    (void) ctx;
+    (void) lsa;
+#endif
+    return INVALID_SOCKET;
+}
+
+/* Closes the sockets handed over for ports that are not listened on
+   anymore. Descriptors of the option that are no listening sockets are not
+   ours to close. */
+static void close_unadopted_sockets(struct mg_context *ctx)
+{
+#if !defined(_WIN32)
+    const char *list = ctx->config[LISTENING_SOCKETS];
+    struct vec vec;
+    SOCKET sock;
+
+    while (list != NULL && (list = next_option(list, &vec, NULL)) != NULL) {
+        sock = (SOCKET) atoi(vec.ptr);
+        if (is_adopted(ctx, sock)) {
+            continue;
+        } else if (is_listening_socket(sock)) {
+            closesocket(sock);
+        } else {
+            mg_cry(fc(ctx), "%s: %.*s is not a listening socket, left open",
+                   __func__, (int) vec.len, vec.ptr);
+        }
+    }
+#else
+    (void) ctx;
+#endif
+}
+
+/* Gives every acceptor but the master thread a socket of its own for each
+   listening socket, bound to the same address with SO_REUSEPORT. The kernel
+   then spreads incoming connections over the acceptors. */
+static int open_acceptor_sockets(struct mg_context *ctx)
+{
+#if defined(SO_REUSEPORT)
+    int i, j, on = 1;
+#if defined(USE_IPV6)
+    int off = 0;
+#endif
+    struct socket *so;
+    socklen_t len;
+
+    for (i = 1; i < ctx->num_acceptors; i++) {
+        if ((so = (struct socket *) mg_calloc(ctx->num_listening_sockets,
+                                              sizeof(*so))) == NULL) {
+            return 0;
+        }
+        ctx->acceptors[i].listening_sockets = so;
+        for (j = 0; j < ctx->num_listening_sockets; j++) {
+            so[j] = ctx->listening_sockets[j];
+            so[j].sock = INVALID_SOCKET;
+        }
+
+        for (j = 0; j < ctx->num_listening_sockets; j++, so++) {
+            /* Sockets of the acceptors of a previous server come first */
+            if ((so->sock = adopt_listening_socket(ctx, &so->lsa)) !=
+                INVALID_SOCKET) {
+                set_close_on_exec(so->sock, fc(ctx));
+                continue;
+            }
+
+            /* Port 0 was resolved when the first socket was bound */
+            len = sizeof(so->lsa);
+            if (getsockname(ctx->listening_sockets[j].sock, &so->lsa.sa,
+                            &len) != 0 ||
+                (so->sock = socket(so->lsa.sa.sa_family, SOCK_STREAM, 6)) ==
+                INVALID_SOCKET ||
+                setsockopt(so->sock, SOL_SOCKET, SO_REUSEADDR,
+                           (void *) &on, sizeof(on)) != 0 ||
+                setsockopt(so->sock, SOL_SOCKET, SO_REUSEPORT,
+                           (void *) &on, sizeof(on)) != 0 ||
+#if defined(USE_IPV6)
+                (so->lsa.sa.sa_family == AF_INET6 &&
+                 setsockopt(so->sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *) &off,
+                            sizeof(off)) != 0) ||
+#endif
+                !set_listening_socket_options(ctx, so->sock) ||
+                bind(so->sock, &so->lsa.sa, len) != 0 ||
+                listen(so->sock, listen_backlog(ctx)) != 0) {
+                mg_cry(fc(ctx), "%s: cannot bind acceptor %d to port %d: %s",
+                       __func__, i, (int) ctx->listening_ports[j],
+                       strerror(ERRNO));
+                return 0;
+            }
+            set_close_on_exec(so->sock, fc(ctx));
+        }
+    }
+    return 1;
+#else
+    return ctx->num_acceptors == 1;
+#endif
+}
+
+int mg_export_listening_sockets(struct mg_context *ctx, char *buf,
+                                size_t buf_len)
+{
+#if !defined(_WIN32)
+    int i, n, fd, total;
+    size_t len = 0;
+    const char *p;
+    SOCKET sock;
+
+    if (buf_len > 0) {
+        buf[0] = '\0';
+    }
+    /* The kernel spreads connections over the sockets of every acceptor,
+       so all of them are handed over, acceptor 0 first */
+    total = ctx->num_acceptors * ctx->num_listening_sockets;
+    for (i = 0; i < total; i++) {
+        sock = ctx->acceptors[i / ctx->num_listening_sockets]
+               .listening_sockets[i % ctx->num_listening_sockets].sock;
+        /* The duplicate survives exec(), and mg_stop() of this server */
+        if ((fd = dup(sock)) < 0) {
+            break;
+        }
+        n = snprintf(buf + len, buf_len - len, i > 0 ? ",%d" : "%d", fd);
+        if (n < 0 || (size_t) n >= buf_len - len) {
+            (void) close(fd);
+            break;
+        }
+        len += n;
+    }
+    if (i == total) {
+        return i;
+    }
+
+    /* Release the duplicates made so far */
+    if (buf_len > 0) {
+        buf[len] = '\0';
+        for (p = buf; len > 0 && p != NULL; p = strchr(p, ',')) {
+            p += *p == ',';
+            (void) close(atoi(p));
+        }
+        buf[0] = '\0';
+    }
+#else
+    (void) ctx;
+    (void) buf;
+    (void) buf_len;
+#endif
+    return -1;
+}
+
 static int set_ports_option(struct mg_context *ctx)
 {
     const char *list = ctx->config[LISTENING_PORTS];
@@ -5670,20 +7582,30 @@ static int set_ports_option(struct mg_context *ctx)
         } else if (so.is_ssl && ctx->ssl_ctx == NULL) {
             mg_cry(fc(ctx), "Cannot add SSL socket, is -ssl_certificate option set?");
             success = 0;
-        } else if ((so.sock = socket(so.lsa.sa.sa_family, SOCK_STREAM, 6)) ==
-                   INVALID_SOCKET ||
-                   /* On Windows, SO_REUSEADDR is recommended only for
-                      broadcast UDP sockets */
-                   setsockopt(so.sock, SOL_SOCKET, SO_REUSEADDR,
-                              (void *) &on, sizeof(on)) != 0 ||
+        } else if (/* A socket handed over keeps its options and backlog */
+                   ((so.sock = adopt_listening_socket(ctx, &so.lsa)) ==
+                    INVALID_SOCKET &&
+                    ((so.sock = socket(so.lsa.sa.sa_family, SOCK_STREAM, 6)) ==
+                     INVALID_SOCKET ||
+                     /* On Windows, SO_REUSEADDR is recommended only for
+                        broadcast UDP sockets */
+                     setsockopt(so.sock, SOL_SOCKET, SO_REUSEADDR,
+                                (void *) &on, sizeof(on)) != 0 ||
+#if defined(SO_REUSEPORT)
+                     /* Other acceptors bind to the same port */
+                     (ctx->num_acceptors > 1 &&
+                      setsockopt(so.sock, SOL_SOCKET, SO_REUSEPORT,
+                                 (void *) &on, sizeof(on)) != 0) ||
+#endif
 #if defined(USE_IPV6)
-                   (so.lsa.sa.sa_family == AF_INET6 &&
-                    setsockopt(so.sock, IPPROTO_IPV6, IPV6_V6ONLY, (void *) &off,
-                               sizeof(off)) != 0) ||
+                     (so.lsa.sa.sa_family == AF_INET6 &&
+                      setsockopt(so.sock, IPPROTO_IPV6, IPV6_V6ONLY,
+                                 (void *) &off, sizeof(off)) != 0) ||
 #endif
-                   bind(so.sock, &so.lsa.sa, so.lsa.sa.sa_family == AF_INET ?
-                        sizeof(so.lsa.sin) : sizeof(so.lsa)) != 0 ||
-                   listen(so.sock, SOMAXCONN) != 0 ||
+                     !set_listening_socket_options(ctx, so.sock) ||
+                     bind(so.sock, &so.lsa.sa, so.lsa.sa.sa_family == AF_INET ?
+                          sizeof(so.lsa.sin) : sizeof(so.lsa)) != 0 ||
+                     listen(so.sock, listen_backlog(ctx)) != 0)) ||
                    getsockname(so.sock, &(usa.sa), &len) != 0) {
             mg_cry(fc(ctx), "%s: cannot bind to %.*s: %d (%s)", __func__,
                    (int) vec.len, vec.ptr, ERRNO, strerror(errno));
@@ -5704,6 +7626,8 @@ static int set_ports_option(struct mg_context *ctx)
         }
         else {
             set_close_on_exec(so.sock, fc(ctx));
+            /* Connections get the bound address, port 0 resolved */
+            so.lsa = usa;
             ctx->listening_sockets = ptr;
             ctx->listening_sockets[ctx->num_listening_sockets] = so;
             ctx->listening_ports = portPtr;
@@ -5712,6 +7636,11 @@ static int set_ports_option(struct mg_context *ctx)
         }
     }
 
+    if (success) {
+        ctx->acceptors[0].listening_sockets = ctx->listening_sockets;
+        success = open_acceptor_sockets(ctx);
+    }
+    close_unadopted_sockets(ctx);
     if (!success) {
         close_all_listening_sockets(ctx);
     }
@@ -5996,6 +7925,7 @@ static void reset_per_request_attributes(struct mg_connection *conn)
     conn->num_bytes_sent = conn->consumed_content = 0;
     conn->status_code = -1;
     conn->must_close = conn->request_len = conn->throttle = 0;
+    conn->headers_indexed = 0;
 }
 
 static void close_socket_gracefully(struct mg_connection *conn)
@@ -6035,6 +7965,54 @@ static void close_socket_gracefully(struct mg_connection *conn)
     closesocket(conn->client.sock);
 }
 
+/* Sequentially consistent atomics for the socket queue and counters */
+#if defined(_WIN32)
+static unsigned long mg_atomic_load(const volatile unsigned long *p)
+{
+    return (unsigned long) InterlockedCompareExchange((volatile LONG *) p,
+                                                      0, 0);
+}
+
+static void mg_atomic_store(volatile unsigned long *p, unsigned long value)
+{
+    (void) InterlockedExchange((volatile LONG *) p, (LONG) value);
+}
+
+static int mg_atomic_cas(volatile unsigned long *p, unsigned long expected,
+                         unsigned long desired)
+{
+    return InterlockedCompareExchange((volatile LONG *) p, (LONG) desired,
+                                      (LONG) expected) == (LONG) expected;
+}
+
+static void mg_atomic_add(volatile unsigned long *p, long delta)
+{
+    (void) InterlockedExchangeAdd((volatile LONG *) p, (LONG) delta);
+}
+#else
+static unsigned long mg_atomic_load(const volatile unsigned long *p)
+{
+    return __atomic_load_n(p, __ATOMIC_SEQ_CST);
+}
+
+static void mg_atomic_store(volatile unsigned long *p, unsigned long value)
+{
+    __atomic_store_n(p, value, __ATOMIC_SEQ_CST);
+}
+
+static int mg_atomic_cas(volatile unsigned long *p, unsigned long expected,
+                         unsigned long desired)
+{
+    return __atomic_compare_exchange_n(p, &expected, desired, 0,
+                                       __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST);
+}
+
+static void mg_atomic_add(volatile unsigned long *p, long delta)
+{
+    (void) __atomic_fetch_add(p, (unsigned long) delta, __ATOMIC_SEQ_CST);
+}
+#endif
+
 static void close_connection(struct mg_connection *conn)
 {
 #if defined(USE_LUA) && defined(USE_WEBSOCKET)
@@ -6062,6 +8040,7 @@ static void close_connection(struct mg_connection *conn)
     if (conn->client.sock != INVALID_SOCKET) {
         close_socket_gracefully(conn);
         conn->client.sock = INVALID_SOCKET;
+        mg_atomic_add(&conn->ctx->open_connections, -1);
     }
 
     mg_unlock(conn);
@@ -6148,12 +8127,13 @@ static int getreq(struct mg_connection *conn, char *ebuf, size_t ebuf_len)
         snprintf(ebuf, ebuf_len, "%s", "Request Too Large");
     } else if (conn->request_len <= 0) {
         snprintf(ebuf, ebuf_len, "%s", "Client closed connection");
-    } else if (parse_http_message(conn->buf, conn->buf_size,
-                                  &conn->request_info) <= 0) {
+    } else if (tokenize_http_message(conn->buf, conn->request_len,
+                                     &conn->request_info) <= 0) {
         snprintf(ebuf, ebuf_len, "Bad request: [%.*s]", conn->data_len, conn->buf);
     } else {
         /* Message is a valid request or response */
-        if ((cl = get_header(&conn->request_info, "Content-Length")) != NULL) {
+        index_headers(conn);
+        if ((cl = mg_get_header(conn, "Content-Length")) != NULL) {
             /* Request/response has content length set */
             conn->content_len = strtoll(cl, NULL, 10);
         } else if (!mg_strcasecmp(conn->request_info.request_method, "POST") ||
@@ -6196,111 +8176,29 @@ struct mg_connection *mg_download(const char *host, int port, int use_ssl,
     return conn;
 }
 
-static void process_new_connection(struct mg_connection *conn)
+static struct mg_connection *new_worker_connection(struct mg_context *ctx)
 {
-    struct mg_request_info *ri = &conn->request_info;
-    int keep_alive_enabled, keep_alive, discard_len;
-    char ebuf[100];
-
-    keep_alive_enabled = !strcmp(conn->ctx->config[ENABLE_KEEP_ALIVE], "yes");
-    keep_alive = 0;
-
-    /* Important: on new connection, reset the receiving buffer. Credit goes
-       to crule42. */
-    conn->data_len = 0;
-    do {
-        if (!getreq(conn, ebuf, sizeof(ebuf))) {
-            send_http_error(conn, 500, "Server Error", "%s", ebuf);
-            conn->must_close = 1;
-        } else if (!is_valid_uri(conn->request_info.uri)) {
-            snprintf(ebuf, sizeof(ebuf), "Invalid URI: [%s]", ri->uri);
-            send_http_error(conn, 400, "Bad Request", "%s", ebuf);
-        } else if (strcmp(ri->http_version, "1.0") &&
-                   strcmp(ri->http_version, "1.1")) {
-            snprintf(ebuf, sizeof(ebuf), "Bad HTTP version: [%s]", ri->http_version);
-            send_http_error(conn, 505, "Bad HTTP version", "%s", ebuf);
-        }
-
-        if (ebuf[0] == '\0') {
-            handle_request(conn);
-            if (conn->ctx->callbacks.end_request != NULL) {
-                conn->ctx->callbacks.end_request(conn, conn->status_code);
-            }
-            log_access(conn);
-        }
-        if (ri->remote_user != NULL) {
-            mg_free((void *) ri->remote_user);
-            /* Important! When having connections with and without auth
-               would cause double free and then crash */
-            ri->remote_user = NULL;
-        }
-
-        /* NOTE(lsm): order is important here. should_keep_alive() call is
-           using parsed request, which will be invalid after memmove's below.
-           Therefore, memorize should_keep_alive() result now for later use
-           in loop exit condition. */
-        keep_alive = conn->ctx->stop_flag == 0 && keep_alive_enabled &&
-                     conn->content_len >= 0 && should_keep_alive(conn);
-
-        /* Discard all buffered data for this request */
-        discard_len = conn->content_len >= 0 && conn->request_len > 0 &&
-                      conn->request_len + conn->content_len < (int64_t) conn->data_len ?
-                      (int) (conn->request_len + conn->content_len) : conn->data_len;
-        assert(discard_len >= 0);
-        memmove(conn->buf, conn->buf + discard_len, conn->data_len - discard_len);
-        conn->data_len -= discard_len;
-        assert(conn->data_len >= 0);
-        assert(conn->data_len <= conn->buf_size);
-    } while (keep_alive);
-}
+    struct mg_connection *conn;
 
-/* Worker threads take accepted socket from the queue */
-static int consume_socket(struct mg_context *ctx, struct socket *sp)
-{
+    /* Every keep-alive connection parked with the reactor costs its worker
+       a new connection, so reuse the ones freed when others resume */
     (void) pthread_mutex_lock(&ctx->mutex);
-    DEBUG_TRACE(("going idle"));
-
-    /* If the queue is empty, wait. We're idle at this point. */
-    while (ctx->sq_head == ctx->sq_tail && ctx->stop_flag == 0) {
-        pthread_cond_wait(&ctx->sq_full, &ctx->mutex);
-    }
-
-    /* If we're stopping, sq_head may be equal to sq_tail. */
-    if (ctx->sq_head > ctx->sq_tail) {
-        /* Copy socket from the queue and increment tail */
-        *sp = ctx->queue[ctx->sq_tail % ARRAY_SIZE(ctx->queue)];
-        ctx->sq_tail++;
-        DEBUG_TRACE(("grabbed socket %d, going busy", sp->sock));
-
-        /* Wrap pointers if needed */
-        while (ctx->sq_tail > (int) ARRAY_SIZE(ctx->queue)) {
-            ctx->sq_tail -= ARRAY_SIZE(ctx->queue);
-            ctx->sq_head -= ARRAY_SIZE(ctx->queue);
-        }
+    if ((conn = ctx->spare_conns) != NULL) {
+        ctx->spare_conns = conn->next_resumed;
+        ctx->num_spare_conns--;
     }
-
-    (void) pthread_cond_signal(&ctx->sq_empty);
     (void) pthread_mutex_unlock(&ctx->mutex);
 
-    return !ctx->stop_flag;
-}
-
-static void *worker_thread_run(void *thread_func_param)
-{
-    struct mg_context *ctx = (struct mg_context *) thread_func_param;
-    struct mg_connection *conn;
-    struct mg_workerTLS tls;
-
-    tls.is_master = 0;
-#if defined(_WIN32) && !defined(__SYMBIAN32__)
-    tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
-#endif
-
-    conn = (struct mg_connection *) mg_calloc(1, sizeof(*conn) + MAX_REQUEST_SIZE);
+    if (conn != NULL) {
+        /* The request buffer is overwritten before it is read */
+        memset(conn, 0, sizeof(*conn));
+    } else {
+        conn = (struct mg_connection *) mg_calloc(1, sizeof(*conn) +
+                                                  MAX_REQUEST_SIZE);
+    }
     if (conn == NULL) {
         mg_cry(fc(ctx), "%s", "Cannot create new connection struct, OOM");
     } else {
-        pthread_setspecific(sTlsKey, &tls);
         conn->buf_size = MAX_REQUEST_SIZE;
         conn->buf = (char *) (conn + 1);
         conn->ctx = ctx;
@@ -6308,47 +8206,771 @@ static void *worker_thread_run(void *thread_func_param)
         /* Allocate a mutex for this connection to allow communication both
            within the request handler and from elsewhere in the application */
         (void) pthread_mutex_init(&conn->mutex, NULL);
-
-        /* Call consume_socket() even when ctx->stop_flag > 0, to let it
-           signal sq_empty condvar to wake up the master waiting in
-           produce_socket() */
-        while (consume_socket(ctx, &conn->client)) {
-            conn->birth_time = time(NULL);
-
-            /* Fill in IP, port info early so even if SSL setup below fails,
-               error handler would have the corresponding info.
-               Thanks to Johannes Winkelmann for the patch.
-               TODO(lsm): Fix IPv6 case */
-            conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
-            memcpy(&conn->request_info.remote_ip,
-                   &conn->client.rsa.sin.sin_addr.s_addr, 4);
-            conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
-            conn->request_info.is_ssl = conn->client.is_ssl;
-
-            if (!conn->client.is_ssl
-#ifndef NO_SSL
-                || sslize(conn, conn->ctx->ssl_ctx, SSL_accept)
-#endif
-               ) {
-                process_new_connection(conn);
-            }
-
-            close_connection(conn);
-        }
     }
+    return conn;
+}
 
-    /* Signal master that we're done with connection and exiting */
-    (void) pthread_mutex_lock(&ctx->mutex);
-    ctx->num_threads--;
-    (void) pthread_cond_signal(&ctx->cond);
-    assert(ctx->num_threads >= 0);
-    (void) pthread_mutex_unlock(&ctx->mutex);
+/* Only for connections made by new_worker_connection() */
+static void free_connection(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+
+    (void) pthread_mutex_destroy(&conn->mutex);
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (ctx->num_spare_conns < ctx->max_threads) {
+        conn->next_resumed = ctx->spare_conns;
+        ctx->spare_conns = conn;
+        ctx->num_spare_conns++;
+        conn = NULL;
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    mg_free(conn);
+}
+
+/* Stores an accepted socket, or a connection when conn is not NULL, in the
+   socket queue without taking any lock. Producers claim a position with a
+   CAS on head, then publish the entry through the sequence number of its
+   slot. Returns 0 when the queue is full. */
+static int sq_push(struct socket_queue *q, const struct socket *sp,
+                   struct mg_connection *conn)
+{
+    struct sq_slot *slot;
+    unsigned long pos = mg_atomic_load(&q->head);
+    long dif;
+
+    for (;;) {
+        slot = &q->slots[pos & (MGSQLEN - 1)];
+        dif = (long) (mg_atomic_load(&slot->seq) - pos);
+        if (dif == 0 && mg_atomic_cas(&q->head, pos, pos + 1)) {
+            break;
+        } else if (dif < 0) {
+            /* The consumer of the previous round did not take it yet */
+            return 0;
+        }
+        pos = mg_atomic_load(&q->head);
+    }
+
+    if (sp != NULL) {
+        slot->sock = *sp;
+    }
+    slot->conn = conn;
+    mg_atomic_store(&slot->seq, pos + 1);
+    return 1;
+}
+
+/* Takes the oldest entry out of the socket queue: a connection is stored in
+   *conn, an accepted socket in *sp with *conn set to NULL. Returns 0 when the
+   queue is empty. */
+static int sq_pop(struct socket_queue *q, struct socket *sp,
+                  struct mg_connection **conn)
+{
+    struct sq_slot *slot;
+    unsigned long pos = mg_atomic_load(&q->tail);
+    long dif;
+
+    for (;;) {
+        slot = &q->slots[pos & (MGSQLEN - 1)];
+        dif = (long) (mg_atomic_load(&slot->seq) - (pos + 1));
+        if (dif == 0 && mg_atomic_cas(&q->tail, pos, pos + 1)) {
+            break;
+        } else if (dif < 0) {
+            return 0;
+        }
+        pos = mg_atomic_load(&q->tail);
+    }
+
+    *conn = slot->conn;
+    if (*conn == NULL) {
+        *sp = slot->sock;
+    }
+    mg_atomic_store(&slot->seq, pos + MGSQLEN);
+    return 1;
+}
+
+static void sq_init(struct socket_queue *q)
+{
+    int i;
+
+    for (i = 0; i < MGSQLEN; i++) {
+        q->slots[i].seq = (unsigned long) i;
+    }
+    (void) pthread_mutex_init(&q->mutex, NULL);
+    (void) pthread_cond_init(&q->sq_empty, NULL);
+    (void) pthread_cond_init(&q->sq_full, NULL);
+}
+
+static void sq_destroy(struct socket_queue *q)
+{
+    (void) pthread_mutex_destroy(&q->mutex);
+    (void) pthread_cond_destroy(&q->sq_empty);
+    (void) pthread_cond_destroy(&q->sq_full);
+}
+
+int mg_get_thread_count(const struct mg_context *ctx)
+{
+    return ctx->num_threads;
+}
+
+size_t mg_get_queue_depths(const struct mg_context *ctx, size_t size,
+                           int *depths)
+{
+    size_t i;
+    const struct socket_queue *q;
+
+    for (i = 0; i < size && i < (size_t) ctx->num_queues; i++) {
+        q = &ctx->queues[i];
+        depths[i] = (int) (mg_atomic_load(&q->head) - mg_atomic_load(&q->tail));
+        if (depths[i] < 0) {
+            /* A consumer moved tail between the two loads */
+            depths[i] = 0;
+        }
+    }
+    return i;
+}
+
+/* Wakes a worker thread sleeping on an empty queue, preferably one of the
+   group of q, which other groups steal from. Waiters announce themselves in
+   their queue's idle count before their last look at the queues, so either
+   they see the new entry or the producer sees them. */
+static void wake_idle_worker(struct mg_context *ctx, struct socket_queue *q)
+{
+    int i;
+
+    for (i = 0; mg_atomic_load(&q->idle) == 0; i++) {
+        if (i == ctx->num_queues) {
+            return;
+        }
+        q = &ctx->queues[i];
+    }
+    (void) pthread_mutex_lock(&q->mutex);
+    (void) pthread_cond_signal(&q->sq_full);
+    (void) pthread_mutex_unlock(&q->mutex);
+}
+
+/* Takes an entry from the queue of another group, starting with the one
+   after q, for a worker thread whose own queue is empty */
+static int sq_steal(struct mg_context *ctx, struct socket_queue *q,
+                    struct socket *sp, struct mg_connection **conn)
+{
+    int i, start = (int) (q - ctx->queues);
+
+    for (i = 1; i < ctx->num_queues; i++) {
+        if (sq_pop(&ctx->queues[(start + i) % ctx->num_queues], sp, conn)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Queues a connection for a worker thread of its group to serve its next
+   request. Returns 0 when the server is stopping. */
+static int resume_connection(struct mg_context *ctx,
+                             struct mg_connection *conn)
+{
+    struct socket_queue *q = conn->queue;
+
+    if (ctx->stop_flag != 0) {
+        return 0;
+    }
+    if (sq_push(q, NULL, conn)) {
+        wake_idle_worker(ctx, q);
+        return 1;
+    }
+
+    /* The queue is full: rather than blocking the caller, leave the
+       connection where the workers look before going to sleep */
+    conn->next_resumed = NULL;
+    (void) pthread_mutex_lock(&q->mutex);
+    if (q->resumed_tail != NULL) {
+        q->resumed_tail->next_resumed = conn;
+    } else {
+        q->resumed_head = conn;
+    }
+    q->resumed_tail = conn;
+    (void) pthread_cond_signal(&q->sq_full);
+    (void) pthread_mutex_unlock(&q->mutex);
+    return 1;
+}
+
+#if defined(HAVE_EPOLL)
+/* ctx->mutex must be held */
+static void unlink_idle_connection(struct mg_context *ctx,
+                                   struct mg_connection *conn)
+{
+    if (conn->idle_prev != NULL) {
+        conn->idle_prev->idle_next = conn->idle_next;
+    } else {
+        ctx->idle_head = conn->idle_next;
+    }
+    if (conn->idle_next != NULL) {
+        conn->idle_next->idle_prev = conn->idle_prev;
+    } else {
+        ctx->idle_tail = conn->idle_prev;
+    }
+    conn->idle_prev = conn->idle_next = NULL;
+}
+
+/* Hands a keep-alive connection over to the reactor thread until its next
+   request arrives, so that idle clients do not hold worker threads. Returns
+   0 when the caller keeps serving the connection instead. */
+static int park_idle_connection(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+    struct epoll_event event;
+    struct pollfd pfd;
+    int op;
+
+    /* Bytes buffered here, or decrypted within OpenSSL, are not seen by
+       epoll */
+    if (ctx->epoll_fd < 0 || conn->data_len > 0 || conn->ssl != NULL) {
+        return 0;
+    }
+
+    /* A client that sent its next request already is served right away */
+    pfd.fd = conn->client.sock;
+    pfd.events = POLLIN;
+    if (poll(&pfd, 1, 0) != 0) {
+        return 0;
+    }
+
+    /* The reactor thread takes ctx->mutex before it looks at an event or
+       at the idle list, so registering and linking under it keeps the
+       connection out of its reach until both are done */
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (ctx->stop_flag != 0 || ctx->draining) {
+        (void) pthread_mutex_unlock(&ctx->mutex);
+        return 0;
+    }
+    event.events = EPOLLIN | EPOLLRDHUP | EPOLLONESHOT;
+    event.data.ptr = conn;
+    op = conn->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD;
+    if (epoll_ctl(ctx->epoll_fd, op, pfd.fd, &event) != 0 &&
+        (op == EPOLL_CTL_ADD ||
+         epoll_ctl(ctx->epoll_fd, EPOLL_CTL_ADD, pfd.fd, &event) != 0)) {
+        (void) pthread_mutex_unlock(&ctx->mutex);
+        conn->registered = 0;
+        return 0;
+    }
+    conn->registered = 1;
+    conn->idle_since = monotonic_seconds();
+    conn->idle_next = NULL;
+    conn->idle_prev = ctx->idle_tail;
+    if (ctx->idle_tail != NULL) {
+        ctx->idle_tail->idle_next = conn;
+    } else {
+        ctx->idle_head = conn;
+    }
+    ctx->idle_tail = conn;
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    /* From here on, the reactor thread may take the connection at any time */
+    return 1;
+}
+
+/* Gives idle connections back to worker threads once their next request
+   arrives, and closes the ones idle for longer than request_timeout_ms, or
+   all of them once the server drains. */
+static void reactor_thread_run(struct mg_context *ctx)
+{
+    struct epoll_event events[64];
+    struct mg_connection *conn, *expired, *ready;
+    int i, n, timeout, wait_ms;
+    double now;
+
+    /* Wake up often enough to close idle connections on time */
+    timeout = atoi(ctx->config[REQUEST_TIMEOUT]);
+    wait_ms = timeout > 0 && timeout < 200 ? timeout : 200;
+    while (ctx->stop_flag == 0) {
+        n = epoll_wait(ctx->epoll_fd, events, ARRAY_SIZE(events), wait_ms);
+        now = monotonic_seconds();
+        expired = ready = NULL;
+
+        (void) pthread_mutex_lock(&ctx->mutex);
+        for (i = 0; i < n; i++) {
+            conn = (struct mg_connection *) events[i].data.ptr;
+            unlink_idle_connection(ctx, conn);
+            conn->idle_next = ready;
+            ready = conn;
+        }
+        /* Idle connections are closed right away when draining */
+        while ((conn = ctx->idle_head) != NULL &&
+               (ctx->draining ||
+                (timeout > 0 &&
+                 (now - conn->idle_since) * 1000 >= timeout))) {
+            unlink_idle_connection(ctx, conn);
+            conn->idle_next = expired;
+            expired = conn;
+        }
+        (void) pthread_mutex_unlock(&ctx->mutex);
+
+        while ((conn = ready) != NULL) {
+            ready = conn->idle_next;
+            conn->idle_next = NULL;
+            if (!resume_connection(ctx, conn)) {
+                close_connection(conn);
+                free_connection(conn);
+            }
+        }
+
+        while ((conn = expired) != NULL) {
+            expired = conn->idle_next;
+            /* Drop any event reported meanwhile before epoll_wait sees it */
+            (void) epoll_ctl(ctx->epoll_fd, EPOLL_CTL_DEL, conn->client.sock, NULL);
+            close_connection(conn);
+            free_connection(conn);
+        }
+    }
+}
+
+static void *reactor_thread(void *thread_func_param)
+{
+    reactor_thread_run((struct mg_context *) thread_func_param);
+    return NULL;
+}
+#endif /* HAVE_EPOLL */
+
+/* Reports a request once it has been replied to, then drops it from the
+   buffer. Returns whether the connection stays open for the next request. */
+static int finish_request(struct mg_connection *conn, int handled)
+{
+    struct mg_request_info *ri = &conn->request_info;
+    int keep_alive, discard_len;
+
+    if (handled) {
+        if (conn->ctx->callbacks.end_request != NULL) {
+            conn->ctx->callbacks.end_request(conn, conn->status_code);
+        }
+        log_access(conn);
+    }
+    if (ri->remote_user != NULL) {
+        mg_free((void *) ri->remote_user);
+        /* Important! When having connections with and without auth
+           would cause double free and then crash */
+        ri->remote_user = NULL;
+    }
+
+    /* NOTE(lsm): order is important here. should_keep_alive() call is
+       using parsed request, which will be invalid after memmove's below.
+       Therefore, memorize should_keep_alive() result now for later use
+       in loop exit condition. */
+    keep_alive = mg_should_keep_alive(conn);
+
+    /* Discard all buffered data for this request */
+    discard_len = conn->content_len >= 0 && conn->request_len > 0 &&
+                  conn->request_len + conn->content_len < (int64_t) conn->data_len ?
+                  (int) (conn->request_len + conn->content_len) : conn->data_len;
+    assert(discard_len >= 0);
+    memmove(conn->buf, conn->buf + discard_len, conn->data_len - discard_len);
+    conn->data_len -= discard_len;
+    assert(conn->data_len >= 0);
+    assert(conn->data_len <= conn->buf_size);
+
+    return keep_alive;
+}
+
+/* Lets go of a connection whose request handler deferred the reply, unless
+   the reply is complete already. Resume functions passed meanwhile to
+   mg_resume_request() are called first. Returns whether the connection was
+   parked, after which it belongs to mg_complete_request(). */
+static int park_connection(struct mg_connection *conn)
+{
+    int parked;
+
+    mg_lock(conn);
+    while (conn->deferred == DEFER_RESUMED) {
+        conn->deferred = DEFER_HANDLER;
+        mg_unlock(conn);
+        conn->resume_func(conn, conn->resume_arg);
+        mg_lock(conn);
+    }
+    parked = conn->deferred == DEFER_HANDLER;
+    conn->deferred = parked ? DEFER_PARKED : DEFER_NONE;
+    mg_unlock(conn);
+
+    return parked;
+}
+
+/* Serves requests until the connection is to be closed, then returns 1, or
+   until a request handler defers its reply or the connection goes idle,
+   then returns 0 as the connection was handed over. */
+static int process_requests(struct mg_connection *conn)
+{
+    struct mg_request_info *ri = &conn->request_info;
+    int keep_alive;
+    char ebuf[100];
+#if defined(TCP_QUICKACK)
+    int quickack = !mg_strcasecmp(conn->ctx->config[TCP_QUICK_ACK], "yes");
+#endif
+
+    do {
+#if defined(TCP_QUICKACK)
+        /* Not inherited from the listener and cleared by the kernel as soon
+           as the connection looks interactive, so re-armed per request */
+        if (quickack) {
+            int on = 1;
+            setsockopt(conn->client.sock, IPPROTO_TCP, TCP_QUICKACK,
+                       (void *) &on, sizeof(on));
+        }
+#endif
+        if (!getreq(conn, ebuf, sizeof(ebuf))) {
+            send_http_error(conn, 500, "Server Error", "%s", ebuf);
+            conn->must_close = 1;
+        } else if (!is_valid_uri(conn->request_info.uri)) {
+            snprintf(ebuf, sizeof(ebuf), "Invalid URI: [%s]", ri->uri);
+            send_http_error(conn, 400, "Bad Request", "%s", ebuf);
+        } else if (strcmp(ri->http_version, "1.0") &&
+                   strcmp(ri->http_version, "1.1")) {
+            snprintf(ebuf, sizeof(ebuf), "Bad HTTP version: [%s]", ri->http_version);
+            send_http_error(conn, 505, "Bad HTTP version", "%s", ebuf);
+        }
+
+        if (ebuf[0] == '\0') {
+            handle_request(conn);
+            if (conn->deferred != DEFER_NONE && park_connection(conn)) {
+                return 0;
+            }
+        }
+        keep_alive = finish_request(conn, ebuf[0] == '\0');
+#if defined(HAVE_EPOLL)
+        if (keep_alive && park_idle_connection(conn)) {
+            return 0;
+        }
+#endif
+    } while (keep_alive);
+
+    return 1;
+}
+
+/* Serves a connection handed over by mg_resume_request(), then its next
+   requests. Returns like process_requests(). */
+static int process_resumed(struct mg_connection *conn)
+{
+    if (park_connection(conn)) {
+        return 0;
+    }
+    if (!finish_request(conn, 1)) {
+        return 1;
+    }
+#if defined(HAVE_EPOLL)
+    if (park_idle_connection(conn)) {
+        return 0;
+    }
+#endif
+    return process_requests(conn);
+}
+
+static int process_new_connection(struct mg_connection *conn)
+{
+    /* Important: on new connection, reset the receiving buffer. Credit goes
+       to crule42. */
+    conn->data_len = 0;
+    return process_requests(conn);
+}
+
+void mg_defer_request(struct mg_connection *conn)
+{
+    conn->deferred = DEFER_HANDLER;
+}
+
+void mg_complete_request(struct mg_connection *conn)
+{
+    struct mg_context *ctx = conn->ctx;
+
+    mg_lock(conn);
+    if (conn->deferred == DEFER_HANDLER) {
+        /* The worker thread finishes the request when the handler returns */
+        conn->deferred = DEFER_COMPLETED;
+        mg_unlock(conn);
+        return;
+    }
+    conn->deferred = DEFER_NONE;
+    mg_unlock(conn);
+
+    if (finish_request(conn, 1)) {
+#if defined(HAVE_EPOLL)
+        if (park_idle_connection(conn)) {
+            return;
+        }
+#endif
+        /* Hand the connection to a worker thread for its next request */
+        if (resume_connection(ctx, conn)) {
+            return;
+        }
+    }
+    if (conn != NULL) {
+        close_connection(conn);
+        free_connection(conn);
+    }
+}
+
+void mg_resume_request(struct mg_connection *conn,
+                       void (*func)(struct mg_connection *, void *),
+                       void *arg)
+{
+    int parked;
+
+    mg_lock(conn);
+    conn->resume_func = func;
+    conn->resume_arg = arg;
+    parked = conn->deferred == DEFER_PARKED;
+    conn->deferred = DEFER_RESUMED;
+    mg_unlock(conn);
+
+    /* Otherwise the worker thread still in the handler calls func */
+    if (parked && !resume_connection(conn->ctx, conn)) {
+        /* The server is stopping, no worker thread takes it anymore */
+        if (!park_connection(conn)) {
+            close_connection(conn);
+            free_connection(conn);
+        }
+    }
+}
+
+/* Closes an entry of the socket queue that no worker thread will serve */
+static void discard_queued(struct mg_context *ctx, struct socket *sp,
+                           struct mg_connection *conn)
+{
+    if (conn != NULL) {
+        close_connection(conn);
+        free_connection(conn);
+    } else {
+        closesocket(sp->sock);
+        mg_atomic_add(&ctx->open_connections, -1);
+    }
+}
+
+static void grow_pool(struct mg_context *ctx);
+
+/* Lets an idle worker thread exit, unless the pool is at min_threads or
+   an entry was queued while it gave up waiting. q->mutex is held, so
+   ctx->mutex nests inside it. The thread leaves the pool, then stops being
+   idle, then looks at the queues a last time: a producer either queued
+   before that look, or finds no idle thread and a pool it can grow. */
+static int retire_worker(struct mg_worker *worker)
+{
+    struct mg_context *ctx = worker->ctx;
+    struct socket_queue *q = worker->queue;
+    int i, queued, retired = 0;
+
+    (void) pthread_mutex_lock(&ctx->mutex);
+    if (ctx->num_threads > ctx->min_threads && ctx->stop_flag == 0) {
+        ctx->num_threads--;
+        mg_atomic_add(&q->idle, -1);
+        queued = q->resumed_head != NULL;
+        for (i = 0; i < ctx->num_queues && !queued; i++) {
+            queued = mg_atomic_load(&ctx->queues[i].head) !=
+                     mg_atomic_load(&ctx->queues[i].tail);
+        }
+        if (queued) {
+            /* Stay and serve it */
+            ctx->num_threads++;
+            mg_atomic_add(&q->idle, 1);
+        } else {
+            /* From here on, the thread must not take ctx->mutex: the
+               master thread may be joining it while holding the mutex */
+            worker->state = WORKER_RETIRED;
+            ctx->retired = retired = 1;
+        }
+    }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    return retired;
+}
+
+/* Worker threads take accepted socket from their queue, or a connection
+   whose deferred request completed, which is then stored in *resumed. When
+   their queue is empty, they steal from the others before going to sleep.
+   The mutex is only taken to sleep, or to wake an acceptor waiting for
+   room. Returns 0 when the thread must exit: the server is stopping, or the
+   thread retired after thread_idle_timeout_ms without work. */
+static int consume_socket(struct mg_worker *worker, struct socket *sp,
+                          struct mg_connection **resumed)
+{
+    struct mg_context *ctx = worker->ctx;
+    struct socket_queue *q = worker->queue;
+    struct timespec deadline;
+    int found, i, retired = 0;
+
+    *resumed = NULL;
+    while (!(found = sq_pop(q, sp, resumed) || sq_steal(ctx, q, sp, resumed)) &&
+           ctx->stop_flag == 0) {
+        (void) pthread_mutex_lock(&q->mutex);
+        mg_atomic_add(&q->idle, 1);
+        if ((*resumed = q->resumed_head) != NULL) {
+            q->resumed_head = (*resumed)->next_resumed;
+            if (q->resumed_head == NULL) {
+                q->resumed_tail = NULL;
+            }
+            found = 1;
+        } else if (!(found = sq_pop(q, sp, resumed) ||
+                             sq_steal(ctx, q, sp, resumed)) &&
+                   ctx->stop_flag == 0) {
+            /* The queue is empty, wait. We're idle at this point. */
+            DEBUG_TRACE(("going idle"));
+            if (ctx->min_threads < ctx->max_threads) {
+                clock_gettime(CLOCK_REALTIME, &deadline);
+                deadline.tv_sec += ctx->thread_idle_timeout / 1000;
+                deadline.tv_nsec += (ctx->thread_idle_timeout % 1000) * 1000000L;
+                if (deadline.tv_nsec >= 1000000000L) {
+                    deadline.tv_sec++;
+                    deadline.tv_nsec -= 1000000000L;
+                }
+                if (pthread_cond_timedwait(&q->sq_full, &q->mutex,
+                                           &deadline) != 0) {
+                    retired = retire_worker(worker);
+                }
+            } else {
+                (void) pthread_cond_wait(&q->sq_full, &q->mutex);
+            }
+        }
+        if (!retired) {
+            mg_atomic_add(&q->idle, -1);
+        }
+        (void) pthread_mutex_unlock(&q->mutex);
+        if (found) {
+            break;
+        } else if (retired) {
+            DEBUG_TRACE(("retiring"));
+            return 0;
+        }
+    }
+
+    if (found) {
+        DEBUG_TRACE(("grabbed socket %d, going busy",
+                     *resumed != NULL ? (*resumed)->client.sock : sp->sock));
+        /* The entry may come from another queue, check them all */
+        for (i = 0; i < ctx->num_queues; i++) {
+            if (mg_atomic_load(&ctx->queues[i].blocked) > 0) {
+                (void) pthread_mutex_lock(&ctx->queues[i].mutex);
+                (void) pthread_cond_signal(&ctx->queues[i].sq_empty);
+                (void) pthread_mutex_unlock(&ctx->queues[i].mutex);
+            }
+        }
+        if (ctx->stop_flag != 0) {
+            discard_queued(ctx, sp, *resumed);
+            *resumed = NULL;
+        } else {
+            /* Going busy, maybe leaving sockets with no thread to take them */
+            grow_pool(ctx);
+        }
+    }
+
+    return !ctx->stop_flag;
+}
+
+/* Keeps the calling thread on one of the CPUs the process may use, so that
+   a shard's connections stay in the caches of that CPU */
+static void pin_to_cpu(struct mg_context *ctx, int shard)
+{
+#if defined(__linux__)
+    cpu_set_t allowed, cpu;
+    int i, n;
+
+    if (sched_getaffinity(0, sizeof(allowed), &allowed) != 0 ||
+        (n = CPU_COUNT(&allowed)) == 0) {
+        return;
+    }
+    n = shard % n;
+    for (i = 0; i < CPU_SETSIZE; i++) {
+        if (CPU_ISSET(i, &allowed) && n-- == 0) {
+            break;
+        }
+    }
+    CPU_ZERO(&cpu);
+    CPU_SET(i, &cpu);
+    if (pthread_setaffinity_np(pthread_self(), sizeof(cpu), &cpu) != 0) {
+        mg_cry(fc(ctx), "%s: cannot pin shard %d to CPU %d", __func__, shard, i);
+    }
+#else
+    (void) ctx;
+    (void) shard;
+#endif
+}
+
+static void *worker_thread_run(void *thread_func_param)
+{
+    struct mg_worker *worker = (struct mg_worker *) thread_func_param;
+    struct mg_context *ctx = worker->ctx;
+    struct mg_connection *conn, *resumed;
+    struct socket_queue *q = worker->queue;
+    struct mg_workerTLS tls;
+    int done;
+
+    tls.is_master = 0;
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+    tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+
+    if (ctx->sharded) {
+        pin_to_cpu(ctx, (int) (q - ctx->queues));
+    }
+
+    conn = new_worker_connection(ctx);
+    if (conn != NULL) {
+        pthread_setspecific(sTlsKey, &tls);
+
+        /* Call consume_socket() even when ctx->stop_flag > 0, to let it
+           signal sq_empty condvar to wake up the master waiting in
+           produce_socket() */
+        while (consume_socket(worker, &conn->client, &resumed)) {
+            if (resumed != NULL) {
+                /* Take over the connection, buffer included */
+                free_connection(conn);
+                conn = resumed;
+                done = conn->deferred == DEFER_RESUMED ?
+                       process_resumed(conn) : process_requests(conn);
+            } else {
+                conn->birth_time = time(NULL);
+                conn->queue = q;
+#if defined(HAVE_EPOLL)
+                conn->registered = 0;
+#endif
+
+                /* Fill in IP, port info early so even if SSL setup below fails,
+                   error handler would have the corresponding info.
+                   Thanks to Johannes Winkelmann for the patch.
+                   TODO(lsm): Fix IPv6 case */
+                conn->request_info.remote_port = ntohs(conn->client.rsa.sin.sin_port);
+                memcpy(&conn->request_info.remote_ip,
+                       &conn->client.rsa.sin.sin_addr.s_addr, 4);
+                conn->request_info.remote_ip = ntohl(conn->request_info.remote_ip);
+                conn->request_info.is_ssl = conn->client.is_ssl;
+
+                done = 1;
+                if (!conn->client.is_ssl
+#ifndef NO_SSL
+                    || sslize(conn, conn->ctx->ssl_ctx, SSL_accept)
+#endif
+                   ) {
+                    done = process_new_connection(conn);
+                }
+            }
+
+            if (done) {
+                close_connection(conn);
+            } else if ((conn = new_worker_connection(ctx)) == NULL) {
+                /* The parked connection is not ours anymore */
+                break;
+            }
+        }
+    }
+
+    /* Signal master that we're done with connection and exiting. A retired
+       thread was accounted for already. */
+    if (worker->state != WORKER_RETIRED) {
+        (void) pthread_mutex_lock(&ctx->mutex);
+        ctx->num_threads--;
+        (void) pthread_cond_signal(&ctx->cond);
+        assert(ctx->num_threads >= 0);
+        (void) pthread_mutex_unlock(&ctx->mutex);
+    }
 
     pthread_setspecific(sTlsKey, 0);
 #if defined(_WIN32) && !defined(__SYMBIAN32__)
     CloseHandle(tls.pthread_cond_helper_mutex);
 #endif
-    mg_free(conn);
+    if (conn != NULL) {
+        free_connection(conn);
+    }
 
     DEBUG_TRACE(("exiting"));
     return NULL;
@@ -6370,50 +8992,182 @@ static void *worker_thread(void *thread_func_param)
 }
 #endif /* _WIN32 */
 
-/* Master thread adds accepted socket to a queue */
-static void produce_socket(struct mg_context *ctx, const struct socket *sp)
+/* Joins the threads that retired. ctx->mutex must be held. */
+static void join_retired_workers(struct mg_context *ctx)
 {
-    (void) pthread_mutex_lock(&ctx->mutex);
+    int i;
+
+    ctx->retired = 0;
+    for (i = 0; i < ctx->max_threads; i++) {
+        if (ctx->workers[i].state == WORKER_RETIRED) {
+            mg_join_thread(ctx->workers[i].thread_id);
+            ctx->workers[i].state = WORKER_FREE;
+        }
+    }
+}
+
+/* Starts a worker thread taking sockets from q. ctx->mutex must be held. */
+static int start_worker(struct mg_context *ctx, struct socket_queue *q)
+{
+    struct mg_worker *worker;
+    int i;
+
+    /* The master thread may be waiting in produce_socket() instead of
+       joining the retired threads, whose slots are needed now */
+    if (ctx->retired) {
+        join_retired_workers(ctx);
+    }
+    for (i = 0; i < ctx->max_threads; i++) {
+        worker = &ctx->workers[i];
+        if (worker->state == WORKER_FREE) {
+            worker->ctx = ctx;
+            worker->queue = q;
+            worker->state = WORKER_RUNNING;
+            ctx->num_threads++;
+            if (mg_start_thread_with_id(worker_thread, worker,
+                                        &worker->thread_id) != 0) {
+                worker->state = WORKER_FREE;
+                ctx->num_threads--;
+                mg_cry(fc(ctx), "Cannot start worker thread: %ld",
+                       (long) ERRNO);
+                return 0;
+            }
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/* Adds a worker thread when sockets wait in a queue and no thread is idle,
+   up to max_threads. The new thread serves the deepest queue, and steals
+   from the others like every worker. */
+static void grow_pool(struct mg_context *ctx)
+{
+    struct socket_queue *deepest = NULL;
+    unsigned long depth, max_depth = 0;
+    int i;
+
+    if (ctx->num_threads >= ctx->max_threads) {
+        return;
+    }
+    for (i = 0; i < ctx->num_queues; i++) {
+        if (mg_atomic_load(&ctx->queues[i].idle) > 0) {
+            return;
+        }
+        depth = mg_atomic_load(&ctx->queues[i].head) -
+                mg_atomic_load(&ctx->queues[i].tail);
+        if ((long) depth > (long) max_depth) {
+            max_depth = depth;
+            deepest = &ctx->queues[i];
+        }
+    }
+
+    if (deepest != NULL) {
+        (void) pthread_mutex_lock(&ctx->mutex);
+        if (ctx->num_threads < ctx->max_threads && ctx->stop_flag == 0) {
+            DEBUG_TRACE(("adding worker thread %d", ctx->num_threads + 1));
+            (void) start_worker(ctx, deepest);
+        }
+        (void) pthread_mutex_unlock(&ctx->mutex);
+    }
+}
+
+/* Acceptor threads add accepted socket to a queue */
+static void produce_socket(struct mg_context *ctx, struct socket_queue *q,
+                           const struct socket *sp)
+{
+    int queued;
+
+    /* Counted before a worker thread can close it */
+    mg_atomic_add(&ctx->open_connections, 1);
 
     /* If the queue is full, wait */
-    while (ctx->stop_flag == 0 &&
-           ctx->sq_head - ctx->sq_tail >= (int) ARRAY_SIZE(ctx->queue)) {
-        (void) pthread_cond_wait(&ctx->sq_empty, &ctx->mutex);
+    while (!(queued = sq_push(q, sp, NULL)) && ctx->stop_flag == 0) {
+        grow_pool(ctx);
+        (void) pthread_mutex_lock(&q->mutex);
+        mg_atomic_add(&q->blocked, 1);
+        if (!(queued = sq_push(q, sp, NULL)) && ctx->stop_flag == 0) {
+            (void) pthread_cond_wait(&q->sq_empty, &q->mutex);
+        }
+        mg_atomic_add(&q->blocked, -1);
+        (void) pthread_mutex_unlock(&q->mutex);
+        if (queued) {
+            break;
+        }
     }
 
-    if (ctx->sq_head - ctx->sq_tail < (int) ARRAY_SIZE(ctx->queue)) {
-        /* Copy socket to the queue and increment head */
-        ctx->queue[ctx->sq_head % ARRAY_SIZE(ctx->queue)] = *sp;
-        ctx->sq_head++;
+    if (queued) {
         DEBUG_TRACE(("queued socket %d", sp->sock));
+        wake_idle_worker(ctx, q);
+        grow_pool(ctx);
+    } else {
+        closesocket(sp->sock);
+        mg_atomic_add(&ctx->open_connections, -1);
     }
+}
 
-    (void) pthread_cond_signal(&ctx->sq_full);
-    (void) pthread_mutex_unlock(&ctx->mutex);
+/* Picks the shard of a connection from its client address and port, so
+   that clients are spread over the shards whichever acceptor took them */
+static struct socket_queue *shard_of(struct mg_context *ctx,
+                                     const struct socket *sp)
+{
+    uint32_t h, port;
+#if defined(USE_IPV6)
+    uint32_t word;
+    int i;
+
+    if (sp->rsa.sa.sa_family == AF_INET6) {
+        /* Folded, as clients of a network differ in the low words */
+        port = ntohs(sp->rsa.sin6.sin6_port);
+        for (h = 0, i = 0; i < 16; i += 4) {
+            memcpy(&word, sp->rsa.sin6.sin6_addr.s6_addr + i, sizeof(word));
+            h ^= ntohl(word);
+        }
+    } else
+#endif
+    {
+        port = ntohs(sp->rsa.sin.sin_port);
+        h = ntohl(sp->rsa.sin.sin_addr.s_addr);
+    }
+
+    /* Knuth's multiplicative hash, which only carries bits upward: host
+       byte order keeps what varies between clients in the low bits */
+    h = (h * 2654435761U ^ port) * 2654435761U;
+    return &ctx->queues[(h >> 16) % (uint32_t) ctx->num_queues];
 }
 
-static int set_sock_timeout(SOCKET sock, int milliseconds)
+/* Tells whether a listening socket is bound to all local addresses, so
+   that the address of its connections is only known from getsockname() */
+static int is_wildcard_address(const union usa *usa)
 {
-#ifdef _WIN32
-    DWORD t = milliseconds;
-#else
-    struct timeval t;
-    t.tv_sec = milliseconds / 1000;
-    t.tv_usec = (milliseconds * 1000) % 1000000;
+#if defined(USE_IPV6)
+    if (usa->sa.sa_family == AF_INET6) {
+        return IN6_IS_ADDR_UNSPECIFIED(&usa->sin6.sin6_addr);
+    }
 #endif
-    return setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (void *) &t, sizeof(t)) ||
-           setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (void *) &t, sizeof(t));
+    return usa->sin.sin_addr.s_addr == htonl(INADDR_ANY);
 }
 
-static void accept_new_connection(const struct socket *listener,
-                                  struct mg_context *ctx)
+/* Accepts a connection and queues it for the worker threads. Returns 0 when
+   the backlog of the listener is empty. */
+static int accept_new_connection(const struct socket *listener,
+                                 struct mg_context *ctx,
+                                 struct socket_queue *q)
 {
     struct socket so;
     char src_addr[IP_ADDR_STR_LEN];
     socklen_t len = sizeof(so.rsa);
+#if !defined(__linux__)
     int on = 1;
+#endif
 
-    if ((so.sock = accept(listener->sock, &so.rsa.sa, &len)) == INVALID_SOCKET) {
+#if defined(__linux__)
+    so.sock = accept4(listener->sock, &so.rsa.sa, &len, SOCK_CLOEXEC);
+#else
+    so.sock = accept(listener->sock, &so.rsa.sa, &len);
+#endif
+    if (so.sock == INVALID_SOCKET) {
+        return 0;
     } else if (!check_acl(ctx, ntohl(* (uint32_t *) &so.rsa.sin.sin_addr))) {
         sockaddr_to_string(src_addr, sizeof(src_addr), &so.rsa);
         mg_cry(fc(ctx), "%s: %s is not allowed to connect", __func__, src_addr);
@@ -6421,19 +9175,24 @@ static void accept_new_connection(const struct socket *listener,
     } else {
         /* Put so socket structure into the queue */
         DEBUG_TRACE(("Accepted socket %d", (int) so.sock));
-        set_close_on_exec(so.sock, fc(ctx));
         so.is_ssl = listener->is_ssl;
         so.ssl_redir = listener->ssl_redir;
-        if (getsockname(so.sock, &so.lsa.sa, &len) != 0) {
+        len = sizeof(so.lsa);
+        if (!is_wildcard_address(&listener->lsa)) {
+            so.lsa = listener->lsa;
+        } else if (getsockname(so.sock, &so.lsa.sa, &len) != 0) {
             mg_cry(fc(ctx), "%s: getsockname() failed: %s",
                    __func__, strerror(ERRNO));
         }
+#if !defined(__linux__)
+        set_close_on_exec(so.sock, fc(ctx));
         /* Set TCP keep-alive. This is needed because if HTTP-level keep-alive
            is enabled, and client resets the connection, server won't get
            TCP FIN or RST and will keep the connection open forever. With TCP
            keep-alive, next keep-alive handshake will figure out that the
            client is down and will close the server end.
-           Thanks to Igor Klopov who suggested the patch. */
+           Thanks to Igor Klopov who suggested the patch.
+           On Linux, the socket inherits it from the listener. */
         if (setsockopt(so.sock, SOL_SOCKET, SO_KEEPALIVE, (void *) &on,
                        sizeof(on)) != 0) {
             mg_cry(fc(ctx),
@@ -6441,17 +9200,114 @@ static void accept_new_connection(const struct socket *listener,
                    __func__, strerror(ERRNO));
         }
         set_sock_timeout(so.sock, atoi(ctx->config[REQUEST_TIMEOUT]));
-        produce_socket(ctx, &so);
+#endif
+        produce_socket(ctx, ctx->sharded ? shard_of(ctx, &so) : q, &so);
+    }
+    return 1;
+}
+
+/* Accepts connections on the listening sockets of an acceptor until the
+   server stops, or until it drains: then the connections waiting in the
+   backlog are accepted one last time, the listeners being closed next */
+static void accept_connections(struct mg_acceptor *acceptor)
+{
+    struct mg_context *ctx = acceptor->ctx;
+    struct pollfd *pfd;
+    int i, n;
+#if defined(__linux__)
+    int batch = 64;  /* Non-blocking listeners have their backlog drained */
+#else
+    int batch = 1;
+#endif
+
+    /* Allocate memory for the listening sockets, and start the server */
+    pfd = (struct pollfd *) mg_calloc(ctx->num_listening_sockets, sizeof(pfd[0]));
+    while (pfd != NULL && ctx->stop_flag == 0 && ctx->draining == 0) {
+        for (i = 0; i < ctx->num_listening_sockets; i++) {
+            pfd[i].fd = acceptor->listening_sockets[i].sock;
+            pfd[i].events = POLLIN;
+        }
+
+        if (ctx->retired && acceptor == &ctx->acceptors[0]) {
+            (void) pthread_mutex_lock(&ctx->mutex);
+            join_retired_workers(ctx);
+            (void) pthread_mutex_unlock(&ctx->mutex);
+        }
+
+        if (poll(pfd, ctx->num_listening_sockets, 200) > 0) {
+            for (i = 0; i < ctx->num_listening_sockets; i++) {
+                /* NOTE(lsm): on QNX, poll() returns POLLRDNORM after the
+                   successful poll, and POLLIN is defined as
+                   (POLLRDNORM | POLLRDBAND)
+                   Therefore, we're checking pfd[i].revents & POLLIN, not
+                   pfd[i].revents == POLLIN. */
+                if (ctx->stop_flag == 0 && (pfd[i].revents & POLLIN)) {
+                    for (n = 0; n < batch && ctx->stop_flag == 0; n++) {
+                        if (!accept_new_connection(
+                                &acceptor->listening_sockets[i], ctx,
+                                acceptor->queue)) {
+                            break;
+                        }
+                    }
+                }
+            }
+        }
     }
+
+    for (i = 0; pfd != NULL && ctx->draining && i < ctx->num_listening_sockets;
+         i++) {
+        pfd[0].fd = acceptor->listening_sockets[i].sock;
+        pfd[0].events = POLLIN;
+        while (ctx->stop_flag == 0 && poll(pfd, 1, 0) > 0 &&
+               (pfd[0].revents & POLLIN) &&
+               accept_new_connection(&acceptor->listening_sockets[i], ctx,
+                                     acceptor->queue)) {
+        }
+    }
+    mg_free(pfd);
+}
+
+static void acceptor_thread_run(void *thread_func_param)
+{
+    struct mg_acceptor *acceptor = (struct mg_acceptor *) thread_func_param;
+    struct mg_workerTLS tls;
+
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+    tls.pthread_cond_helper_mutex = CreateEvent(NULL, FALSE, FALSE, NULL);
+#endif
+    tls.is_master = 1;
+    pthread_setspecific(sTlsKey, &tls);
+
+    accept_connections(acceptor);
+
+    pthread_setspecific(sTlsKey, 0);
+#if defined(_WIN32) && !defined(__SYMBIAN32__)
+    CloseHandle(tls.pthread_cond_helper_mutex);
+#endif
+}
+
+#ifdef _WIN32
+static unsigned __stdcall acceptor_thread(void *thread_func_param)
+{
+    acceptor_thread_run(thread_func_param);
+    return 0;
+}
+#else
+static void *acceptor_thread(void *thread_func_param)
+{
+    acceptor_thread_run(thread_func_param);
+    return NULL;
 }
+#endif /* _WIN32 */
 
 static void master_thread_run(void *thread_func_param)
 {
     struct mg_context *ctx = (struct mg_context *) thread_func_param;
     struct mg_workerTLS tls;
-    struct pollfd *pfd;
+    struct mg_connection *conn;
+    struct socket_queue *q;
+    struct socket so;
     int i;
-    int workerthreadcount;
 
     /* Increase priority of the master thread */
 #if defined(_WIN32)
@@ -6479,35 +9335,32 @@ static void master_thread_run(void *thread_func_param)
     /* Server starts *now* */
     ctx->start_time = (unsigned long)time(NULL);
 
-    /* Allocate memory for the listening sockets, and start the server */
-    pfd = (struct pollfd *) mg_calloc(ctx->num_listening_sockets, sizeof(pfd[0]));
-    while (pfd != NULL && ctx->stop_flag == 0) {
-        for (i = 0; i < ctx->num_listening_sockets; i++) {
-            pfd[i].fd = ctx->listening_sockets[i].sock;
-            pfd[i].events = POLLIN;
-        }
+    accept_connections(&ctx->acceptors[0]);
 
-        if (poll(pfd, ctx->num_listening_sockets, 200) > 0) {
-            for (i = 0; i < ctx->num_listening_sockets; i++) {
-                /* NOTE(lsm): on QNX, poll() returns POLLRDNORM after the
-                   successful poll, and POLLIN is defined as
-                   (POLLRDNORM | POLLRDBAND)
-                   Therefore, we're checking pfd[i].revents & POLLIN, not
-                   pfd[i].revents == POLLIN. */
-                if (ctx->stop_flag == 0 && (pfd[i].revents & POLLIN)) {
-                    accept_new_connection(&ctx->listening_sockets[i], ctx);
-                }
-            }
+    for (i = 1; i < ctx->num_acceptors; i++) {
+        mg_join_thread(ctx->acceptors[i].thread_id);
+    }
+    close_all_listening_sockets(ctx);
+
+    /* When draining, let mg_stop_gracefully() know that no connection comes
+       in anymore, and serve the open ones until it calls mg_stop() */
+    if (ctx->draining) {
+        ctx->draining = 2;
+        while (ctx->stop_flag == 0) {
+            (void) mg_sleep(10);
         }
     }
-    mg_free(pfd);
     DEBUG_TRACE(("stopping workers"));
 
     /* Stop signal received: somebody called mg_stop. Quit. */
-    close_all_listening_sockets(ctx);
 
     /* Wakeup workers that are waiting for connections to handle. */
-    pthread_cond_broadcast(&ctx->sq_full);
+    for (i = 0; i < ctx->num_queues; i++) {
+        q = &ctx->queues[i];
+        (void) pthread_mutex_lock(&q->mutex);
+        (void) pthread_cond_broadcast(&q->sq_full);
+        (void) pthread_mutex_unlock(&q->mutex);
+    }
 
     /* Wait until all threads finish */
     (void) pthread_mutex_lock(&ctx->mutex);
@@ -6517,9 +9370,41 @@ static void master_thread_run(void *thread_func_param)
     (void) pthread_mutex_unlock(&ctx->mutex);
 
     /* Join all worker threads to avoid leaking threads. */
-    workerthreadcount = ctx->workerthreadcount;
-    for (i = 0; i < workerthreadcount; i++) {
-        mg_join_thread(ctx->workerthreadids[i]);
+    for (i = 0; i < ctx->max_threads; i++) {
+        if (ctx->workers[i].state != WORKER_FREE) {
+            mg_join_thread(ctx->workers[i].thread_id);
+        }
+    }
+
+#if defined(HAVE_INOTIFY)
+    if (ctx->stat_cache != NULL) {
+        mg_join_thread(ctx->stat_cache->thread_id);
+    }
+#endif
+
+#if defined(HAVE_EPOLL)
+    if (ctx->epoll_fd >= 0) {
+        mg_join_thread(ctx->reactorthreadid);
+        while ((conn = ctx->idle_head) != NULL) {
+            unlink_idle_connection(ctx, conn);
+            close_connection(conn);
+            free_connection(conn);
+        }
+    }
+#endif
+
+    /* Close connections resumed after the workers stopped taking them */
+    for (i = 0; i < ctx->num_queues; i++) {
+        q = &ctx->queues[i];
+        while (sq_pop(q, &so, &conn)) {
+            discard_queued(ctx, &so, conn);
+        }
+        while ((conn = q->resumed_head) != NULL) {
+            q->resumed_head = conn->next_resumed;
+            close_connection(conn);
+            free_connection(conn);
+        }
+        q->resumed_tail = NULL;
     }
 
 #if !defined(NO_SSL)
@@ -6558,15 +9443,26 @@ static void free_context(struct mg_context *ctx)
 {
     int i;
     struct mg_request_handler_info *tmp_rh;
+    struct mg_connection *conn;
 
     if (ctx == NULL)
         return;
 
+    while ((conn = ctx->spare_conns) != NULL) {
+        ctx->spare_conns = conn->next_resumed;
+        mg_free(conn);
+    }
+
     /* All threads exited, no sync is needed. Destroy mutex and condvars */
     (void) pthread_mutex_destroy(&ctx->mutex);
     (void) pthread_cond_destroy(&ctx->cond);
-    (void) pthread_cond_destroy(&ctx->sq_empty);
-    (void) pthread_cond_destroy(&ctx->sq_full);
+    if (ctx->queues != NULL) {
+        for (i = 0; i < ctx->num_queues; i++) {
+            sq_destroy(&ctx->queues[i]);
+        }
+        mg_free(ctx->queues);
+    }
+    mg_free(ctx->acceptors);
 
     /* Deallocate config parameters */
     for (i = 0; i < NUM_OPTIONS; i++) {
@@ -6596,10 +9492,28 @@ static void free_context(struct mg_context *ctx)
     }
 #endif /* !NO_SSL */
 
-    /* Deallocate worker thread ID array */
-    if (ctx->workerthreadids != NULL) {
-        mg_free(ctx->workerthreadids);
+    /* Deallocate worker thread slots */
+    if (ctx->workers != NULL) {
+        mg_free(ctx->workers);
+    }
+
+    if (ctx->file_cache != NULL) {
+        file_cache_destroy(ctx->file_cache);
+    }
+    if (ctx->extra_mime_types != NULL) {
+        mg_free(ctx->extra_mime_types);
+    }
+#if defined(HAVE_INOTIFY)
+    if (ctx->stat_cache != NULL) {
+        stat_cache_destroy(ctx->stat_cache);
+    }
+#endif
+
+#if defined(HAVE_EPOLL)
+    if (ctx->epoll_fd >= 0) {
+        (void) close(ctx->epoll_fd);
     }
+#endif
 
     /* Deallocate the tls variable */
     sTlsInit--;
@@ -6614,6 +9528,20 @@ static void free_context(struct mg_context *ctx)
     mg_free(ctx);
 }
 
+void mg_stop_gracefully(struct mg_context *ctx, int timeout_ms)
+{
+    int waited = 0;
+
+    ctx->draining = 1;
+    while ((ctx->draining != 2 ||
+            mg_atomic_load(&ctx->open_connections) > 0) &&
+           waited < timeout_ms) {
+        (void) mg_sleep(10);
+        waited += 10;
+    }
+    mg_stop(ctx);
+}
+
 void mg_stop(struct mg_context *ctx)
 {
     ctx->stop_flag = 1;
@@ -6684,6 +9612,9 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
     if ((ctx = (struct mg_context *) mg_calloc(1, sizeof(*ctx))) == NULL) {
         return NULL;
     }
+#if defined(HAVE_EPOLL)
+    ctx->epoll_fd = -1;
+#endif
 
     if (sTlsInit==0) {
         if (0 != pthread_key_create(&sTlsKey, NULL)) {
@@ -6732,6 +9663,79 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
 
     get_system_name(&ctx->systemName);
 
+    /* The pool starts with num_threads, within min_threads and max_threads */
+    workerthreadcount = atoi(ctx->config[NUM_THREADS]);
+    value = ctx->config[MIN_THREADS];
+    ctx->min_threads = value != NULL ? atoi(value) : workerthreadcount;
+    value = ctx->config[MAX_THREADS];
+    ctx->max_threads = value != NULL ? atoi(value) : workerthreadcount;
+    ctx->thread_idle_timeout = atoi(ctx->config[THREAD_IDLE_TIMEOUT]);
+    if (ctx->min_threads < 0 || ctx->max_threads < ctx->min_threads ||
+        ctx->max_threads < 1 || ctx->thread_idle_timeout < 0) {
+        mg_cry(fc(ctx), "Invalid min_threads, max_threads or thread_idle_timeout_ms");
+        free_context(ctx);
+        return NULL;
+    }
+    if (workerthreadcount < ctx->min_threads) {
+        workerthreadcount = ctx->min_threads;
+    } else if (workerthreadcount > ctx->max_threads) {
+        workerthreadcount = ctx->max_threads;
+    }
+
+    /* Every acceptor feeds its own group of worker threads */
+    ctx->num_acceptors = atoi(ctx->config[NUM_ACCEPTORS]);
+#if !defined(SO_REUSEPORT)
+    if (ctx->num_acceptors > 1) {
+        mg_cry(fc(ctx), "num_acceptors: SO_REUSEPORT is not supported");
+        ctx->num_acceptors = 1;
+    }
+#endif
+    if (ctx->num_acceptors < 1 || ctx->num_acceptors > ctx->max_threads) {
+        mg_cry(fc(ctx), "num_acceptors must be between 1 and max_threads");
+        free_context(ctx);
+        return NULL;
+    }
+
+    /* Unless the worker threads are split in shards */
+    ctx->num_queues = atoi(ctx->config[NUM_SHARDS]);
+    if (ctx->num_queues < 0 || ctx->num_queues > ctx->max_threads) {
+        mg_cry(fc(ctx), "num_shards must be between 0 and max_threads");
+        free_context(ctx);
+        return NULL;
+    }
+    ctx->sharded = ctx->num_queues > 0;
+    if (!ctx->sharded) {
+        ctx->num_queues = ctx->num_acceptors;
+    }
+    if ((ctx->queues = (struct socket_queue *)
+         mg_calloc(ctx->num_queues, sizeof(ctx->queues[0]))) == NULL ||
+        (ctx->acceptors = (struct mg_acceptor *)
+         mg_calloc(ctx->num_acceptors, sizeof(ctx->acceptors[0]))) == NULL) {
+        mg_cry(fc(ctx), "Not enough memory for the socket queues");
+        free_context(ctx);
+        return NULL;
+    }
+    for (i = 0; i < ctx->num_queues; i++) {
+        sq_init(&ctx->queues[i]);
+    }
+    for (i = 0; i < ctx->num_acceptors; i++) {
+        ctx->acceptors[i].ctx = ctx;
+        ctx->acceptors[i].queue = &ctx->queues[i % ctx->num_queues];
+    }
+    if (strtoll(ctx->config[FILE_CACHE_SIZE], NULL, 10) > 0 &&
+        (ctx->file_cache = file_cache_create(ctx)) == NULL) {
+        mg_cry(fc(ctx), "Not enough memory for the file cache");
+        free_context(ctx);
+        return NULL;
+    }
+    if (ctx->config[EXTRA_MIME_TYPES] != NULL &&
+        (ctx->extra_mime_types =
+             extra_mime_types_create(ctx->config[EXTRA_MIME_TYPES])) == NULL) {
+        mg_cry(fc(ctx), "Not enough memory for the mime types");
+        free_context(ctx);
+        return NULL;
+    }
+
     /* NOTE(lsm): order is important here. SSL certificates must
        be initialized before listening ports. UID must be set last. */
     if (!set_gpass_option(ctx) ||
@@ -6755,43 +9759,69 @@ struct mg_context *mg_start(const struct mg_callbacks *callbacks,
 
     (void) pthread_mutex_init(&ctx->mutex, NULL);
     (void) pthread_cond_init(&ctx->cond, NULL);
-    (void) pthread_cond_init(&ctx->sq_empty, NULL);
-    (void) pthread_cond_init(&ctx->sq_full, NULL);
-
-    workerthreadcount = atoi(ctx->config[NUM_THREADS]);
 
-    if (workerthreadcount > MAX_WORKER_THREADS) {
+    if (ctx->max_threads > MAX_WORKER_THREADS) {
         mg_cry(fc(ctx), "Too many worker threads");
         free_context(ctx);
         return NULL;
     }
 
-    if (workerthreadcount > 0) {
-        ctx->workerthreadcount = workerthreadcount;
-        ctx->workerthreadids = mg_calloc(workerthreadcount, sizeof(pthread_t));
-        if (ctx->workerthreadids == NULL) {
-            mg_cry(fc(ctx), "Not enough memory for worker thread ID array");
-            free_context(ctx);
-            return NULL;
+    ctx->workers = (struct mg_worker *) mg_calloc(ctx->max_threads,
+                                                  sizeof(ctx->workers[0]));
+    if (ctx->workers == NULL) {
+        mg_cry(fc(ctx), "Not enough memory for worker thread slots");
+        free_context(ctx);
+        return NULL;
+    }
+
+#if defined(HAVE_EPOLL)
+    /* Start the thread watching idle keep-alive connections. Without it,
+       they wait for their next request in a worker thread. */
+    if ((ctx->epoll_fd = epoll_create1(EPOLL_CLOEXEC)) >= 0 &&
+        mg_start_thread_with_id(reactor_thread, ctx,
+                                &ctx->reactorthreadid) != 0) {
+        (void) close(ctx->epoll_fd);
+        ctx->epoll_fd = -1;
+    }
+#endif
+
+#if defined(HAVE_INOTIFY)
+    /* Start the thread keeping the stat cache coherent */
+    if (ctx->config[DOCUMENT_ROOT] != NULL &&
+        !mg_strcasecmp(ctx->config[ENABLE_STAT_CACHE], "yes")) {
+        if ((ctx->stat_cache = stat_cache_create(ctx)) == NULL) {
+            mg_cry(fc(ctx), "Cannot create the stat cache: %s",
+                   strerror(ERRNO));
+        } else if (mg_start_thread_with_id(stat_cache_thread, ctx,
+                                           &ctx->stat_cache->thread_id) != 0) {
+            stat_cache_destroy(ctx->stat_cache);
+            ctx->stat_cache = NULL;
         }
     }
+#endif
 
-    /* Start master (listening) thread */
-    mg_start_thread_with_id(master_thread, ctx, &ctx->masterthreadid);
+    /* Start the other acceptors. The master thread, acceptor 0, starts after
+       the workers. */
+    for (i = 1; i < ctx->num_acceptors; i++) {
+        if (mg_start_thread_with_id(acceptor_thread, &ctx->acceptors[i],
+                                    &ctx->acceptors[i].thread_id) != 0) {
+            /* The kernel must not route connections to their sockets */
+            mg_cry(fc(ctx), "Cannot start acceptor thread: %ld", (long) ERRNO);
+            while (ctx->num_acceptors > i) {
+                close_acceptor_sockets(ctx,
+                                       &ctx->acceptors[--ctx->num_acceptors]);
+            }
+        }
+    }
 
-    /* Start worker threads */
+    /* Start worker threads, spread evenly over the queues */
+    (void) pthread_mutex_lock(&ctx->mutex);
     for (i = 0; i < workerthreadcount; i++) {
-        (void) pthread_mutex_lock(&ctx->mutex);
-        ctx->num_threads++;
-        (void) pthread_mutex_unlock(&ctx->mutex);
-        if (mg_start_thread_with_id(worker_thread, ctx,
-                                    &ctx->workerthreadids[i]) != 0) {
-            (void) pthread_mutex_lock(&ctx->mutex);
-            ctx->num_threads--;
-            (void) pthread_mutex_unlock(&ctx->mutex);
-            mg_cry(fc(ctx), "Cannot start worker thread: %ld", (long) ERRNO);
-        }
+        (void) start_worker(ctx, &ctx->queues[i % ctx->num_queues]);
     }
+    (void) pthread_mutex_unlock(&ctx->mutex);
+
+    mg_start_thread_with_id(master_thread, ctx, &ctx->masterthreadid);
 
     return ctx;
 }
@@ -0,0 +1,371 @@
+/* Copyright (c) 2013-2014 the Civetta developers
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ */
+
+// Unit test for the Civetta classes, built with "make civetta_test".
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "civetta.h"
+
+using namespace Civetta;
+
+static int s_total_tests = 0;
+static int s_failed_tests = 0;
+
+#define FAIL(str, line)                             \
+  do {                                              \
+    printf("Fail on line %d: [%s]\n", line, str); \
+    s_failed_tests++;                               \
+  } while (0)
+
+#define ASSERT(expr)                 \
+  do {                               \
+    s_total_tests++;                 \
+    if (!(expr))                     \
+      FAIL(#expr, __LINE__);         \
+  } while (0)
+
+#define HTTP_PORT "8089"
+
+// Sends a raw request, half closing the socket once it is sent, and returns
+// the whole response
+static std::string fetch(const std::string &request) {
+  struct sockaddr_in sin;
+  memset(&sin, 0, sizeof(sin));
+  sin.sin_family = AF_INET;
+  sin.sin_port = htons(atoi(HTTP_PORT));
+  sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+  int fd = socket(AF_INET, SOCK_STREAM, 0);
+  std::string response;
+  if (connect(fd, (struct sockaddr *)&sin, sizeof(sin)) == 0) {
+    send(fd, request.data(), request.size(), MSG_NOSIGNAL);
+    shutdown(fd, SHUT_WR);
+    char buf[4096];
+    ssize_t n;
+    while ((n = recv(fd, buf, sizeof(buf), 0)) > 0)
+      response.append(buf, n);
+  }
+  close(fd);
+  return response;
+}
+
+static std::string body_of(const std::string &response) {
+  size_t end = response.find("\r\n\r\n");
+  return end == std::string::npos ? "" : response.substr(end + 4);
+}
+
+// Records the parts as "name|filename|content type|data" strings
+class PartLog : public MultipartParser::Handler {
+ public:
+  std::vector<std::string> parts;
+
+  void onPartBegin(const Part &part) {
+    parts.push_back(std::string(part.name.data, part.name.size) + "|" +
+                    std::string(part.filename.data, part.filename.size) + "|" +
+                    std::string(part.content_type.data, part.content_type.size) + "|");
+  }
+  void onPartData(const char *data, size_t len) { parts.back().append(data, len); }
+  void onPartEnd() { parts.back() += "$"; }
+};
+
+static void test_multipart_parser() {
+  const std::string body =
+      "preamble\r\n"
+      "--b0undary\r\n"
+      "Content-Disposition: form-data; name=\"field\"\r\n\r\n"
+      "value\r\n--b0und not a boundary\r\n"
+      "--b0undary\r\n"
+      "Content-Disposition: form-data; name=\"up;load\"; filename=\"a b;c.txt\"\r\n"
+      "Content-Type: text/plain\r\n\r\n"
+      "\r\r\n-\r\n--\r\n"
+      "--b0undary\r\n"
+      "Content-Disposition: form-data; filename=plain.txt; name=bare\r\n\r\n"
+      "\r\n"
+      "--b0undary--\r\nepilogue";
+  const char *expected[] = {
+      "field|||value\r\n--b0und not a boundary$",
+      "up;load|a b;c.txt|text/plain|\r\r\n-\r\n--$",
+      "bare|plain.txt||$",
+  };
+
+  // The same parts whichever way the body is cut, delimiters included
+  for (size_t chunk = 1; chunk <= body.size(); chunk++) {
+    PartLog log;
+    MultipartParser parser(MultipartParser::getBoundary("multipart/form-data; boundary=b0undary"), log);
+    bool ok = true;
+    for (size_t i = 0; i < body.size(); i += chunk)
+      ok = parser.feed(body.data() + i, std::min(chunk, body.size() - i)) && ok;
+    bool same = ok && parser.done() && log.parts.size() == 3;
+    for (size_t i = 0; same && i < 3; i++)
+      same = log.parts[i] == expected[i];
+    if (!same) {
+      FAIL("multipart body cut in chunks", __LINE__);
+      printf("  chunk size %d\n", (int)chunk);
+      break;
+    }
+  }
+  s_total_tests++;
+
+  // Quoted boundaries, which may hold characters ending an unquoted one
+  Slice boundary = MultipartParser::getBoundary("multipart/form-data; boundary=\"a b;c\"; charset=utf-8");
+  ASSERT(boundary == "a b;c");
+  ASSERT(MultipartParser::getBoundary("multipart/form-data; boundary=abc; charset=utf-8") == "abc");
+  ASSERT(MultipartParser::getBoundary("multipart/form-data; boundary=\"abc").empty());
+  ASSERT(MultipartParser::getBoundary("multipart/form-data").empty());
+
+  PartLog log;
+  MultipartParser parser(boundary, log);
+  const std::string quoted = "--a b;c\r\nContent-Disposition: form-data; name=\"x\"\r\n\r\n1\r\n--a b;c--";
+  ASSERT(parser.feed(quoted.data(), quoted.size()) && parser.done());
+  ASSERT(log.parts.size() == 1 && log.parts[0] == "x|||1$");
+
+  // Malformed bodies
+  PartLog bad_log;
+  MultipartParser bad(Slice("abc", 3), bad_log);
+  ASSERT(!bad.feed("--abcXY", 7));
+  std::string long_boundary(71, 'x');
+  MultipartParser too_long(Slice(long_boundary.data(), long_boundary.size()), bad_log);
+  ASSERT(!too_long.feed("--", 2));
+}
+
+static void test_arena_allocations() {
+  const char *options[] = {"listening_ports", HTTP_PORT, "num_threads", "1", NULL};
+  Server server(options);
+  ASSERT(server.getContext() != NULL);
+  server.route("GET", "/hello/:name", [](Request &request, Response &response) {
+    response.setHeader("Content-Type", "text/plain");
+    response << "hello " << request.getCapture("name") << " " << request.getQueryParamView("n");
+  });
+  server.route("POST", "/echo", [](Request &request, Response &response) {
+    response << request.getParamView("a") << request.getParamView("b");
+  });
+
+  const std::string get = "GET /hello/civetta?n=42 HTTP/1.0\r\n\r\n";
+  const std::string post =
+      "POST /echo HTTP/1.0\r\nContent-Type: application/x-www-form-urlencoded\r\n"
+      "Content-Length: 11\r\n\r\na=x%20y&b=z";
+  for (int i = 0; i < 20; i++) {
+    fetch(get);
+    fetch(post);
+  }
+
+  // A warmed up worker reuses the blocks of its arena
+  unsigned long allocations = Arena::allocations();
+  int ok = 0;
+  for (int i = 0; i < 200; i++) {
+    ok += body_of(fetch(get)) == "hello civetta 42";
+    ok += body_of(fetch(post)) == "x yz";
+  }
+  ASSERT(ok == 400);
+  ASSERT(Arena::allocations() == allocations);
+}
+
+static void test_arena() {
+  Arena arena(1024);
+  unsigned long allocations = Arena::allocations();
+  char *a = (char *)arena.allocate(100);
+  char *b = (char *)arena.allocate(100);
+  ASSERT(a != NULL && b >= a + 100);
+  ASSERT(((size_t)a & 15) == 0 && ((size_t)b & 15) == 0);
+  ASSERT(arena.allocate(1000) != NULL);  // oversized, freed on reset
+  ASSERT(Arena::allocations() == allocations + 2);
+  arena.reset();
+  ASSERT(arena.allocate(100) == a);
+  ASSERT(Arena::allocations() == allocations + 2);
+
+  // Sizes that would wrap around once rounded up
+  ASSERT(arena.tryAllocate(~(size_t)0) == NULL);
+  ASSERT(arena.tryAllocate(~(size_t)0 - 8) == NULL);
+  bool thrown = false;
+  try {
+    arena.allocate(~(size_t)0);
+  } catch (const std::bad_alloc &) {
+    thrown = true;
+  }
+  ASSERT(thrown);
+  ASSERT(arena.tryAllocate(16) != NULL);
+}
+
+static void test_body_length() {
+  const char *options[] = {"listening_ports", HTTP_PORT, "num_threads", "1", NULL};
+  Server server(options);
+  server.route("POST", "/body", [](Request &request, Response &response) {
+    const char *data = request.getPostData();
+    response << (data == NULL ? "null" : data);
+  });
+
+  ASSERT(body_of(fetch("POST /body HTTP/1.0\r\nContent-Length: 5\r\n\r\nhello")) == "hello");
+  // Bodies that cannot be allocated, or that wrap around size_t
+  ASSERT(body_of(fetch("POST /body HTTP/1.0\r\nContent-Length: 1000000000000000\r\n\r\nhello")) == "null");
+  ASSERT(body_of(fetch("POST /body HTTP/1.0\r\nContent-Length: 18446744073709551615\r\n\r\nhello")) == "null");
+  ASSERT(body_of(fetch("POST /body HTTP/1.0\r\nContent-Length: 18446744073709551616\r\n\r\nhello")) == "null");
+  ASSERT(body_of(fetch("POST /body HTTP/1.0\r\nContent-Length: 5x\r\n\r\nhello")) == "null");
+  ASSERT(body_of(fetch("POST /body HTTP/1.0\r\nContent-Length: -1\r\n\r\nhello")) == "null");
+  // The server is still up
+  ASSERT(body_of(fetch("POST /body HTTP/1.0\r\nContent-Length: 2\r\n\r\nok")) == "ok");
+}
+
+static void test_routes() {
+  ASSERT(Router::accepts("/users/:id<int>/*rest"));
+  ASSERT(!Router::accepts("/index.html"));
+  ASSERT(!Router::accepts("/a*/b"));
+
+  const char *options[] = {"listening_ports", HTTP_PORT, "num_threads", "1", NULL};
+  Server server(options);
+  auto matches = [](Request &request, Response &response) {
+    std::smatch m = request.getMatches();
+    for (size_t i = 0; i < m.size(); i++)
+      response << (i > 0 ? "," : "") << m[i].str();
+  };
+  server.route("GET", "/users/:id", matches);
+  server.route("GET", "/items/([0-9]+)", matches);
+  server.route("GET", "/file.txt", matches);
+
+  // Router routes match the whole key, regular expressions fill groups
+  ASSERT(body_of(fetch("GET /users/7 HTTP/1.0\r\n\r\n")) == "GET:/users/7");
+  ASSERT(body_of(fetch("GET /items/42/ HTTP/1.0\r\n\r\n")) == "GET:/items/42/,42");
+  // '.' keeps its regular expression meaning
+  ASSERT(body_of(fetch("GET /file.txt HTTP/1.0\r\n\r\n")) == "GET:/file.txt");
+  ASSERT(body_of(fetch("GET /file-txt HTTP/1.0\r\n\r\n")) == "GET:/file-txt");
+
+  // '*' and ':' are route syntax now, where they used to be regular expression
+  // syntax and literal text
+  server.route("GET", "/static/*", matches);
+  server.route("GET", "/old/:id", matches);
+  server.route("GET", "/slashes/{0,}", matches);
+  ASSERT(body_of(fetch("GET /static/css/site.css HTTP/1.0\r\n\r\n")) == "GET:/static/css/site.css");
+  ASSERT(body_of(fetch("GET /old/7 HTTP/1.0\r\n\r\n")) == "GET:/old/7");
+  ASSERT(body_of(fetch("GET /old/:id HTTP/1.0\r\n\r\n")) == "GET:/old/:id");
+  // The former meaning of "/static/*", written as a regular expression
+  ASSERT(body_of(fetch("GET /slashes HTTP/1.0\r\n\r\n")) == "GET:/slashes");
+  ASSERT(fetch("GET /slashes/x HTTP/1.0\r\n\r\n").find(" 404 ") != std::string::npos);
+}
+
+static void test_multipart_limit() {
+  const char *options[] = {"listening_ports", HTTP_PORT, "num_threads", "1", NULL};
+  Server server(options);
+  server.route("POST", "/upload", [](Request &request, Response &response) {
+    response << request.getParamView("file").size << " " << request.getParamView("after");
+  });
+
+  // A file kept in memory is truncated, the parts after it are still read
+  std::string file(Request::max_field_size + 1000, 'f');
+  std::string body = "--xyz\r\nContent-Disposition: form-data; name=\"file\"; filename=\"big.bin\"\r\n\r\n" + file +
+                     "\r\n--xyz\r\nContent-Disposition: form-data; name=\"after\"\r\n\r\nok\r\n--xyz--\r\n";
+  std::string response = fetch("POST /upload HTTP/1.0\r\nContent-Type: multipart/form-data; boundary=xyz\r\n"
+                               "Content-Length: " + std::to_string(body.size()) + "\r\n\r\n" + body);
+  ASSERT(body_of(response) == std::to_string(Request::max_field_size) + " ok");
+}
+
+static void test_keep_alive() {
+  const char *options[] = {"listening_ports", HTTP_PORT, "num_threads", "1", "enable_keep_alive", "yes", NULL};
+  Server server(options);
+  server.route("GET", "/hello/:name", [](Request &request, Response &response) {
+    response << "hello " << request.getCapture("name");
+  });
+
+  // Two requests on one connection, the second one closing it
+  std::string response = fetch(
+      "GET /hello/a HTTP/1.1\r\n\r\n"
+      "GET /hello/b HTTP/1.1\r\nConnection: close\r\n\r\n");
+  size_t second = response.find("HTTP/1.1 200", 1);
+  ASSERT(second != std::string::npos);
+  ASSERT(response.substr(0, second).find("Connection: keep-alive\r\n") != std::string::npos);
+  ASSERT(response.find("Connection: close\r\n", second) != std::string::npos);
+  ASSERT(response.find("hello b") != std::string::npos);
+
+  // HTTP/1.0 closes unless asked otherwise
+  response = fetch("GET /hello/c HTTP/1.0\r\n\r\n");
+  ASSERT(response.find("Connection: close\r\n") != std::string::npos);
+}
+
+static void test_timing() {
+  const char *options[] = {"listening_ports", HTTP_PORT, "num_threads", "1", NULL};
+  Server server(options);
+  Histogram histogram;
+  server.route("GET", "/slow", makeChain(Timing(histogram)), [](Request &, Response &response) {
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    response << "done";
+  });
+
+  ASSERT(body_of(fetch("GET /slow HTTP/1.0\r\n\r\n")) == "done");
+  ASSERT(histogram.total() == 1);
+  ASSERT(histogram.percentile(100) >= 16384 && histogram.percentile(100) <= 1 << 20);
+}
+
+#if defined(__cpp_impl_coroutine)
+static std::thread::id worker_id;
+
+static Task sleepy(Request &, Response &response) {
+  co_await Sleep(std::chrono::milliseconds(20));
+  bool on_worker = std::this_thread::get_id() == worker_id;
+  co_await Sleep(std::chrono::milliseconds(20));
+  on_worker = on_worker && std::this_thread::get_id() == worker_id;
+  response << (on_worker ? "worker" : "elsewhere");
+}
+
+static void test_coroutines() {
+  // Frames freed on another thread go back to the pool they came from
+  void *frame = FramePool::allocate(100);
+  std::thread([frame] { FramePool::release(frame, 100); }).join();
+  ASSERT(FramePool::allocate(100) == frame);
+  FramePool::release(frame, 100);
+
+  const char *options[] = {"listening_ports", HTTP_PORT, "num_threads", "1", NULL};
+  Server server(options);
+  server.route("GET", "/id", [](Request &, Response &) { worker_id = std::this_thread::get_id(); });
+  routeTask(server, "GET", "/sleepy", sleepy);
+  fetch("GET /id HTTP/1.0\r\n\r\n");
+  // Handlers resume on the worker thread, not on the timer thread
+  for (int i = 0; i < 3; i++)
+    ASSERT(body_of(fetch("GET /sleepy HTTP/1.0\r\n\r\n")) == "worker");
+}
+#endif
+
+int main() {
+  test_arena();
+  test_multipart_parser();
+  test_arena_allocations();
+  test_body_length();
+  test_routes();
+  test_multipart_limit();
+  test_keep_alive();
+  test_timing();
+#if defined(__cpp_impl_coroutine)
+  test_coroutines();
+#else
+  FAIL("coroutines not compiled in, build with -std=c++20", __LINE__);
+#endif
+
+  printf("TOTAL TESTS: %d, FAILED: %d\n", s_total_tests, s_failed_tests);
+  return s_failed_tests == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,117 @@
+/* Microbenchmark of parsing the request headers and looking them up.
+ *
+ * Compares, per request, the former path with the new one. The former path
+ * ran get_request_len() in read_request() then again in parse_http_message(),
+ * tokenized with skip_quoted() and searched linearly per lookup. The new one
+ * scans once, then runs tokenize_http_message(), index_headers() and
+ * mg_get_header(). The lookups are the ones made for a static file.
+ *
+ * Build, like unit_test.c, from this directory:
+ *   cc -O2 -DNO_SSL -I../include -I../src header_bench.c -lpthread -ldl
+ */
+
+#include "civetweb.c"
+
+static const char *lookups[] = {
+    "Content-Length", "Connection", "Upgrade", "Authorization", "Origin",
+    "If-Modified-Since", "If-None-Match", "Range", "Accept-Encoding",
+    "Connection"
+};
+
+static int make_request(char *buf, int size, int cookies)
+{
+    int i, len = snprintf(buf, size,
+                          "GET /static/js/app.min.js?v=1.6.3 HTTP/1.1\r\n"
+                          "Host: www.example.com\r\n"
+                          "User-Agent: Mozilla/5.0 (X11; Linux x86_64; "
+                          "rv:38.0) Gecko/20100101 Firefox/38.0\r\n"
+                          "Accept: */*\r\n"
+                          "Accept-Language: en-US,en;q=0.5\r\n"
+                          "Accept-Encoding: gzip, deflate\r\n"
+                          "Referer: http://www.example.com/index.html\r\n"
+                          "Connection: keep-alive\r\n"
+                          "Cache-Control: max-age=0\r\n");
+
+    for (i = 0; i < cookies; i++) {
+        len += snprintf(buf + len, size - len,
+                        "Cookie: session%d=%016x%016x; theme=dark\r\n",
+                        i, i * 2654435761U, ~i * 40503U);
+    }
+    return len + snprintf(buf + len, size - len, "\r\n");
+}
+
+static int former_parse(char *buf, int len, struct mg_request_info *ri)
+{
+    int i, request_length = get_request_len(buf, len);
+
+    buf[request_length - 1] = '\0';
+    ri->request_method = skip(&buf, " ");
+    ri->uri = skip(&buf, " ");
+    ri->http_version = skip(&buf, "\r\n");
+    ri->num_headers = 0;
+    for (i = 0; i < (int) ARRAY_SIZE(ri->http_headers); i++) {
+        ri->http_headers[i].name = skip_quoted(&buf, ":", " ", 0);
+        ri->http_headers[i].value = skip(&buf, "\r\n");
+        if (ri->http_headers[i].name[0] == '\0')
+            break;
+        ri->num_headers = i + 1;
+    }
+    return request_length;
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the nanoseconds per request, copying the request included */
+static double bench(const char *request, int len, int indexed,
+                    int iterations)
+{
+    static struct mg_connection conn;
+    char buf[8192];
+    double start = now();
+    int i, j, found = 0;
+
+    for (i = 0; i < iterations; i++) {
+        memcpy(buf, request, len);
+        if (indexed) {
+            tokenize_http_message(buf, get_request_len(request, len),
+                                  &conn.request_info);
+            index_headers(&conn);
+            for (j = 0; j < (int) ARRAY_SIZE(lookups); j++) {
+                found += mg_get_header(&conn, lookups[j]) != NULL;
+            }
+        } else {
+            (void) get_request_len(buf, len);
+            former_parse(buf, len, &conn.request_info);
+            for (j = 0; j < (int) ARRAY_SIZE(lookups); j++) {
+                found += get_header(&conn.request_info, lookups[j]) != NULL;
+            }
+        }
+    }
+    if (found != 3 * iterations) {
+        printf("found %d headers instead of %d\n", found, 3 * iterations);
+        exit(EXIT_FAILURE);
+    }
+    return (now() - start) * 1e9 / iterations;
+}
+
+int main(void)
+{
+    static const int cookies[] = {0, 4, 40};
+    char request[8192];
+    int i, len, iterations;
+
+    printf("%-20s %10s %10s\n", "request", "former", "indexed");
+    for (i = 0; i < (int) ARRAY_SIZE(cookies); i++) {
+        len = make_request(request, sizeof(request), cookies[i]);
+        iterations = 20000000 / len;
+        printf("%4d B, %2d cookies  %7.0f ns %7.0f ns\n", len, cookies[i],
+               bench(request, len, 0, iterations),
+               bench(request, len, 1, iterations));
+    }
+    return 0;
+}
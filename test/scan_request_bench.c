@@ -0,0 +1,114 @@
+/* Microbenchmark of the scan for the end of the request headers.
+ *
+ * Compares the former byte at a time scan, restarted from the beginning of
+ * the buffer after every recv(), with scan_request(), for header blocks of
+ * 500 bytes to 8 KB received whole and in segments of 1448 bytes, the TCP
+ * payload of a 1500 bytes MTU.
+ *
+ * Build, like unit_test.c, from this directory:
+ *   cc -O2 -DNO_SSL -I../include -I../src scan_request_bench.c -lpthread -ldl
+ * and add -mavx2 for the 32 bytes kernel.
+ */
+
+#include "civetweb.c"
+
+#define SEGMENT 1448
+
+static int byte_request_len(const char *buf, int buflen)
+{
+    const char *s, *e;
+    int len = 0;
+
+    for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
+        if (!isprint(* (const unsigned char *) s) && *s != '\r' &&
+            *s != '\n' && * (const unsigned char *) s < 128) {
+            len = -1;
+            break;
+        } else if (s[0] == '\n' && s[1] == '\n') {
+            len = (int) (s - buf) + 2;
+        } else if (s[0] == '\n' && &s[1] < e &&
+                   s[1] == '\r' && s[2] == '\n') {
+            len = (int) (s - buf) + 3;
+        }
+
+    return len;
+}
+
+/* A browser-like request padded with cookies up to about size bytes */
+static int make_request(char *buf, int size)
+{
+    int len = snprintf(buf, size,
+                       "GET /static/js/app.min.js?v=1.6.3 HTTP/1.1\r\n"
+                       "Host: www.example.com\r\n"
+                       "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:38.0) "
+                       "Gecko/20100101 Firefox/38.0\r\n"
+                       "Accept: text/html,application/xhtml+xml,"
+                       "application/xml;q=0.9,*/*;q=0.8\r\n"
+                       "Accept-Language: en-US,en;q=0.5\r\n"
+                       "Accept-Encoding: gzip, deflate\r\n"
+                       "Referer: http://www.example.com/index.html\r\n"
+                       "Connection: keep-alive\r\n");
+    int i = 0;
+
+    while (len + 80 < size) {
+        len += snprintf(buf + len, size - len,
+                        "Cookie: session%d=%016x%016x; theme=dark\r\n",
+                        i, i * 2654435761U, ~i * 40503U);
+        i++;
+    }
+    return len + snprintf(buf + len, size - len, "\r\n");
+}
+
+static double now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Returns the nanoseconds per request, the headers arriving segment bytes
+   at a time */
+static double bench(const char *buf, int len, int segment, int resume,
+                    int iterations)
+{
+    double start = now();
+    int i, n, scanned, result = 0;
+
+    for (i = 0; i < iterations; i++) {
+        scanned = 0;
+        for (n = segment < len ? segment : len;; n += segment) {
+            n = n < len ? n : len;
+            result = resume ? scan_request(buf, n, &scanned) :
+                     byte_request_len(buf, n);
+            if (result != 0 || n == len) {
+                break;
+            }
+        }
+        if (result != len) {
+            printf("wrong request length %d instead of %d\n", result, len);
+            exit(EXIT_FAILURE);
+        }
+    }
+    return (now() - start) * 1e9 / iterations;
+}
+
+int main(void)
+{
+    static const int sizes[] = {500, 2000, 8000};
+    char buf[8192];
+    int i, len, iterations;
+
+    printf("%-8s %-10s %12s %12s\n", "headers", "received", "byte scan",
+           "scan_request");
+    for (i = 0; i < (int) ARRAY_SIZE(sizes); i++) {
+        len = make_request(buf, sizes[i]);
+        iterations = 20000000 / len;
+        printf("%5d B  %-10s %9.0f ns %9.0f ns\n", len, "whole",
+               bench(buf, len, len, 0, iterations),
+               bench(buf, len, len, 1, iterations));
+        printf("%5d B  %-10s %9.0f ns %9.0f ns\n", len, "segments",
+               bench(buf, len, SEGMENT, 0, iterations),
+               bench(buf, len, SEGMENT, 1, iterations));
+    }
+    return 0;
+}
@@ -67,6 +67,146 @@ static int s_failed_tests = 0;
 #define LISTENING_ADDR "127.0.0.1:" HTTP_PORT ",127.0.0.1:" HTTPS_PORT "s"
 #endif
 
+/* Byte at a time scan that scan_request() must agree with */
+static int reference_request_len(const char *buf, int buflen) {
+    const char *s, *e;
+    int len = 0;
+
+    for (s = buf, e = s + buflen - 1; len <= 0 && s < e; s++)
+        if (!isprint(* (const unsigned char *) s) && *s != '\r' &&
+            *s != '\n' && * (const unsigned char *) s < 128) {
+            len = -1;
+            break;
+        } else if (s[0] == '\n' && s[1] == '\n') {
+            len = (int) (s - buf) + 2;
+        } else if (s[0] == '\n' && &s[1] < e &&
+                   s[1] == '\r' && s[2] == '\n') {
+            len = (int) (s - buf) + 3;
+        }
+
+    return len;
+}
+
+static void test_scan_request(void) {
+    static const char ends[] = "\r\n: ", odd[] = "\t\x7f\x80\xff\x01";
+    char buf[300];
+    int i, j, len, n, scanned, fails = 0;
+
+    srand(1);
+    for (i = 0; i < 2000; i++) {
+        /* Mostly printable, with line ends, and rarely an odd byte */
+        len = 1 + rand() % (int) sizeof(buf);
+        for (j = 0; j < len; j++) {
+            n = rand() % 256;
+            buf[j] = n < 200 ? 'a' + n % 26 : n < 255 ? ends[n % 4] :
+                     odd[rand() % 5];
+        }
+        fails += get_request_len(buf, len) != reference_request_len(buf, len);
+
+        /* Resuming the scan as the request arrives changes nothing */
+        scanned = 0;
+        for (j = 1, n = 0; j < len && n == 0; j += 1 + rand() % 40) {
+            n = scan_request(buf, j, &scanned);
+            fails += n != reference_request_len(buf, j);
+        }
+        if (n == 0) {
+            fails += scan_request(buf, len, &scanned) !=
+                     reference_request_len(buf, len);
+        }
+    }
+    ASSERT(fails == 0);
+
+    ASSERT(get_request_len("GET / HTTP/1.0\r\n\r\nbody", 22) == 18);
+    ASSERT(get_request_len("GET / HTTP/1.0\n\nbody", 20) == 16);
+    ASSERT(get_request_len("GET / HTTP/1.0\r\nA: b\x01\r\n\r\n", 25) == -1);
+}
+
+/* Scans then tokenizes a request, as getreq() does */
+static int parse_request(char *buf, int len, struct mg_request_info *ri) {
+    return tokenize_http_message(buf, get_request_len(buf, len), ri);
+}
+
+static void test_parse_http_headers(void) {
+    static const char pieces[][40] = {
+        "Host", ": ", ":", "  ", "\r\n", "\n", "\t", "x",
+        "Content-Length", "0123456789abcdefghijklmnopqrstuv"
+    };
+    struct mg_request_info ri, expected;
+    char buf[400], copy[400], *p, *q;
+    int i, j, len, fails = 0;
+
+    srand(2);
+    for (i = 0; i < 2000; i++) {
+        for (len = 0; len < 300;) {
+            len += sprintf(buf + len, "%s",
+                           pieces[rand() % (int) ARRAY_SIZE(pieces)]);
+        }
+        memcpy(copy, buf, len + 1);
+
+        /* As the former tokenizer does */
+        q = copy;
+        expected.num_headers = 0;
+        for (j = 0; j < (int) ARRAY_SIZE(expected.http_headers); j++) {
+            expected.http_headers[j].name = skip_quoted(&q, ":", " ", 0);
+            expected.http_headers[j].value = skip(&q, "\r\n");
+            if (expected.http_headers[j].name[0] == '\0')
+                break;
+            expected.num_headers = j + 1;
+        }
+
+        p = buf;
+        ri.num_headers = 0;
+        parse_http_headers(&p, buf + len, &ri);
+        fails += ri.num_headers != expected.num_headers || p - buf != q - copy;
+        for (j = 0; j < ri.num_headers && j < expected.num_headers; j++) {
+            fails += ri.http_headers[j].name - buf !=
+                     expected.http_headers[j].name - copy ||
+                     ri.http_headers[j].value - buf !=
+                     expected.http_headers[j].value - copy;
+        }
+        fails += memcmp(buf, copy, len) != 0;
+    }
+    ASSERT(fails == 0);
+}
+
+static void test_header_index(void) {
+    static const char *common[] = {
+        "Accept", "Accept-Encoding", "Accept-Language", "Authorization",
+        "Cache-Control", "Connection", "Content-Encoding", "Content-Length",
+        "Content-Range", "Content-Type", "Cookie", "Depth", "Expect", "Host",
+        "If-Modified-Since", "If-None-Match", "Keep-Alive", "Location",
+        "Origin", "Pragma", "Range", "Referer", "Sec-WebSocket-Key",
+        "Sec-WebSocket-Protocol", "Sec-WebSocket-Version", "Status",
+        "Transfer-Encoding", "Upgrade", "User-Agent", "X-Forwarded-For"
+    };
+    /* X-q takes the slot of Host */
+    char req[] = "GET / HTTP/1.1\r\nX-q: 1\r\nHost: a\r\nX-Custom: b\r\n"
+                 "content-length: 1\r\nContent-Length: 2\r\n\r\n";
+    struct mg_connection conn;
+    int i, j, collisions = 0;
+
+    for (i = 0; i < (int) ARRAY_SIZE(common); i++) {
+        for (j = 0; j < i; j++) {
+            collisions += header_slot(common[i], strlen(common[i])) ==
+                          header_slot(common[j], strlen(common[j]));
+        }
+    }
+    ASSERT(collisions == 0);
+
+    memset(&conn, 0, sizeof(conn));
+    ASSERT(parse_request(req, sizeof(req), &conn.request_info) > 0);
+    index_headers(&conn);
+    ASSERT(header_slot("X-q", 3) == header_slot("Host", 4));
+    ASSERT(strcmp(mg_get_header(&conn, "HOST"), "a") == 0);
+    ASSERT(strcmp(mg_get_header(&conn, "x-Q"), "1") == 0);
+    ASSERT(mg_get_header(&conn, "H-a") == NULL);
+    ASSERT(strcmp(mg_get_header(&conn, "Content-Length"), "1") == 0);
+    ASSERT(strcmp(mg_get_header(&conn, "x-custom"), "b") == 0);
+    ASSERT(mg_get_header(&conn, "Range") == NULL);
+    ASSERT(mg_get_header(&conn, "X-Other") == NULL);
+    ASSERT(mg_get_header(&conn, "") == NULL);
+}
+
 static void test_parse_http_message() {
     struct mg_request_info ri;
     char req1[] = "GET / HTTP/1.1\r\n\r\n";
@@ -79,22 +219,22 @@ static void test_parse_http_message() {
     char req8[] = " HTTP/1.1 200 OK \n\n";
     char req9[] = "HTTP/1.1 200 OK\r\nConnection: close\r\n\r\n";
 
-    ASSERT(parse_http_message(req9, sizeof(req9), &ri) == sizeof(req9) - 1);
+    ASSERT(parse_request(req9, sizeof(req9), &ri) == sizeof(req9) - 1);
     ASSERT(ri.num_headers == 1);
 
-    ASSERT(parse_http_message(req1, sizeof(req1), &ri) == sizeof(req1) - 1);
+    ASSERT(parse_request(req1, sizeof(req1), &ri) == sizeof(req1) - 1);
     ASSERT(strcmp(ri.http_version, "1.1") == 0);
     ASSERT(ri.num_headers == 0);
 
-    ASSERT(parse_http_message(req2, sizeof(req2), &ri) == -1);
-    ASSERT(parse_http_message(req3, sizeof(req3), &ri) == 0);
-    ASSERT(parse_http_message(req6, sizeof(req6), &ri) == 0);
-    ASSERT(parse_http_message(req7, sizeof(req7), &ri) == 0);
-    ASSERT(parse_http_message("", 0, &ri) == 0);
-    ASSERT(parse_http_message(req8, sizeof(req8), &ri) == sizeof(req8) - 1);
+    ASSERT(parse_request(req2, sizeof(req2), &ri) == -1);
+    ASSERT(parse_request(req3, sizeof(req3), &ri) == 0);
+    ASSERT(parse_request(req6, sizeof(req6), &ri) == 0);
+    ASSERT(parse_request(req7, sizeof(req7), &ri) == 0);
+    ASSERT(parse_request("", 0, &ri) == 0);
+    ASSERT(parse_request(req8, sizeof(req8), &ri) == sizeof(req8) - 1);
 
     /* TODO(lsm): Fix this. Header value may span multiple lines. */
-    ASSERT(parse_http_message(req4, sizeof(req4), &ri) == sizeof(req4) - 1);
+    ASSERT(parse_request(req4, sizeof(req4), &ri) == sizeof(req4) - 1);
     ASSERT(strcmp(ri.http_version, "1.1") == 0);
     ASSERT(ri.num_headers == 3);
     ASSERT(strcmp(ri.http_headers[0].name, "A") == 0);
@@ -104,7 +244,7 @@ static void test_parse_http_message() {
     ASSERT(strcmp(ri.http_headers[2].name, "baz\r\n\r") == 0);
     ASSERT(strcmp(ri.http_headers[2].value, "") == 0);
 
-    ASSERT(parse_http_message(req5, sizeof(req5), &ri) == sizeof(req5) - 1);
+    ASSERT(parse_request(req5, sizeof(req5), &ri) == sizeof(req5) - 1);
     ASSERT(strcmp(ri.request_method, "GET") == 0);
     ASSERT(strcmp(ri.http_version, "1.1") == 0);
 }
@@ -118,8 +258,9 @@ static void test_should_keep_alive(void) {
     char req4[] = "GET / HTTP/1.1\r\nConnection: keep-alive\r\n\r\n";
 
     memset(&conn, 0, sizeof(conn));
+    memset(&ctx, 0, sizeof(ctx));
     conn.ctx = &ctx;
-    ASSERT(parse_http_message(req1, sizeof(req1), &conn.request_info) ==
+    ASSERT(parse_request(req1, sizeof(req1), &conn.request_info) ==
         sizeof(req1) - 1);
 
     ctx.config[ENABLE_KEEP_ALIVE] = "no";
@@ -132,13 +273,13 @@ static void test_should_keep_alive(void) {
     ASSERT(should_keep_alive(&conn) == 0);
 
     conn.must_close = 0;
-    parse_http_message(req2, sizeof(req2), &conn.request_info);
+    parse_request(req2, sizeof(req2), &conn.request_info);
     ASSERT(should_keep_alive(&conn) == 0);
 
-    parse_http_message(req3, sizeof(req3), &conn.request_info);
+    parse_request(req3, sizeof(req3), &conn.request_info);
     ASSERT(should_keep_alive(&conn) == 0);
 
-    parse_http_message(req4, sizeof(req4), &conn.request_info);
+    parse_request(req4, sizeof(req4), &conn.request_info);
     ASSERT(should_keep_alive(&conn) == 1);
 
     conn.status_code = 401;
@@ -147,6 +288,19 @@ static void test_should_keep_alive(void) {
     conn.status_code = 200;
     conn.must_close = 1;
     ASSERT(should_keep_alive(&conn) == 0);
+
+    /* Also needs a body of known length, and a server not stopping */
+    conn.must_close = 0;
+    conn.content_len = 0;
+    ASSERT(mg_should_keep_alive(&conn) == 1);
+    ctx.config[ENABLE_KEEP_ALIVE] = "YES";
+    ASSERT(mg_should_keep_alive(&conn) == 0);
+    ctx.config[ENABLE_KEEP_ALIVE] = "yes";
+    conn.content_len = -1;
+    ASSERT(mg_should_keep_alive(&conn) == 0);
+    conn.content_len = 0;
+    ctx.stop_flag = 1;
+    ASSERT(mg_should_keep_alive(&conn) == 0);
 }
 
 static void test_match_prefix(void) {
@@ -571,6 +725,92 @@ static void test_next_option(void) {
     }
 }
 
+/* The linear scans mg_get_builtin_mime_type() and get_mime_type() replace */
+static const char *scan_mime_types(const char *list, const char *path,
+                                   struct vec *vec) {
+    struct vec ext_vec, mime_vec;
+    size_t i, path_len = strlen(path);
+
+    while ((list = next_option(list, &ext_vec, &mime_vec)) != NULL) {
+        if (ext_vec.len <= path_len &&
+            mg_strncasecmp(path + path_len - ext_vec.len, ext_vec.ptr,
+                           ext_vec.len) == 0) {
+            *vec = mime_vec;
+            return vec->ptr;
+        }
+    }
+    for (i = 0; builtin_mime_types[i].extension != NULL; i++) {
+        if (path_len > builtin_mime_types[i].ext_len &&
+            mg_strcasecmp(path + path_len - builtin_mime_types[i].ext_len,
+                          builtin_mime_types[i].extension) == 0) {
+            break;
+        }
+    }
+    vec->ptr = builtin_mime_types[i].extension != NULL ?
+               builtin_mime_types[i].mime_type : "text/plain";
+    vec->len = strlen(vec->ptr);
+    return vec->ptr;
+}
+
+static void test_mime_types(void) {
+    static const char *paths[] = {
+        "a.js", "A.JS", ".js", "js", "", "a.", ".", "a.tar.gz", "b.tgz",
+        "x.torrent", "x.TORRENT", "x.html", "x.htm", "x.shtml", "x.jpegx",
+        "dir.d/x", "dir.d/.css", "/x.css", "x.cpp", "X.CPP", "x.java",
+        "x.gz", "x.GZ", "x.css", "x.cs", "x.txt", "x.png.txt", "x.json"
+    };
+    static const char *lists[] = {
+        NULL, "", ".cpp=text/x-c,.java=text/x-java",
+        ".cpp=text/x-c,.CSS=text/x-css,gz=application/x-gz,"
+        ".tar.gz=application/x-tgz,.cpp=text/x-dup,.txt=text/x-txt",
+        ".tar.gz=application/x-tgz,.gz=application/x-gz2,=text/x-any"
+    };
+    struct mg_context ctx;
+    struct vec vec, expected;
+    char path[32];
+    size_t i, j, num_types, num_slots = 0;
+    unsigned slot;
+
+    /* Each builtin extension has its own slot */
+    for (num_types = 0; builtin_mime_types[num_types].extension != NULL;
+         num_types++) {
+        slot = hash_extension(builtin_mime_types[num_types].extension,
+                              builtin_mime_types[num_types].ext_len,
+                              MIME_HASH_SEED) >> 24;
+        ASSERT(builtin_mime_slots[slot & 255] == num_types + 1);
+    }
+    for (i = 0; i < ARRAY_SIZE(builtin_mime_slots); i++) {
+        num_slots += builtin_mime_slots[i] != 0;
+    }
+    ASSERT(num_slots == num_types);
+    for (i = 0; i < num_types; i++) {
+        snprintf(path, sizeof(path), "file%s", builtin_mime_types[i].extension);
+        ASSERT(mg_get_builtin_mime_type(path) ==
+               builtin_mime_types[i].mime_type);
+        for (j = 0; path[j] != '\0'; j++) {
+            path[j] = (char) toupper((unsigned char) path[j]);
+        }
+        ASSERT(mg_get_builtin_mime_type(path) ==
+               builtin_mime_types[i].mime_type);
+    }
+
+    memset(&ctx, 0, sizeof(ctx));
+    for (i = 0; i < ARRAY_SIZE(lists); i++) {
+        ctx.extra_mime_types =
+            lists[i] == NULL ? NULL : extra_mime_types_create(lists[i]);
+        ASSERT(lists[i] == NULL || ctx.extra_mime_types != NULL);
+        for (j = 0; j < ARRAY_SIZE(paths); j++) {
+            scan_mime_types(lists[i], paths[j], &expected);
+            get_mime_type(&ctx, paths[j], &vec);
+            ASSERT(vec.len == expected.len &&
+                   memcmp(vec.ptr, expected.ptr, vec.len) == 0);
+        }
+        mg_free(ctx.extra_mime_types);
+    }
+    ASSERT(!strcmp(mg_get_builtin_mime_type("x.TorRent"),
+                   "application/x-bittorrent"));
+}
+
 #if defined(USE_LUA)
 static void check_lua_expr(lua_State *L, const char *expr, const char *value) {
     const char *v, *var_name = "myVar";
@@ -595,7 +835,7 @@ static void test_lua(void) {
     conn.ctx = &ctx;
     conn.buf = http_request;
     conn.buf_size = conn.data_len = strlen(http_request);
-    conn.request_len = parse_http_message(conn.buf, conn.data_len, &conn.request_info);
+    conn.request_len = parse_request(conn.buf, conn.data_len, &conn.request_info);
     conn.content_len = conn.data_len - conn.request_len;
 
     prepare_lua_environment(&conn, L, "unit_test", LUA_ENV_TYPE_PLAIN_LUA_PAGE);
@@ -722,6 +962,1218 @@ static void test_api_calls(void) {
     mg_stop(ctx);
 }
 
+static int writev_callback(struct mg_connection *conn) {
+    static char body[100000];
+    struct mg_iovec iov[3];
+    char head[64];
+
+    memset(body, 'x', sizeof(body));
+    iov[0].buf = head;
+    iov[0].len = sprintf(head, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n",
+        (int) sizeof(body) + 3);
+    iov[1].buf = body;
+    iov[1].len = sizeof(body);
+    iov[2].buf = "end";
+    iov[2].len = 3;
+    ASSERT(mg_writev(conn, iov, 3) == (int) (iov[0].len + sizeof(body) + 3));
+    return 1;
+}
+
+static void test_mg_writev(void) {
+    char ebuf[100], *p;
+    int len;
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = writev_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, OPTIONS)) != NULL);
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+    ASSERT((p = read_conn(conn, &len)) != NULL);
+    ASSERT(len == 100003);
+    ASSERT(p[0] == 'x' && p[99999] == 'x' && memcmp(p + 100000, "end", 3) == 0);
+    mg_free(p);
+    mg_close_connection(conn);
+    mg_stop(ctx);
+}
+
+static struct mg_connection *volatile deferred_conn;
+static volatile int deferred_done;
+
+static int defer_callback(struct mg_connection *conn) {
+    if (!strcmp(mg_get_request_info(conn)->uri, "/deferred")) {
+        mg_defer_request(conn);
+        deferred_conn = conn;
+    } else {
+        mg_printf(conn, "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    }
+    return 1;
+}
+
+static void *fetch_deferred(void *arg) {
+    char ebuf[100], *p;
+    int len;
+    struct mg_connection *conn;
+
+    (void) arg;
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET /deferred HTTP/1.0\r\n\r\n")) != NULL);
+    ASSERT((p = read_conn(conn, &len)) != NULL);
+    ASSERT(len == 4 && memcmp(p, "late", 4) == 0);
+    mg_free(p);
+    mg_close_connection(conn);
+    deferred_done = 1;
+    return NULL;
+}
+
+static void test_mg_defer_request(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1", NULL
+    };
+    char ebuf[100];
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = defer_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    ASSERT(mg_start_thread(fetch_deferred, NULL) == 0);
+    while (deferred_conn == NULL) {
+        mg_sleep(10);
+    }
+
+    /* The only worker thread serves other requests meanwhile */
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET /other HTTP/1.0\r\n\r\n")) != NULL);
+    ASSERT(strcmp(conn->request_info.uri, "200") == 0);
+    mg_close_connection(conn);
+    ASSERT(!deferred_done);
+
+    mg_printf(deferred_conn, "HTTP/1.0 200 OK\r\nContent-Length: 4\r\n\r\nlate");
+    mg_complete_request(deferred_conn);
+    while (!deferred_done) {
+        mg_sleep(10);
+    }
+    mg_stop(ctx);
+}
+
+static pthread_t resume_caller;
+static volatile int resumed_elsewhere;
+
+static void resume_reply(struct mg_connection *conn, void *arg) {
+    resumed_elsewhere = !pthread_equal(pthread_self(), resume_caller);
+    mg_printf(conn, "HTTP/1.0 200 OK\r\nContent-Length: %d\r\n\r\n%s",
+              (int) strlen((const char *) arg), (const char *) arg);
+    mg_complete_request(conn);
+}
+
+static int resume_callback(struct mg_connection *conn) {
+    mg_defer_request(conn);
+    if (!strcmp(mg_get_request_info(conn)->uri, "/deferred")) {
+        deferred_conn = conn;
+    } else {
+        /* Called once the handler returns */
+        mg_resume_request(conn, resume_reply, (void *) "now");
+    }
+    return 1;
+}
+
+static void test_mg_resume_request(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1", NULL
+    };
+    char ebuf[100], *p;
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+    int len;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = resume_callback;
+    deferred_conn = NULL;
+    deferred_done = 0;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET /now HTTP/1.0\r\n\r\n")) != NULL);
+    ASSERT((p = read_conn(conn, &len)) != NULL);
+    ASSERT(len == 3 && memcmp(p, "now", 3) == 0);
+    mg_free(p);
+    mg_close_connection(conn);
+
+    /* The reply is written by the worker thread, not by this one */
+    ASSERT(mg_start_thread(fetch_deferred, NULL) == 0);
+    while (deferred_conn == NULL) {
+        mg_sleep(10);
+    }
+    resume_caller = pthread_self();
+    resumed_elsewhere = 0;
+    mg_resume_request(deferred_conn, resume_reply, (void *) "late");
+    while (!deferred_done) {
+        mg_sleep(10);
+    }
+    ASSERT(resumed_elsewhere);
+    mg_stop(ctx);
+}
+
+static int keep_alive_callback(struct mg_connection *conn) {
+    mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    return 1;
+}
+
+/* Sends another request over a keep-alive connection, then waits until it
+   has been served */
+static int fetch_idle(struct mg_connection *conn, const char *headers) {
+    char buf[100];
+    int n, len;
+
+    mg_printf(conn, "GET / HTTP/1.1\r\n%s\r\n", headers);
+    for (len = 0; len < (int) sizeof(buf) - 1 &&
+         (n = recv(conn->client.sock, buf + len, sizeof(buf) - 1 - len, 0)) > 0;
+         len += n) {
+        buf[len + n] = '\0';
+        if (strstr(buf, "\r\n\r\nok") != NULL) {
+            /* Let the worker thread park or close it */
+            mg_sleep(100);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void test_idle_keep_alive(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1",
+        "enable_keep_alive", "yes", "request_timeout_ms", "5000", NULL
+    };
+    char ebuf[100];
+    struct mg_callbacks callbacks;
+    struct mg_connection *idle[3], *conn;
+    struct mg_context *ctx;
+    time_t start;
+    int i;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = keep_alive_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+
+    /* Idle keep-alive connections do not hold the only worker thread */
+    start = time(NULL);
+    for (i = 0; i < 3; i++) {
+        ASSERT((idle[i] = mg_download("localhost", atoi(HTTP_PORT), 0,
+            ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.1\r\n\r\n")) != NULL);
+    }
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+    ASSERT(time(NULL) - start < 3);
+    mg_close_connection(conn);
+
+    /* A worker taking a parked connection back frees its own connection
+       struct, up to max_threads of which are kept, and reuses one when it
+       parks a connection again */
+    ASSERT(ctx->num_spare_conns == 0);
+    ASSERT(fetch_idle(idle[0], "Connection: close\r\n"));
+    ASSERT(ctx->num_spare_conns == 1);
+    ASSERT(fetch_idle(idle[1], ""));
+    ASSERT(ctx->num_spare_conns == 0);
+
+    for (i = 0; i < 3; i++) {
+        mg_close_connection(idle[i]);
+    }
+    mg_stop(ctx);
+}
+
+static void test_idle_timeout(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1",
+        "enable_keep_alive", "yes", "request_timeout_ms", "300", NULL
+    };
+    char ebuf[100], c;
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+    struct pollfd pfd;
+    double start, idle;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = keep_alive_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+
+    /* Idle connections are closed after request_timeout_ms, not after
+       whole seconds */
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.1\r\n\r\n")) != NULL);
+    start = monotonic_seconds();
+    pfd.fd = conn->client.sock;
+    pfd.events = POLLIN;
+    ASSERT(poll(&pfd, 1, 2000) == 1);
+    idle = monotonic_seconds() - start;
+    ASSERT(recv(conn->client.sock, &c, 1, 0) == 0);
+    ASSERT(idle > 0.25 && idle < 0.7);
+
+    mg_close_connection(conn);
+    mg_stop(ctx);
+}
+
+static volatile unsigned long queue_sum, queue_done;
+
+static void *fill_queue(void *arg) {
+    struct socket_queue *q = (struct socket_queue *) arg;
+    struct socket so;
+    int i;
+
+    memset(&so, 0, sizeof(so));
+    for (i = 0; i < 1000; i++) {
+        so.sock = i;
+        while (!sq_push(q, &so, NULL)) {
+            mg_sleep(0);
+        }
+    }
+    return NULL;
+}
+
+static void *drain_queue(void *arg) {
+    struct socket_queue *q = (struct socket_queue *) arg;
+    struct mg_connection *conn;
+    struct socket so;
+    int taken = 0;
+
+    while (taken < 1000) {
+        if (sq_pop(q, &so, &conn)) {
+            mg_atomic_add(&queue_sum, (long) so.sock);
+            taken++;
+        } else {
+            mg_sleep(0);
+        }
+    }
+    mg_atomic_add(&queue_done, 1);
+    return NULL;
+}
+
+static void test_socket_queue(void) {
+    struct socket_queue *q;
+    struct mg_connection *conn, dummy;
+    struct socket so;
+    int i;
+
+    ASSERT((q = (struct socket_queue *) mg_calloc(1, sizeof(*q))) != NULL);
+    sq_init(q);
+
+    /* First in, first out, and bounded */
+    ASSERT(sq_pop(q, &so, &conn) == 0);
+    memset(&so, 0, sizeof(so));
+    for (i = 0; i < MGSQLEN; i++) {
+        so.sock = i;
+        ASSERT(sq_push(q, &so, i == 1 ? &dummy : NULL) == 1);
+    }
+    ASSERT(sq_push(q, &so, NULL) == 0);
+    for (i = 0; i < MGSQLEN; i++) {
+        ASSERT(sq_pop(q, &so, &conn) == 1);
+        ASSERT(i == 1 ? conn == &dummy : (conn == NULL && so.sock == i));
+    }
+    ASSERT(sq_pop(q, &so, &conn) == 0);
+
+    /* Four consumers take what four producers push, across many rounds */
+    for (i = 0; i < 4; i++) {
+        ASSERT(mg_start_thread(drain_queue, q) == 0);
+        ASSERT(mg_start_thread(fill_queue, q) == 0);
+    }
+    while (mg_atomic_load(&queue_done) < 4) {
+        mg_sleep(1);
+    }
+    ASSERT(queue_sum == 4 * 999 * 1000 / 2);
+    ASSERT(sq_pop(q, &so, &conn) == 0);
+    sq_destroy(q);
+    mg_free(q);
+}
+
+static int acceptor_callback(struct mg_connection *conn) {
+    mg_printf(conn, "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    return 1;
+}
+
+static void test_acceptors(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "4",
+        "num_acceptors", "2", NULL
+    };
+    static const char *bad_options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1",
+        "num_acceptors", "2", NULL
+    };
+    char ebuf[100];
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+    int i, ports[4], ssl[4];
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = acceptor_callback;
+    ASSERT(mg_start(&callbacks, NULL, bad_options) == NULL);
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    ASSERT(ctx->acceptors[1].listening_sockets != NULL);
+    ASSERT(mg_get_ports(ctx, 4, ports, ssl) == 1);
+
+    for (i = 0; i < 20; i++) {
+        ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+            ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+        ASSERT(strcmp(conn->request_info.uri, "200") == 0);
+        mg_close_connection(conn);
+    }
+    mg_stop(ctx);
+}
+
+static volatile int shard_blocked, shard_release;
+
+static int shard_callback(struct mg_connection *conn) {
+    if (strcmp(conn->request_info.uri, "/block") == 0) {
+        shard_blocked = 1;
+        while (!shard_release) {
+            mg_sleep(10);
+        }
+    }
+    mg_printf(conn, "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    return 1;
+}
+
+static void *fetch_blocking(void *arg) {
+    char ebuf[100];
+    struct mg_connection *conn;
+
+    (void) arg;
+    conn = mg_download("localhost", atoi(HTTP_PORT), 0, ebuf, sizeof(ebuf),
+                       "%s", "GET /block HTTP/1.0\r\n\r\n");
+    if (conn != NULL) {
+        mg_close_connection(conn);
+    }
+    return NULL;
+}
+
+static void test_shards(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "2",
+        "num_shards", "2", NULL
+    };
+    char ebuf[100];
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+    int i, depths[4];
+    time_t start;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = shard_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    ASSERT(mg_get_queue_depths(ctx, 4, depths) == 2);
+    ASSERT(depths[0] == 0 && depths[1] == 0);
+
+    /* One shard has its only worker busy: the other one steals its work */
+    ASSERT(mg_start_thread(fetch_blocking, NULL) == 0);
+    while (!shard_blocked) {
+        mg_sleep(10);
+    }
+    start = time(NULL);
+    for (i = 0; i < 20; i++) {
+        ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+            ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+        ASSERT(strcmp(conn->request_info.uri, "200") == 0);
+        mg_close_connection(conn);
+    }
+    ASSERT(time(NULL) - start < 3);
+    shard_release = 1;
+    mg_stop(ctx);
+}
+
+#if defined(USE_IPV6)
+static void test_shard_of(void) {
+    static struct socket_queue queues[4];
+    struct mg_context ctx;
+    struct socket so;
+    int i, used[4] = {0, 0, 0, 0};
+
+    memset(&ctx, 0, sizeof(ctx));
+    ctx.queues = queues;
+    ctx.num_queues = 4;
+
+    /* IPv4 clients of one network on the same port, then ports of one */
+    memset(&so, 0, sizeof(so));
+    so.rsa.sin.sin_family = AF_INET;
+    so.rsa.sin.sin_port = htons(40000);
+    for (i = 0; i < 64; i++) {
+        so.rsa.sin.sin_addr.s_addr = htonl(0xc0a80100 + i);
+        used[shard_of(&ctx, &so) - queues] = 1;
+    }
+    ASSERT(used[0] + used[1] + used[2] + used[3] == 4);
+    memset(used, 0, sizeof(used));
+    for (i = 0; i < 64; i++) {
+        so.rsa.sin.sin_port = htons(40000 + i);
+        used[shard_of(&ctx, &so) - queues] = 1;
+    }
+    ASSERT(used[0] + used[1] + used[2] + used[3] == 4);
+    memset(used, 0, sizeof(used));
+
+    /* IPv6 clients of one network, all on the same port */
+    memset(&so, 0, sizeof(so));
+    so.rsa.sin6.sin6_family = AF_INET6;
+    so.rsa.sin6.sin6_port = htons(40000);
+    so.rsa.sin6.sin6_addr.s6_addr[0] = 0x20;
+    so.rsa.sin6.sin6_addr.s6_addr[1] = 0x01;
+    for (i = 0; i < 64; i++) {
+        so.rsa.sin6.sin6_addr.s6_addr[15] = (unsigned char) i;
+        used[shard_of(&ctx, &so) - queues] = 1;
+    }
+    ASSERT(used[0] + used[1] + used[2] + used[3] == 4);
+}
+#endif
+
+static volatile unsigned long pool_blocked;
+static volatile int pool_release;
+
+static int pool_callback(struct mg_connection *conn) {
+    if (strcmp(conn->request_info.uri, "/block") == 0) {
+        mg_atomic_add(&pool_blocked, 1);
+        while (!pool_release) {
+            mg_sleep(10);
+        }
+    }
+    mg_printf(conn, "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    return 1;
+}
+
+static void *exit_at_once(void *arg) {
+    return arg;
+}
+
+static void test_elastic_pool(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1",
+        "max_threads", "4", "thread_idle_timeout_ms", "200", NULL
+    };
+    char ebuf[100];
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+    int i;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = pool_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    ASSERT(mg_get_thread_count(ctx) == 1);
+
+    /* Busy threads make the pool grow, up to max_threads */
+    for (i = 0; i < 3; i++) {
+        ASSERT(mg_start_thread(fetch_blocking, NULL) == 0);
+    }
+    for (i = 0; i < 300 && pool_blocked < 3; i++) {
+        mg_sleep(10);
+    }
+    ASSERT(pool_blocked == 3);
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+    mg_close_connection(conn);
+    ASSERT(mg_get_thread_count(ctx) == 4);
+
+    /* Idle threads retire down to min_threads, num_threads here */
+    pool_release = 1;
+    for (i = 0; i < 300 && mg_get_thread_count(ctx) > 1; i++) {
+        mg_sleep(10);
+    }
+    ASSERT(mg_get_thread_count(ctx) == 1);
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+    mg_close_connection(conn);
+
+    /* Then grows again */
+    pool_release = 0;
+    pool_blocked = 0;
+    for (i = 0; i < 3; i++) {
+        ASSERT(mg_start_thread(fetch_blocking, NULL) == 0);
+    }
+    for (i = 0; i < 300 && pool_blocked < 3; i++) {
+        mg_sleep(10);
+    }
+    ASSERT(pool_blocked == 3);
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+    mg_close_connection(conn);
+    ASSERT(mg_get_thread_count(ctx) == 4);
+    pool_release = 1;
+    for (i = 0; i < 300 && mg_get_thread_count(ctx) > 1; i++) {
+        mg_sleep(10);
+    }
+    ASSERT(mg_get_thread_count(ctx) == 1);
+
+    /* Slots of retired threads the master thread has not joined yet are
+       reused */
+    (void) pthread_mutex_lock(&ctx->mutex);
+    for (i = 0; i < ctx->max_threads; i++) {
+        if (ctx->workers[i].state == WORKER_FREE) {
+            ASSERT(mg_start_thread_with_id(exit_at_once, NULL,
+                                           &ctx->workers[i].thread_id) == 0);
+            ctx->workers[i].state = WORKER_RETIRED;
+        }
+    }
+    ctx->retired = 1;
+    ASSERT(start_worker(ctx, &ctx->queues[0]) == 1);
+    ASSERT(ctx->num_threads == 2);
+    (void) pthread_mutex_unlock(&ctx->mutex);
+    mg_stop(ctx);
+}
+
+#if defined(__linux__)
+static int accepted_flags, accepted_fd_flags, accepted_keep_alive;
+static struct timeval accepted_timeout;
+static in_port_t accepted_port;
+
+static int inspect_callback(struct mg_connection *conn) {
+    socklen_t len = sizeof(accepted_keep_alive);
+
+    accepted_flags = fcntl(conn->client.sock, F_GETFL);
+    accepted_fd_flags = fcntl(conn->client.sock, F_GETFD);
+    getsockopt(conn->client.sock, SOL_SOCKET, SO_KEEPALIVE,
+               &accepted_keep_alive, &len);
+    len = sizeof(accepted_timeout);
+    getsockopt(conn->client.sock, SOL_SOCKET, SO_RCVTIMEO,
+               &accepted_timeout, &len);
+    accepted_port = ntohs(conn->client.lsa.sin.sin_port);
+    mg_printf(conn, "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    return 1;
+}
+
+static void test_fast_accept(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1",
+        "request_timeout_ms", "7000", "tcp_defer_accept", "1", NULL
+    };
+    char ebuf[100];
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+    int i;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = inspect_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    for (i = 0; i < 3; i++) {
+        ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+            ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+        ASSERT(strcmp(conn->request_info.uri, "200") == 0);
+        mg_close_connection(conn);
+    }
+
+    /* Accepted sockets block, and got their options from the listener */
+    ASSERT((accepted_flags & O_NONBLOCK) == 0);
+    ASSERT((accepted_fd_flags & FD_CLOEXEC) != 0);
+    ASSERT(accepted_keep_alive != 0);
+    ASSERT(accepted_timeout.tv_sec == 7);
+    ASSERT(accepted_port == atoi(HTTP_PORT));
+    mg_stop(ctx);
+}
+
+static int accepted_no_delay, accepted_sndbuf, accepted_rcvbuf;
+
+static int tuning_callback(struct mg_connection *conn) {
+    socklen_t len = sizeof(int);
+
+    getsockopt(conn->client.sock, IPPROTO_TCP, TCP_NODELAY,
+               &accepted_no_delay, &len);
+    getsockopt(conn->client.sock, SOL_SOCKET, SO_SNDBUF, &accepted_sndbuf,
+               &len);
+    getsockopt(conn->client.sock, SOL_SOCKET, SO_RCVBUF, &accepted_rcvbuf,
+               &len);
+    mg_printf(conn, "HTTP/1.0 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    return 1;
+}
+
+static void test_socket_tuning(void) {
+    static const char *options[] = {
+        "listening_ports", "127.0.0.1:" HTTP_PORT, "num_threads", "1",
+        "tcp_nodelay", "yes", "tcp_quickack", "yes", "tcp_fastopen", "16",
+        "socket_send_buffer", "65536", "socket_receive_buffer", "32768",
+        "listen_backlog", "16", NULL
+    };
+    char ebuf[100];
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = tuning_callback;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+    ASSERT(strcmp(conn->request_info.uri, "200") == 0);
+    mg_close_connection(conn);
+
+    /* Inherited from the listener; Linux doubles the buffer sizes */
+    ASSERT(accepted_no_delay != 0);
+    ASSERT(accepted_sndbuf >= 65536);
+    ASSERT(accepted_rcvbuf >= 32768 && accepted_rcvbuf < 65536 * 2);
+    mg_stop(ctx);
+}
+#endif
+
+#if !defined(_WIN32)
+static volatile int slow_entered, slow_closed;
+
+static int slow_callback(struct mg_connection *conn) {
+    if (strcmp(conn->request_info.uri, "/slow") == 0) {
+        slow_entered = 1;
+        mg_sleep(300);
+    }
+    mg_printf(conn, "HTTP/1.1 200 OK\r\nContent-Length: 2\r\n\r\nok");
+    return 1;
+}
+
+static void *fetch_slow(void *arg) {
+    char ebuf[100], buf[10];
+    struct mg_connection *conn;
+
+    (void) arg;
+    conn = mg_download("localhost", atoi(HTTP_PORT), 0, ebuf, sizeof(ebuf),
+                       "%s", "GET /slow HTTP/1.1\r\nHost: localhost\r\n\r\n");
+    if (conn != NULL) {
+        /* Complete, then closed instead of kept alive */
+        set_sock_timeout(conn->client.sock, 3000);
+        slow_closed = mg_read(conn, buf, sizeof(buf)) == 2 &&
+                      recv(conn->client.sock, buf, sizeof(buf), 0) == 0;
+        mg_close_connection(conn);
+    }
+    slow_entered = 2;
+    return NULL;
+}
+
+static void test_graceful_restart(void) {
+    static const char *options[] = {
+        "listening_ports", HTTP_PORT, "enable_keep_alive", "yes",
+        "num_threads", "2", NULL, NULL, NULL
+    };
+    char ebuf[100], fds[32];
+    struct mg_callbacks callbacks;
+    struct mg_connection *conn;
+    struct mg_context *old_ctx, *ctx;
+    struct sockaddr_in sin;
+    int i, udp;
+
+    memset(&callbacks, 0, sizeof(callbacks));
+    callbacks.begin_request = slow_callback;
+    ASSERT((old_ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    ASSERT(mg_export_listening_sockets(old_ctx, fds, 1) == -1);
+    ASSERT(mg_export_listening_sockets(old_ctx, fds, sizeof(fds)) == 1);
+
+    slow_entered = slow_closed = 0;
+    ASSERT(mg_start_thread(fetch_slow, NULL) == 0);
+    for (i = 0; i < 300 && slow_entered == 0; i++) {
+        mg_sleep(10);
+    }
+    ASSERT(slow_entered == 1);
+
+    /* A bound socket that is no listening socket is not closed */
+    memset(&sin, 0, sizeof(sin));
+    sin.sin_family = AF_INET;
+    sin.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    ASSERT((udp = socket(AF_INET, SOCK_DGRAM, 0)) >= 0);
+    ASSERT(bind(udp, (struct sockaddr *) &sin, sizeof(sin)) == 0);
+    snprintf(fds + strlen(fds), sizeof(fds) - strlen(fds), ",%d", udp);
+
+    /* The port is taken, so the new server only starts with the socket */
+    options[6] = "listening_sockets";
+    options[7] = fds;
+    ASSERT((ctx = mg_start(&callbacks, NULL, options)) != NULL);
+    ASSERT(fcntl(udp, F_GETFD) != -1);
+    closesocket(udp);
+    mg_stop_gracefully(old_ctx, 5000);
+    for (i = 0; i < 300 && slow_entered != 2; i++) {
+        mg_sleep(10);
+    }
+    ASSERT(slow_closed);
+
+    ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+        ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+    ASSERT(strcmp(conn->request_info.uri, "200") == 0);
+    mg_close_connection(conn);
+    mg_stop(ctx);
+}
+
+#if defined(SO_REUSEPORT)
+/* Tells whether a descriptor of a comma-separated list is sock */
+static int fd_listed(const char *fds, SOCKET sock) {
+    for (; fds != NULL; fds = strchr(fds, ',')) {
+        fds += *fds == ',';
+        if (atoi(fds) == (int) sock) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void test_restart_acceptors(void) {
+    static const char *options[] = {
+        "listening_ports", HTTP_PORT, "num_threads", "2",
+        "num_acceptors", NULL, NULL, NULL, NULL
+    };
+    char ebuf[100], fds[32];
+    struct mg_context *old_ctx, *ctx;
+    struct mg_connection *conn;
+    int i;
+
+    /* A socket of a server with one acceptor is shared with the new
+       acceptor sockets of the next one */
+    options[5] = "1";
+    ASSERT((old_ctx = mg_start(NULL, NULL, options)) != NULL);
+    ASSERT(mg_export_listening_sockets(old_ctx, fds, sizeof(fds)) == 1);
+    options[5] = "2";
+    options[6] = "listening_sockets";
+    options[7] = fds;
+    ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+    ASSERT(fd_listed(fds, ctx->acceptors[0].listening_sockets[0].sock));
+    mg_stop_gracefully(old_ctx, 5000);
+
+    /* Every acceptor hands its sockets over, and takes one over */
+    old_ctx = ctx;
+    ASSERT(mg_export_listening_sockets(old_ctx, fds, sizeof(fds)) == 2);
+    ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+    ASSERT(fd_listed(fds, ctx->acceptors[0].listening_sockets[0].sock));
+    ASSERT(fd_listed(fds, ctx->acceptors[1].listening_sockets[0].sock));
+    ASSERT(ctx->acceptors[0].listening_sockets[0].sock !=
+           ctx->acceptors[1].listening_sockets[0].sock);
+    mg_stop_gracefully(old_ctx, 5000);
+
+    for (i = 0; i < 20; i++) {
+        ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0,
+            ebuf, sizeof(ebuf), "%s", "GET / HTTP/1.0\r\n\r\n")) != NULL);
+        mg_close_connection(conn);
+    }
+    mg_stop(ctx);
+}
+#endif
+
+#if !defined(_WIN32)
+/* Downloads uri and compares the body with expected_len bytes of the test
+   pattern from offset on */
+static int check_download(const char *uri, const char *range, int offset,
+                          int expected_len) {
+    char ebuf[100], buf[8192];
+    struct mg_connection *conn;
+    int i, n, total = 0, ok = 1;
+
+    conn = mg_download("localhost", atoi(HTTP_PORT), 0, ebuf, sizeof(ebuf),
+                       "GET %s HTTP/1.0\r\n%s\r\n", uri, range);
+    if (conn == NULL) {
+        return 0;
+    }
+    while ((n = mg_read(conn, buf, sizeof(buf))) > 0) {
+        for (i = 0; i < n; i++) {
+            ok &= (unsigned char) buf[i] ==
+                  (unsigned char) ((offset + total + i) * 7 % 251);
+        }
+        total += n;
+    }
+    mg_close_connection(conn);
+    return ok && total == expected_len;
+}
+
+static void test_send_file(void) {
+    static const char *options[] = {
+        "listening_ports", HTTP_PORT, "document_root", ".",
+        "enable_sendfile", "yes", "enable_keep_alive", "yes", NULL
+    };
+    static const char *cgi =
+        "#!/bin/sh\n"
+        "printf 'Content-Type: application/octet-stream\\r\\n\\r\\n'\n"
+        "head -c 100000 sendfile.bin\n";
+    /* The body comes after the headers were read */
+    static const char *keep_alive_cgi =
+        "#!/bin/sh\n"
+        "printf 'Connection: keep-alive\\r\\nContent-Length: 2\\r\\n\\r\\n'\n"
+        "sleep 0.1\n"
+        "printf ok\n";
+    char ebuf[100], buf[10];
+    struct mg_connection *conn;
+    struct mg_context *ctx;
+    double start;
+    FILE *fp;
+    int i;
+
+    ASSERT((fp = fopen("sendfile.bin", "wb")) != NULL);
+    for (i = 0; i < 300000; i++) {
+        fputc(i * 7 % 251, fp);
+    }
+    fclose(fp);
+    ASSERT((fp = fopen("sendfile.cgi", "w")) != NULL);
+    fputs(cgi, fp);
+    fclose(fp);
+    chmod("sendfile.cgi", 0755);
+    ASSERT((fp = fopen("keepalive.cgi", "w")) != NULL);
+    fputs(keep_alive_cgi, fp);
+    fclose(fp);
+    chmod("keepalive.cgi", 0755);
+
+    /* The copying path first, then the zero-copy one */
+    for (i = 0; i < 2; i++) {
+        options[5] = i == 0 ? "no" : "yes";
+        ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+        ASSERT(check_download("/sendfile.bin", "", 0, 300000));
+        ASSERT(check_download("/sendfile.bin",
+                              "Range: bytes=100001-200000\r\n", 100001,
+                              100000));
+        ASSERT(check_download("/sendfile.bin", "Range: bytes=299990-\r\n",
+                              299990, 10));
+        ASSERT(check_download("/sendfile.cgi", "", 0, 100000));
+
+        /* The last bytes of a CGI kept alive are not held back */
+        start = monotonic_seconds();
+        ASSERT((conn = mg_download("localhost", atoi(HTTP_PORT), 0, ebuf,
+            sizeof(ebuf), "%s", "GET /keepalive.cgi HTTP/1.1\r\n\r\n")) !=
+            NULL);
+        set_sock_timeout(conn->client.sock, 2000);
+        ASSERT(mg_read(conn, buf, sizeof(buf)) == 2);
+        ASSERT(monotonic_seconds() - start < 0.25);
+        mg_close_connection(conn);
+        mg_stop(ctx);
+    }
+
+    remove("sendfile.bin");
+    remove("sendfile.cgi");
+    remove("keepalive.cgi");
+}
+#endif
+
+/* Returns the body of uri, which the caller frees, or NULL on error */
+static char *fetch_cached(const char *uri, const char *range, int *size) {
+    char ebuf[100];
+    struct mg_connection *conn;
+    char *data;
+
+    if ((conn = mg_download("localhost", atoi(HTTP_PORT), 0, ebuf,
+                            sizeof(ebuf), "GET %s HTTP/1.0\r\n%s\r\n", uri,
+                            range)) == NULL) {
+        return NULL;
+    }
+    data = read_conn(conn, size);
+    mg_close_connection(conn);
+    return data;
+}
+
+static void write_test_file(const char *path, int c, int size) {
+    FILE *fp;
+
+    ASSERT((fp = fopen(path, "wb")) != NULL);
+    while (size-- > 0) {
+        fputc(c, fp);
+    }
+    fclose(fp);
+}
+
+static void test_file_cache(void) {
+    static const char *options[] = {
+        "listening_ports", HTTP_PORT, "document_root", ".",
+        "file_cache_size", "16000", "file_cache_max_file_size", "800",
+        "file_cache_revalidate_ms", "100", NULL
+    };
+    struct mg_file_cache_stats stats;
+    struct mg_context *ctx;
+    char name[32], other[32], uri[32], *data;
+    int i, size;
+
+    /* Two files of the same shard, which only holds one of them */
+    snprintf(name, sizeof(name), "fc0.txt");
+    for (i = 1; i < 1000; i++) {
+        snprintf(other, sizeof(other), "./fc%d.txt", i);
+        if (hash_path(other, strlen(other)) % FILE_CACHE_SHARDS ==
+            hash_path("./fc0.txt", 9) % FILE_CACHE_SHARDS) {
+            break;
+        }
+    }
+    ASSERT(i < 1000);
+    write_test_file(name, 'a', 600);
+    write_test_file(other + 2, 'b', 600);
+    write_test_file("fc_big.txt", 'c', 900);
+    (void) mkdir("fc_dir", 0755);
+    write_test_file("fc_dir/index.html", 'i', 500);
+
+    ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+    ASSERT(mg_get_file_cache_stats(ctx, &stats) == 1);
+    ASSERT(stats.hits == 0 && stats.misses == 0 && stats.files == 0);
+
+    /* Read once, then served from memory, ranges included */
+    for (i = 0; i < 3; i++) {
+        data = fetch_cached("/fc0.txt", "", &size);
+        ASSERT(data != NULL && size == 600 && data[0] == 'a' &&
+               data[599] == 'a');
+        mg_free(data);
+    }
+    data = fetch_cached("/fc0.txt", "Range: bytes=100-199\r\n", &size);
+    ASSERT(data != NULL && size == 100 && data[0] == 'a');
+    mg_free(data);
+    ASSERT(mg_get_file_cache_stats(ctx, &stats) == 1);
+    ASSERT(stats.hits == 3 && stats.misses == 1);
+    ASSERT(stats.files == 1 && stats.bytes == 600 && stats.evictions == 0);
+
+    /* Too large to be cached */
+    data = fetch_cached("/fc_big.txt", "", &size);
+    ASSERT(data != NULL && size == 900 && data[899] == 'c');
+    mg_free(data);
+    ASSERT(mg_get_file_cache_stats(ctx, &stats) == 1);
+    ASSERT(stats.misses == 2 && stats.files == 1);
+
+    /* The other file of the shard takes the place of the first one */
+    snprintf(uri, sizeof(uri), "%s", other + 1);
+    data = fetch_cached(uri, "", &size);
+    ASSERT(data != NULL && size == 600 && data[0] == 'b');
+    mg_free(data);
+    ASSERT(mg_get_file_cache_stats(ctx, &stats) == 1);
+    ASSERT(stats.misses == 3 && stats.evictions == 1 && stats.files == 1);
+
+    /* A modified file is read again once revalidated */
+    write_test_file(other + 2, 'd', 650);
+    mg_sleep(200);
+    data = fetch_cached(uri, "", &size);
+    ASSERT(data != NULL && size == 650 && data[0] == 'd');
+    mg_free(data);
+    ASSERT(mg_get_file_cache_stats(ctx, &stats) == 1);
+    ASSERT(stats.misses == 4 && stats.evictions == 1);
+    ASSERT(stats.files == 1 && stats.bytes == 650);
+
+    /* Directory index files are cached too */
+    for (i = 0; i < 3; i++) {
+        data = fetch_cached("/fc_dir/", "", &size);
+        ASSERT(data != NULL && size == 500 && data[0] == 'i');
+        mg_free(data);
+    }
+    ASSERT(mg_get_file_cache_stats(ctx, &stats) == 1);
+    ASSERT(stats.misses == 5 && stats.hits == 5);
+    mg_stop(ctx);
+
+    /* Disabled by default */
+    ASSERT((ctx = mg_start(NULL, NULL, OPTIONS)) != NULL);
+    ASSERT(mg_get_file_cache_stats(ctx, &stats) == 0);
+    mg_stop(ctx);
+
+    remove(name);
+    remove(other + 2);
+    remove("fc_big.txt");
+    remove("fc_dir/index.html");
+    rmdir("fc_dir");
+}
+
+/* Returns the value of header name in the reply to a GET of uri, or "" */
+static const char *reply_header(const char *uri, const char *headers,
+                                const char *name, char *value,
+                                size_t value_len) {
+    char ebuf[100];
+    struct mg_connection *conn;
+    const char *v;
+
+    value[0] = '\0';
+    if ((conn = mg_download("localhost", atoi(HTTP_PORT), 0, ebuf,
+                            sizeof(ebuf), "GET %s HTTP/1.0\r\n%s\r\n", uri,
+                            headers)) != NULL) {
+        if ((v = mg_get_header(conn, name)) != NULL) {
+            mg_strlcpy(value, v, value_len);
+        }
+        mg_close_connection(conn);
+    }
+    return value;
+}
+
+static void test_file_reply_headers(void) {
+    static const char *options[] = {
+        "listening_ports", HTTP_PORT, "document_root", ".",
+        "access_control_allow_origin", "*", "file_cache_size", "0", NULL
+    };
+    char origin[2000], value[2100], date[64];
+    struct mg_context *ctx;
+    time_t now;
+    int i;
+
+    write_test_file("headers.css", 'h', 12345);
+    memset(origin, 'o', sizeof(origin) - 1);
+    origin[sizeof(origin) - 1] = '\0';
+
+    /* Read from disk, then from the file cache */
+    for (i = 0; i < 2; i++) {
+        options[7] = i == 0 ? "0" : "1000000";
+        ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+        ASSERT(strcmp(reply_header("/headers.css", "", "Content-Length",
+                                   value, sizeof(value)), "12345") == 0);
+        ASSERT(strcmp(reply_header("/headers.css", "", "Content-Type",
+                                   value, sizeof(value)), "text/css") == 0);
+        ASSERT(strcmp(reply_header("/headers.css", "", "Connection",
+                                   value, sizeof(value)), "close") == 0);
+        ASSERT(strcmp(reply_header("/headers.css", "Range: bytes=10-19\r\n",
+                                   "Content-Range", value, sizeof(value)),
+                      "bytes 10-19/12345") == 0);
+        ASSERT(strcmp(reply_header("/headers.css", "Range: bytes=10-19\r\n",
+                                   "Content-Length", value, sizeof(value)),
+                      "10") == 0);
+        ASSERT(strcmp(reply_header("/headers.css", "Origin: x\r\n",
+                                   "Access-Control-Allow-Origin", value,
+                                   sizeof(value)), "*") == 0);
+        ASSERT(reply_header("/headers.css", "", "Etag", value,
+                            sizeof(value))[0] == '"');
+        now = time(NULL);
+        gmt_time_string(date, sizeof(date), &now);
+        reply_header("/headers.css", "", "Date", value, sizeof(value));
+        ASSERT(strcmp(value, date) == 0 || time(NULL) != now);
+        mg_stop(ctx);
+    }
+
+    /* Headers too long for the reply buffer go out with mg_writev() */
+    options[5] = origin;
+    ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+    ASSERT(strcmp(reply_header("/headers.css", "Origin: x\r\n",
+                               "Access-Control-Allow-Origin", value,
+                               sizeof(value)), origin) == 0);
+    ASSERT(strcmp(reply_header("/headers.css", "Origin: x\r\n",
+                               "Accept-Ranges", value, sizeof(value)),
+                  "bytes") == 0);
+    mg_stop(ctx);
+    options[5] = "*";
+
+    remove("headers.css");
+}
+
+#if defined(HAVE_INOTIFY)
+static int is_stat_cached(struct mg_context *ctx, const char *path) {
+    unsigned hash = hash_path(path, strlen(path));
+    struct stat_cache_shard *shard = stat_cache_shard(ctx->stat_cache, hash);
+    struct stat_cache_entry *e;
+    int found = 0;
+
+    (void) pthread_mutex_lock(&shard->mutex);
+    for (e = *stat_cache_bucket(shard, hash); e != NULL; e = e->next) {
+        found |= !strcmp(e->path, path);
+    }
+    (void) pthread_mutex_unlock(&shard->mutex);
+    return found;
+}
+
+/* Returns the size mg_stat() reports for path, -1 if it does not exist,
+   once it is expected within 2 seconds */
+static int64_t stat_size(struct mg_connection *conn, const char *path,
+                         int64_t expected) {
+    struct file file = STRUCT_FILE_INITIALIZER;
+    int64_t size = -1;
+    int i;
+
+    for (i = 0; i < 200 && size != expected; i++) {
+        if (i > 0) {
+            mg_sleep(10);
+        }
+        size = mg_stat(conn, path, &file) ? file.size : -1;
+    }
+    return size;
+}
+
+/* Returns whether a stat() of path gets cached within 2 seconds: events
+   coming in meanwhile may keep it from being cached */
+static int becomes_cached(struct mg_connection *conn, const char *path) {
+    struct file file = STRUCT_FILE_INITIALIZER;
+    int i;
+
+    for (i = 0; i < 200 && !is_stat_cached(conn->ctx, path); i++) {
+        mg_sleep(i > 0 ? 10 : 0);
+        (void) mg_stat(conn, path, &file);
+    }
+    return is_stat_cached(conn->ctx, path);
+}
+
+static int is_watched(struct mg_context *ctx, const char *path) {
+    struct stat_cache *sc = ctx->stat_cache;
+    int i, watched = 0;
+
+    for (i = 0; i < 200 && !watched; i++) {
+        mg_sleep(i > 0 ? 10 : 0);
+        (void) pthread_mutex_lock(&sc->dirs_mutex);
+        watched = find_watched_dir(sc, path, strlen(path)) != NULL;
+        (void) pthread_mutex_unlock(&sc->dirs_mutex);
+    }
+    return watched;
+}
+
+static void test_stat_cache(void) {
+    static const char *options[] = {
+        "listening_ports", HTTP_PORT, "document_root", "sc_root/",
+        "enable_stat_cache", "yes", NULL
+    };
+    struct mg_connection conn;
+    struct mg_context *ctx;
+    char *data;
+    FILE *fp;
+    int size;
+
+    (void) mkdir("sc_root", 0755);
+    (void) mkdir("sc_root/sub", 0755);
+    write_test_file("sc_root/a.txt", 'a', 5);
+    write_test_file("sc_root/sub/d.txt", 'd', 2);
+    write_test_file("sc_target.txt", 't', 3);
+    (void) symlink("../sc_target.txt", "sc_root/link.txt");
+
+    ASSERT((ctx = mg_start(NULL, NULL, options)) != NULL);
+    ASSERT(ctx->stat_cache != NULL);
+    ASSERT(is_watched(ctx, "sc_root"));
+    ASSERT(is_watched(ctx, "sc_root/sub"));
+    memset(&conn, 0, sizeof(conn));
+    conn.ctx = ctx;
+
+    /* Cached after the first stat(), then updated when written */
+    ASSERT(stat_size(&conn, "sc_root/a.txt", 5) == 5);
+    ASSERT(becomes_cached(&conn, "sc_root/a.txt"));
+    ASSERT((fp = fopen("sc_root/a.txt", "ab")) != NULL);
+    fputs("bb", fp);
+    fclose(fp);
+    ASSERT(stat_size(&conn, "sc_root/a.txt", 7) == 7);
+
+    /* Missing paths are cached too, until created */
+    ASSERT(stat_size(&conn, "sc_root/sub/b.txt", -1) == -1);
+    ASSERT(becomes_cached(&conn, "sc_root/sub/b.txt"));
+    write_test_file("sc_root/sub/b.txt", 'b', 4);
+    ASSERT(stat_size(&conn, "sc_root/sub/b.txt", 4) == 4);
+    remove("sc_root/sub/b.txt");
+    ASSERT(stat_size(&conn, "sc_root/sub/b.txt", -1) == -1);
+
+    /* New directories are watched */
+    (void) mkdir("sc_root/new", 0755);
+    ASSERT(is_watched(ctx, "sc_root/new"));
+    ASSERT(stat_size(&conn, "sc_root/new/c.txt", -1) == -1);
+    write_test_file("sc_root/new/c.txt", 'c', 6);
+    ASSERT(stat_size(&conn, "sc_root/new/c.txt", 6) == 6);
+
+    /* Nor the paths out of the tree, or behind symbolic links */
+    ASSERT(stat_size(&conn, "sc_target.txt", 3) == 3);
+    ASSERT(!is_stat_cached(ctx, "sc_target.txt"));
+    ASSERT(stat_size(&conn, "sc_root/link.txt", 3) == 3);
+    ASSERT(!is_stat_cached(ctx, "sc_root/link.txt"));
+    ASSERT(stat_size(&conn, "sc_root/sub/../a.txt", 7) == 7);
+    ASSERT(!is_stat_cached(ctx, "sc_root/sub/../a.txt"));
+
+    /* Requests go through it, the document root ends with a slash */
+    ASSERT(!is_stat_cached(ctx, "sc_root/sub/d.txt"));
+    data = fetch_cached("/sub/d.txt", "", &size);
+    ASSERT(data != NULL && size == 2 && data[0] == 'd');
+    mg_free(data);
+    ASSERT(is_stat_cached(ctx, "sc_root/sub/d.txt"));
+
+    /* Removing a directory clears the cache */
+    remove("sc_root/new/c.txt");
+    (void) rmdir("sc_root/new");
+    ASSERT(stat_size(&conn, "sc_root/new/c.txt", -1) == -1);
+    mg_stop(ctx);
+
+    remove("sc_root/a.txt");
+    remove("sc_root/sub/d.txt");
+    remove("sc_root/link.txt");
+    remove("sc_target.txt");
+    (void) rmdir("sc_root/sub");
+    (void) rmdir("sc_root");
+}
+#endif
+#endif
+
 static void test_url_decode(void) {
     char buf[100];
 
@@ -777,6 +2229,52 @@ static void test_strtoll(void) {
     ASSERT(strtoll("3566626116", NULL, 10) == 3566626116);
 }
 
+static void test_gmt_time_string(void) {
+    static const time_t times[] = {
+        0, 1, 59, 86399, 86400, 951782399, 951782400, 951868800,
+        1234567890, 2147483647, 4102444799, -1, -86401, -2208988800
+    };
+    struct mg_connection conn;
+    char buf[64], expected[64], digits[24], *p;
+    struct tm *tm;
+    time_t t;
+    size_t i;
+    int fails = 0;
+
+    /* strftime() in the default C locale is the reference */
+    for (i = 0; i < ARRAY_SIZE(times); i++) {
+        t = times[i];
+        if ((tm = gmtime(&t)) != NULL) {
+            strftime(expected, sizeof(expected), "%a, %d %b %Y %H:%M:%S GMT", tm);
+            gmt_time_string(buf, sizeof(buf), &t);
+            ASSERT(strcmp(buf, expected) == 0);
+        }
+    }
+    for (t = -86400 * 365; t < (time_t) 86400 * 365 * 200; t += 86400 * 7 + 3601) {
+        tm = gmtime(&t);
+        strftime(expected, sizeof(expected), "%a, %d %b %Y %H:%M:%S GMT", tm);
+        gmt_time_string(buf, sizeof(buf), &t);
+        fails += strcmp(buf, expected) != 0;
+    }
+    ASSERT(fails == 0);
+    t = 1234567890;
+    gmt_time_string(buf, 6, &t);
+    ASSERT(strcmp(buf, "Fri, ") == 0);
+
+    memset(&conn, 0, sizeof(conn));
+    t = time(NULL);
+    gmt_time_string(expected, sizeof(expected), &t);
+    p = (char *) current_date(&conn);
+    ASSERT(strcmp(p, expected) == 0 || conn.date_time != t);
+    ASSERT(current_date(&conn) == p);
+
+    p = int64_digits(digits + sizeof(digits) - 1, 0);
+    digits[sizeof(digits) - 1] = '\0';
+    ASSERT(strcmp(p, "0") == 0);
+    p = int64_digits(digits + sizeof(digits) - 1, 9223372036854775807LL);
+    ASSERT(strcmp(p, "9223372036854775807") == 0);
+}
+
 static void test_parse_port_string(void) {
     static const char *valid[] = {
         "0", "1", "1s", "1r", "1.2.3.4:1", "1.2.3.4:1s", "1.2.3.4:1r",
@@ -841,15 +2339,20 @@ int __cdecl main(void) {
     test_match_prefix();
     test_remove_double_dots();
     test_should_keep_alive();
+    test_scan_request();
     test_parse_http_message();
+    test_parse_http_headers();
+    test_header_index();
     test_mg_get_var();
     test_set_throttle();
     test_next_option();
+    test_mime_types();
     test_mg_stat();
     test_skip_quoted();
     test_url_decode();
     test_mg_get_cookie();
     test_strtoll();
+    test_gmt_time_string();
 
     /* start stop server */
     ctx = mg_start(NULL, NULL, OPTIONS);
@@ -865,6 +2368,38 @@ int __cdecl main(void) {
     test_mg_upload();
     test_request_replies();
     test_api_calls();
+    test_mg_writev();
+    test_file_cache();
+    test_file_reply_headers();
+#if defined(HAVE_INOTIFY)
+    test_stat_cache();
+#endif
+    test_mg_defer_request();
+    test_mg_resume_request();
+    test_socket_queue();
+#if defined(SO_REUSEPORT)
+    test_acceptors();
+#endif
+    test_shards();
+#if defined(USE_IPV6)
+    test_shard_of();
+#endif
+    test_elastic_pool();
+#if defined(__linux__)
+    test_fast_accept();
+    test_socket_tuning();
+#endif
+#if !defined(_WIN32)
+    test_graceful_restart();
+#if defined(SO_REUSEPORT)
+    test_restart_acceptors();
+#endif
+    test_send_file();
+#endif
+#if defined(HAVE_EPOLL)
+    test_idle_keep_alive();
+    test_idle_timeout();
+#endif
 
 #if defined(USE_LUA)
     test_lua();